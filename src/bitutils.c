@@ -4,19 +4,39 @@
 
 #include "./bitutils.h"
 
-#define BIN_BITS 32
 #define MAX_BITS_PER_COUNTER 32
 
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define BITUTILS_X86
+#endif
+
 #define GEN_BITS_RANGE(l ,r) (((1UL << ((l) - 1)) - 1) ^ ((1UL << (r)) - 1))
 
 /**
- * Init a CounterBitSet.
+ * Init a CounterBitSet with the packed layout.
+ * 
+ * counters: pointer to a CounterBitSet
+ * size: number of counters
+ * bits_per_counter: value from 1 -- 32
+*/
+void init_counters(CounterBitSet *counters, uint64 size, int bits_per_counter)
+{
+    init_counters_with_layout(counters, size, bits_per_counter, LAYOUT_PACKED);
+}
+
+/**
+ * Init a CounterBitSet. The bins are cache-line aligned so that a block of
+ * CACHE_LINE_BYTES bytes starting at a multiple of 16 bins never spans two lines.
+ * LAYOUT_PADDED never lets a counter span two bins, at the cost of the unused tail
+ * bits of each bin (see counters_overhead).
  * 
  * counters: pointer to a CounterBitSet
  * size: number of counters
  * bits_per_counter: value from 1 -- 32
+ * layout: LAYOUT_PACKED or LAYOUT_PADDED
 */
-void init_counters(CounterBitSet *counters, int size, int bits_per_counter)
+void init_counters_with_layout(CounterBitSet *counters, uint64 size, int bits_per_counter, CounterLayout layout)
 {
     if (bits_per_counter > MAX_BITS_PER_COUNTER)
     {
@@ -24,26 +44,61 @@ void init_counters(CounterBitSet *counters, int size, int bits_per_counter)
         exit(1);
     }
 
-    int bins = (size * bits_per_counter + BIN_BITS - 1) / BIN_BITS;
-    uint32 *data = (uint32 *) malloc(bins * sizeof(uint32));
-    memset(data, 0, bins * sizeof(uint32));
+    uint64 bins;
+    int counters_per_bin = BIN_BITS / bits_per_counter;
+    if (layout == LAYOUT_PADDED)
+    {
+        bins = (size + counters_per_bin - 1) / counters_per_bin;
+    }
+    else
+    {
+        bins = (size * bits_per_counter + BIN_BITS - 1) / BIN_BITS;
+    }
+    size_t bytes = (bins * sizeof(uint32) + CACHE_LINE_BYTES - 1) / CACHE_LINE_BYTES * CACHE_LINE_BYTES;
+    uint32 *data = (uint32 *) aligned_alloc(CACHE_LINE_BYTES, bytes);
     if (data == NULL)
     {
-        printf("Memory allocation fail for %d bytes.\n", bins);
+        printf("Memory allocation fail for %zu bytes.\n", bytes);
         exit(1);
     }
+    memset(data, 0, bytes);
     counters->raw_bits = data;
     counters->size = size;
     counters->bits_per_counter = bits_per_counter;
     counters->num_bins = bins;
+    counters->layout = layout;
+    counters->counters_per_bin = counters_per_bin;
+    counters->zero_count = size;
+    counters->borrowed = 0;
+}
+
+/**
+ * Fraction of allocated bin bits that do not hold counter bits.
+ * 
+ * counters: pointer to CounterBitSet
+*/
+float counters_overhead(CounterBitSet *counters)
+{
+    double used = (double)counters->size * counters->bits_per_counter;
+    return ((double)counters->num_bins * BIN_BITS - used) / used;
+}
+
+/**
+ * Locate bin idx and right shift of i-th counter in the padded layout.
+ * The first counter of a bin occupies its most significant bits, as in the packed layout.
+*/
+static inline void get_padded_slot(CounterBitSet *counters, uint64 idx, uint64 *bin, int *shift)
+{
+    *bin = idx / counters->counters_per_bin;
+    *shift = BIN_BITS - (idx % counters->counters_per_bin + 1) * counters->bits_per_counter;
 }
 
 /**
  * Locate bin idx and bit idx given i-th counter.
 */
-void get_bin_range(CounterBitSet *counters, int idx, int *bin_start, int *bin_end, int *bit_start, int *bit_end)
+void get_bin_range(CounterBitSet *counters, uint64 idx, uint64 *bin_start, uint64 *bin_end, int *bit_start, int *bit_end)
 {
-    int s = counters->bits_per_counter * idx;
+    uint64 s = counters->bits_per_counter * idx;
     *bin_start = s >> 5;
     *bin_end = (s + counters->bits_per_counter - 1) >> 5;
     *bit_start = BIN_BITS - s % BIN_BITS;
@@ -56,9 +111,18 @@ void get_bin_range(CounterBitSet *counters, int idx, int *bin_start, int *bin_en
  * counters: pointer to CounterBitSet
  * idx: index of a queried counter
 */
-int test_counter(CounterBitSet *counters, int idx)
+int test_counter(CounterBitSet *counters, uint64 idx)
 {
-    int bin_start = 0, bin_end = 0, bit_start = 0, bit_end = 0;
+    if (counters->layout == LAYOUT_PADDED)
+    {
+        uint64 bin = 0;
+        int shift = 0;
+        get_padded_slot(counters, idx, &bin, &shift);
+        return (counters->raw_bits[bin] & (COUNTER_MASK(counters->bits_per_counter) << shift)) != 0;
+    }
+
+    uint64 bin_start = 0, bin_end = 0;
+    int bit_start = 0, bit_end = 0;
     get_bin_range(counters, idx, &bin_start, &bin_end, &bit_start, &bit_end);
 
     if (bin_start == bin_end)
@@ -72,9 +136,18 @@ int test_counter(CounterBitSet *counters, int idx)
     }
 }
 
-int get_counter(CounterBitSet *counters, int idx)
+int get_counter(CounterBitSet *counters, uint64 idx)
 {
-    int bin_start = 0, bin_end = 0, bit_start = 0, bit_end = 0;
+    if (counters->layout == LAYOUT_PADDED)
+    {
+        uint64 bin = 0;
+        int shift = 0;
+        get_padded_slot(counters, idx, &bin, &shift);
+        return (counters->raw_bits[bin] >> shift) & COUNTER_MASK(counters->bits_per_counter);
+    }
+
+    uint64 bin_start = 0, bin_end = 0;
+    int bit_start = 0, bit_end = 0;
     get_bin_range(counters, idx, &bin_start, &bin_end, &bit_start, &bit_end);
 
     if (bin_start == bin_end)
@@ -90,35 +163,529 @@ int get_counter(CounterBitSet *counters, int idx)
 
 
 /**
- * [REQUIRE FURTHER OPTIMIZED] Decrement i-th counter by 1.
+ * Decrement i-th counter by 1 if it is non-zero. A packed counter spanning two bins is
+ * handled as one field of a 64-bit window over both bins, so no borrow or carry has to be
+ * moved between bins by hand.
  * 
  * counters: pointer to CounterBitSet
  * idx: index of a counter to be decremented
 */
-void decrement(CounterBitSet *counters, int idx)
+void decrement(CounterBitSet *counters, uint64 idx)
 {
-    int bin_start = 0, bin_end = 0, bit_start = 0, bit_end = 0;
-    get_bin_range(counters, idx, &bin_start, &bin_end, &bit_start, &bit_end);
+    uint32 mask = COUNTER_MASK(counters->bits_per_counter);
+    if (counters->layout == LAYOUT_PADDED)
+    {
+        uint64 bin = 0;
+        int shift = 0;
+        get_padded_slot(counters, idx, &bin, &shift);
+        // a non-zero counter can be decremented in place without borrowing from its neighbour
+        uint32 value = counters->raw_bits[bin] & (mask << shift);
+        if (value)
+        {
+            counters->raw_bits[bin] -= 1U << shift;
+            counters->zero_count += value == 1U << shift;
+        }
+        return;
+    }
 
-    // decrement the counter if is non-zero
-    if (test_counter(counters, idx))
+    uint64 s = counters->bits_per_counter * idx;
+    uint64 bin = s / BIN_BITS;
+    int offset = s % BIN_BITS;
+    if (offset + counters->bits_per_counter <= BIN_BITS)
     {
-        int temp = get_counter(counters, idx) - 1;
-        if (bin_start == bin_end)
+        int shift = BIN_BITS - offset - counters->bits_per_counter;
+        uint32 value = counters->raw_bits[bin] & (mask << shift);
+        if (value)
         {
-            counters->raw_bits[bin_start] &= ~GEN_BITS_RANGE(bit_end, bit_start);
-            counters->raw_bits[bin_start] |= (temp << (bit_end - 1));
+            counters->raw_bits[bin] -= 1U << shift;
+            counters->zero_count += value == 1U << shift;
         }
-        else
+        return;
+    }
+
+    uint64 window = (uint64)counters->raw_bits[bin] << BIN_BITS | counters->raw_bits[bin + 1];
+    int shift = 2 * BIN_BITS - offset - counters->bits_per_counter;
+    uint64 value = window & ((uint64)mask << shift);
+    if (value)
+    {
+        counters->zero_count += value == 1ULL << shift;
+        window -= 1ULL << shift;
+        counters->raw_bits[bin] = window >> BIN_BITS;
+        counters->raw_bits[bin + 1] = (uint32)window;
+    }
+}
+
+
+/**
+ * Top bit of every non-zero lane of a word (SIMD within a register). Adding 2^(W-1)-1 to
+ * the low W-1 bits of a lane carries into its top bit iff those bits are non-zero.
+ * 
+ * x: word value
+ * rest: low W-1 bits of every lane
+ * high: top bit of every lane
+*/
+static inline uint32 swar_nonzero(uint32 x, uint32 rest, uint32 high)
+{
+    return (((x & rest) + rest) | x) & high;
+}
+
+static inline uint64 swar_nonzero64(uint64 x, uint64 rest, uint64 high)
+{
+    return (((x & rest) + rest) | x) & high;
+}
+
+/**
+ * Decrement every non-zero lane of a word by 1. Only non-zero lanes are decremented, so no
+ * lane borrows from its neighbour. Lanes holding 1 (those whose lowest bit flip leaves them
+ * zero) become zero and are added to zeros.
+ * 
+ * x: word value
+ * low: lowest bit of every lane to be decremented
+ * W: lane width (bits per counter)
+ * zeros: counter of lanes reaching zero
+*/
+static inline uint32 swar_decrement(uint32 x, uint32 low, int W, uint64 *zeros)
+{
+    uint32 high = low << (W - 1);
+    uint32 rest = (low * COUNTER_MASK(W)) & ~high;
+    *zeros += __builtin_popcount(high & ~swar_nonzero(x ^ low, rest, high));
+    return x - (swar_nonzero(x, rest, high) >> (W - 1));
+}
+
+static inline uint64 swar_decrement64(uint64 x, uint64 low, int W, uint64 *zeros)
+{
+    uint64 high = low << (W - 1);
+    uint64 rest = (low * COUNTER_MASK(W)) & ~high;
+    *zeros += __builtin_popcountll(high & ~swar_nonzero64(x ^ low, rest, high));
+    return x - (swar_nonzero64(x, rest, high) >> (W - 1));
+}
+
+typedef uint64 (*SweepKernel)(uint32 *bins, uint64 num_bins, uint32 low, int W);
+typedef uint64 (*CountKernel)(const uint32 *bins, uint64 num_bins, uint32 low, int W);
+
+static uint64 sweep_bins_scalar(uint32 *bins, uint64 num_bins, uint32 low, int W)
+{
+    uint64 zeros = 0;
+    for (uint64 i=0; i<num_bins; ++i)
+    {
+        bins[i] = swar_decrement(bins[i], low, W, &zeros);
+    }
+    return zeros;
+}
+
+static uint64 count_nonzero_scalar(const uint32 *bins, uint64 num_bins, uint32 low, int W)
+{
+    uint32 high = low << (W - 1);
+    uint32 rest = (low * COUNTER_MASK(W)) & ~high;
+    uint64 nonzero = 0;
+    for (uint64 i=0; i<num_bins; ++i)
+    {
+        nonzero += __builtin_popcount(swar_nonzero(bins[i], rest, high));
+    }
+    return nonzero;
+}
+
+#ifdef BITUTILS_X86
+
+__attribute__((target("avx2")))
+static inline __m256i swar_nonzero_avx2(__m256i x, __m256i rest, __m256i high)
+{
+    return _mm256_and_si256(_mm256_or_si256(_mm256_add_epi32(_mm256_and_si256(x, rest), rest), x), high);
+}
+
+/**
+ * Per 64-bit lane popcount of v, added to acc (nibble lookup table, then byte sums).
+*/
+__attribute__((target("avx2")))
+static inline __m256i popcount_add_avx2(__m256i acc, __m256i v)
+{
+    const __m256i table = _mm256_setr_epi8(0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4,
+                                           0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4);
+    const __m256i nibble = _mm256_set1_epi8(0x0f);
+    __m256i count = _mm256_add_epi8(_mm256_shuffle_epi8(table, _mm256_and_si256(v, nibble)),
+                                    _mm256_shuffle_epi8(table, _mm256_and_si256(_mm256_srli_epi16(v, 4), nibble)));
+    return _mm256_add_epi64(acc, _mm256_sad_epu8(count, _mm256_setzero_si256()));
+}
+
+__attribute__((target("avx2")))
+static inline uint64 horizontal_sum_avx2(__m256i acc)
+{
+    uint64 lanes[4];
+    _mm256_storeu_si256((__m256i *)lanes, acc);
+    return lanes[0] + lanes[1] + lanes[2] + lanes[3];
+}
+
+/**
+ * swar_decrement on 8 bins per instruction.
+*/
+__attribute__((target("avx2")))
+static uint64 sweep_bins_avx2(uint32 *bins, uint64 num_bins, uint32 low, int W)
+{
+    uint32 high = low << (W - 1);
+    uint32 rest = (low * COUNTER_MASK(W)) & ~high;
+    __m256i low_v = _mm256_set1_epi32((int)low);
+    __m256i high_v = _mm256_set1_epi32((int)high);
+    __m256i rest_v = _mm256_set1_epi32((int)rest);
+    __m128i shift = _mm_cvtsi32_si128(W - 1);
+    __m256i zeros = _mm256_setzero_si256();
+    uint64 i = 0;
+    for (; i + 8 <= num_bins; i += 8)
+    {
+        __m256i x = _mm256_loadu_si256((__m256i *)(bins + i));
+        __m256i ones = _mm256_andnot_si256(swar_nonzero_avx2(_mm256_xor_si256(x, low_v), rest_v, high_v), high_v);
+        zeros = popcount_add_avx2(zeros, ones);
+        x = _mm256_sub_epi32(x, _mm256_srl_epi32(swar_nonzero_avx2(x, rest_v, high_v), shift));
+        _mm256_storeu_si256((__m256i *)(bins + i), x);
+    }
+    return horizontal_sum_avx2(zeros) + sweep_bins_scalar(bins + i, num_bins - i, low, W);
+}
+
+/**
+ * count_nonzero_scalar on 8 bins per instruction.
+*/
+__attribute__((target("avx2")))
+static uint64 count_nonzero_avx2(const uint32 *bins, uint64 num_bins, uint32 low, int W)
+{
+    uint32 high = low << (W - 1);
+    uint32 rest = (low * COUNTER_MASK(W)) & ~high;
+    __m256i high_v = _mm256_set1_epi32((int)high);
+    __m256i rest_v = _mm256_set1_epi32((int)rest);
+    __m256i nonzero = _mm256_setzero_si256();
+    uint64 i = 0;
+    for (; i + 8 <= num_bins; i += 8)
+    {
+        __m256i x = _mm256_loadu_si256((const __m256i *)(bins + i));
+        nonzero = popcount_add_avx2(nonzero, swar_nonzero_avx2(x, rest_v, high_v));
+    }
+    return horizontal_sum_avx2(nonzero) + count_nonzero_scalar(bins + i, num_bins - i, low, W);
+}
+
+#endif
+
+static SweepKernel sweep_kernel = NULL;
+static CountKernel count_kernel = NULL;
+
+/**
+ * Pick the bulk kernels, AVX2 when the CPU supports it.
+*/
+static void select_bulk_kernels()
+{
+    sweep_kernel = sweep_bins_scalar;
+    count_kernel = count_nonzero_scalar;
+#ifdef BITUTILS_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2"))
+    {
+        sweep_kernel = sweep_bins_avx2;
+        count_kernel = count_nonzero_avx2;
+    }
+#endif
+}
+
+/**
+ * Decrement the lanes given by low in num_bins consecutive bins. Returns the number of
+ * lanes reaching zero.
+*/
+static uint64 sweep_bins(uint32 *bins, uint64 num_bins, uint32 low, int W)
+{
+    if (sweep_kernel == NULL)
+    {
+        select_bulk_kernels();
+    }
+    return sweep_kernel(bins, num_bins, low, W);
+}
+
+/**
+ * Number of non-zero lanes given by low in num_bins consecutive bins.
+*/
+static uint64 count_nonzero_bins(const uint32 *bins, uint64 num_bins, uint32 low, int W)
+{
+    if (count_kernel == NULL)
+    {
+        select_bulk_kernels();
+    }
+    return count_kernel(bins, num_bins, low, W);
+}
+
+/**
+ * Lowest bits of lanes j0 .. j1-1 of a bin, all_low holding those of every lane.
+*/
+static inline uint32 bin_lanes(uint32 all_low, int j0, int j1, int W)
+{
+    // lane j occupies bits [32 - (j + 1) * W, 32 - j * W)
+    uint32 upper = j0 ? (1U << (BIN_BITS - j0 * W)) - 1 : ~0U;
+    uint32 lower = (1U << (BIN_BITS - j1 * W)) - 1;
+    return all_low & upper & ~lower;
+}
+
+/**
+ * Lowest bit of every counter of a bin of word-aligned counters, counter j sits at bit
+ * 32 - (j + 1) * W.
+*/
+static inline uint32 all_lanes(int per_bin, int W)
+{
+    uint32 all_low = 0;
+    for (int j=0; j<per_bin; ++j)
+    {
+        all_low |= 1U << (BIN_BITS - (j + 1) * W);
+    }
+    return all_low;
+}
+
+/**
+ * Decrement lanes j0 .. j1-1 of a bin of word-aligned counters.
+*/
+static inline void decrement_bin_lanes(CounterBitSet *counters, uint64 bin, int j0, int j1, uint32 all_low)
+{
+    int W = counters->bits_per_counter;
+    counters->raw_bits[bin] = swar_decrement(counters->raw_bits[bin], bin_lanes(all_low, j0, j1, W), W, &(counters->zero_count));
+}
+
+/**
+ * Decrement packed counters [start, end) floor(33 / W) at a time, each chunk in a 64-bit
+ * window over the (at most two) bins it occupies.
+*/
+static void decrement_chunks(CounterBitSet *counters, uint64 start, uint64 end)
+{
+    int W = counters->bits_per_counter;
+    // any chunk of this many counters fits in a 64-bit window whatever its offset
+    int chunk = (BIN_BITS + 1) / W;
+    uint64 pattern = 0;
+    for (int k=0; k<chunk; ++k)
+    {
+        pattern |= 1ULL << (k * W);
+    }
+    for (uint64 c=start; c<end; c+=chunk)
+    {
+        int n = end - c < (uint64)chunk ? (int)(end - c) : chunk;
+        uint64 s = c * W;
+        uint64 bin = s / BIN_BITS;
+        int offset = s % BIN_BITS;
+        int two_bins = offset + n * W > BIN_BITS;
+        uint64 low = (pattern & ((1ULL << (n * W)) - 1)) << (2 * BIN_BITS - offset - n * W);
+        uint64 window = (uint64)counters->raw_bits[bin] << BIN_BITS | (two_bins ? counters->raw_bits[bin + 1] : 0);
+        window = swar_decrement64(window, low, W, &(counters->zero_count));
+        counters->raw_bits[bin] = window >> BIN_BITS;
+        if (two_bins)
+        {
+            counters->raw_bits[bin + 1] = (uint32)window;
+        }
+    }
+}
+
+/**
+ * Decrement every counter starting in bins [bin_lo, bin_hi) of a packed set whose width
+ * does not divide 32. Each bin is decremented in a 64-bit window over it and the next one,
+ * so counters running into the next bin are whole. Windows are computed from the original
+ * bins and the part of a counter spilling into the next bin is merged into it afterwards,
+ * so consecutive steps do not wait on each other. Lane masks only depend on the offset of
+ * the first counter in the bin, which cycles with period W. bin_hi must be below num_bins.
+*/
+static void sweep_straddling_bins(CounterBitSet *counters, uint64 bin_lo, uint64 bin_hi)
+{
+    int W = counters->bits_per_counter;
+    uint64 lows[MAX_BITS_PER_COUNTER], rest[MAX_BITS_PER_COUNTER], high[MAX_BITS_PER_COUNTER];
+    uint32 spill[MAX_BITS_PER_COUNTER];
+    for (int o=0; o<W; ++o)
+    {
+        // first counter starts o bits into the bin, the o bits before belong to the previous one
+        uint64 low = 0;
+        for (int start_bit=o; start_bit<BIN_BITS; start_bit+=W)
+        {
+            low |= 1ULL << (2 * BIN_BITS - start_bit - W);
+        }
+        lows[o] = low;
+        high[o] = low << (W - 1);
+        rest[o] = (low * COUNTER_MASK(W)) & ~high[o];
+        spill[o] = o ? ~0U << (BIN_BITS - o) : 0;
+    }
+
+    uint32 *bins = counters->raw_bits;
+    uint64 zeros = 0;
+    int step = BIN_BITS % W;
+    int phase = (bin_lo * BIN_BITS) % W; // bits of the bin's first bit into its counter
+    uint32 carry = bins[bin_lo];          // bin as left by the previous window
+    for (uint64 b=bin_lo; b<bin_hi; ++b)
+    {
+        int o = phase ? W - phase : 0;
+        uint64 x = (uint64)bins[b] << BIN_BITS | bins[b + 1];
+        zeros += __builtin_popcountll(high[o] & ~swar_nonzero64(x ^ lows[o], rest[o], high[o]));
+        x -= swar_nonzero64(x, rest[o], high[o]) >> (W - 1);
+        bins[b] = ((uint32)(x >> BIN_BITS) & ~spill[o]) | (carry & spill[o]);
+        carry = (uint32)x;
+        phase += step;
+        phase = phase >= W ? phase - W : phase;
+    }
+    int o = phase ? W - phase : 0;
+    bins[bin_hi] = (bins[bin_hi] & ~spill[o]) | (carry & spill[o]);
+    counters->zero_count += zeros;
+}
+
+/**
+ * Decrement counters [start, start + count) by 1 each, leaving zero counters at zero.
+ * Usable both for the contiguous SBF decrement and for sweeps over the whole set.
+ * When counters never span two bins (LAYOUT_PADDED or bits_per_counter dividing 32), full
+ * bins are swept with one SWAR decrement per bin (8 bins at a time with AVX2). Other packed
+ * widths are swept one bin per step in a 64-bit window over the bin and the next one, the
+ * partial bins at both ends chunk by chunk.
+ * 
+ * counters: pointer to CounterBitSet
+ * start: index of the first counter
+ * count: number of counters, start + count must not exceed the size
+*/
+void decrement_range(CounterBitSet *counters, uint64 start, uint64 count)
+{
+    int W = counters->bits_per_counter;
+    uint64 end = start + count;
+    if (count == 0)
+    {
+        return;
+    }
+
+    if (! counters_word_aligned(counters))
+    {
+        // bins whose counters (those starting in the bin) all lie in the range
+        uint64 bin_lo = (start * W + BIN_BITS - 1) / BIN_BITS;
+        uint64 bin_hi = end * W / BIN_BITS;
+        bin_hi = bin_hi < counters->num_bins - 1 ? bin_hi : counters->num_bins - 1;
+        if (bin_lo >= bin_hi)
+        {
+            decrement_chunks(counters, start, end);
+            return;
+        }
+        uint64 first = (bin_lo * BIN_BITS + W - 1) / W;
+        uint64 last = (bin_hi * BIN_BITS + W - 1) / W;
+        decrement_chunks(counters, start, first);
+        sweep_straddling_bins(counters, bin_lo, bin_hi);
+        decrement_chunks(counters, last, end);
+        return;
+    }
+
+    int per_bin = counters->layout == LAYOUT_PADDED ? counters->counters_per_bin : BIN_BITS / W;
+    uint32 all_low = all_lanes(per_bin, W);
+
+    uint64 first_bin = start / per_bin;
+    uint64 last_bin = (end - 1) / per_bin;
+    int j0 = start % per_bin;
+    int j1 = (end - 1) % per_bin + 1;
+    if (first_bin == last_bin)
+    {
+        decrement_bin_lanes(counters, first_bin, j0, j1, all_low);
+        return;
+    }
+    if (j0)
+    {
+        decrement_bin_lanes(counters, first_bin, j0, per_bin, all_low);
+        first_bin++;
+    }
+    if (j1 < per_bin)
+    {
+        decrement_bin_lanes(counters, last_bin, 0, j1, all_low);
+        last_bin--;
+    }
+    if (first_bin <= last_bin)
+    {
+        counters->zero_count += sweep_bins(counters->raw_bits + first_bin, last_bin - first_bin + 1, all_low, W);
+    }
+}
+
+/**
+ * Thread-safe decrement_range for word-aligned counters (see counters_word_aligned). Every
+ * bin gets the same SWAR decrement as decrement_range, committed with a compare-and-swap,
+ * so bits set concurrently by set_to_max_atomic are never lost.
+ * 
+ * counters: pointer to CounterBitSet
+ * start: index of the first counter
+ * count: number of counters, start + count must not exceed the size
+ * return: number of counters actually decremented, i.e. that were not zero
+*/
+uint64 decrement_range_atomic(CounterBitSet *counters, uint64 start, uint64 count)
+{
+    if (count == 0)
+    {
+        return 0;
+    }
+    int W = counters->bits_per_counter;
+    int per_bin = counters->layout == LAYOUT_PADDED ? counters->counters_per_bin : BIN_BITS / W;
+    uint32 all_low = all_lanes(per_bin, W);
+
+    uint64 end = start + count;
+    uint64 last_bin = (end - 1) / per_bin;
+    uint64 decremented = 0;
+    for (uint64 bin=start / per_bin; bin<=last_bin; ++bin)
+    {
+        uint64 first = bin * per_bin;
+        int j0 = start > first ? start - first : 0;
+        int j1 = end < first + per_bin ? end - first : per_bin;
+        uint32 low = bin_lanes(all_low, j0, j1, W);
+        uint32 old = __atomic_load_n(&(counters->raw_bits[bin]), __ATOMIC_RELAXED);
+        uint32 value;
+        uint64 zeros;
+        do
         {
-            counters->raw_bits[bin_start] &= ~GEN_BITS_RANGE(1, bit_start);
-            counters->raw_bits[bin_start] |= (temp >> (BIN_BITS - bit_end + 1));
-            counters->raw_bits[bin_end] &= ~GEN_BITS_RANGE(bit_end, BIN_BITS);
-            counters->raw_bits[bin_end] |= (temp << (bit_end - 1));
+            zeros = 0;
+            value = swar_decrement(old, low, W, &zeros);
+        } while (value != old && ! __atomic_compare_exchange_n(&(counters->raw_bits[bin]), &old, value, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+        if (zeros)
+        {
+            __atomic_fetch_add(&(counters->zero_count), zeros, __ATOMIC_RELAXED);
         }
+        // old is the value the decrement was applied to
+        uint32 high = low << (W - 1);
+        decremented += __builtin_popcount(swar_nonzero(old, (low * COUNTER_MASK(W)) & ~high, high));
     }
+    return decremented;
 }
 
+/**
+ * Recount the zero counters from scratch and reset the live zero count to the result.
+ * Each bin's non-zero lanes are found with the SWAR test of swar_nonzero and counted with
+ * popcount, 8 bins at a time with AVX2 for counters within one bin. Counters spanning two
+ * bins are tested in a 64-bit window over the bin they start in and the next one.
+ * Must not run concurrently with updates.
+ * 
+ * counters: pointer to CounterBitSet
+*/
+uint64 count_zero_counters(CounterBitSet *counters)
+{
+    int W = counters->bits_per_counter;
+    uint64 nonzero = 0;
+    if (counters_word_aligned(counters))
+    {
+        int per_bin = counters->layout == LAYOUT_PADDED ? counters->counters_per_bin : BIN_BITS / W;
+        // lanes past the last counter are always zero
+        nonzero = count_nonzero_bins(counters->raw_bits, counters->num_bins, all_lanes(per_bin, W), W);
+    }
+    else
+    {
+        uint64 rest[MAX_BITS_PER_COUNTER], high[MAX_BITS_PER_COUNTER];
+        for (int o=0; o<W; ++o)
+        {
+            // lanes of the counters starting in a bin whose first counter starts o bits in
+            uint64 low = 0;
+            for (int start_bit=o; start_bit<BIN_BITS; start_bit+=W)
+            {
+                low |= 1ULL << (2 * BIN_BITS - start_bit - W);
+            }
+            high[o] = low << (W - 1);
+            rest[o] = (low * COUNTER_MASK(W)) & ~high[o];
+        }
+
+        uint32 *bins = counters->raw_bits;
+        int step = BIN_BITS % W;
+        int phase = 0;
+        for (uint64 b=0; b<counters->num_bins; ++b)
+        {
+            int o = phase ? W - phase : 0;
+            uint64 x = (uint64)bins[b] << BIN_BITS | (b + 1 < counters->num_bins ? bins[b + 1] : 0);
+            nonzero += __builtin_popcountll(swar_nonzero64(x, rest[o], high[o]));
+            phase += step;
+            phase = phase >= W ? phase - W : phase;
+        }
+    }
+    counters->zero_count = counters->size - nonzero;
+    return counters->zero_count;
+}
 
 
 /**
@@ -127,25 +694,169 @@ void decrement(CounterBitSet *counters, int idx)
  * counters: pointer to CounterBitSet
  * idx: index of a counter to be set
 */
-void set_to_max(CounterBitSet *counters, int idx)
+void set_to_max(CounterBitSet *counters, uint64 idx)
 {
-    int bin_start = 0, bin_end = 0, bit_start = 0, bit_end = 0;
+    if (counters->layout == LAYOUT_PADDED)
+    {
+        uint64 bin = 0;
+        int shift = 0;
+        get_padded_slot(counters, idx, &bin, &shift);
+        counters->zero_count -= ! (counters->raw_bits[bin] & (COUNTER_MASK(counters->bits_per_counter) << shift));
+        counters->raw_bits[bin] |= COUNTER_MASK(counters->bits_per_counter) << shift;
+        return;
+    }
+
+    uint64 bin_start = 0, bin_end = 0;
+    int bit_start = 0, bit_end = 0;
     get_bin_range(counters, idx, &bin_start, &bin_end, &bit_start, &bit_end);
 
     // printf("insert to %d, bin_start: %d, bin_end: %d, bit_start: %d, bit_end: %d\n", idx, bin_start, bin_end, bit_start, bit_end);
 
     if (bin_start == bin_end)
     {
+        counters->zero_count -= ! (counters->raw_bits[bin_start] & GEN_BITS_RANGE(bit_end, bit_start));
         counters->raw_bits[bin_start] |= GEN_BITS_RANGE(bit_end, bit_start);
     }
     else
     {
+        counters->zero_count -= ! ((counters->raw_bits[bin_start] & GEN_BITS_RANGE(1, bit_start)) ||
+                                   (counters->raw_bits[bin_end] & GEN_BITS_RANGE(bit_end, BIN_BITS)));
         counters->raw_bits[bin_start] |= GEN_BITS_RANGE(1, bit_start);
         counters->raw_bits[bin_end] |= GEN_BITS_RANGE(bit_end, BIN_BITS);
     }
 }
 
 
+/**
+ * Thread-safe set_to_max: bits are only ever set, so an atomic fetch-or per bin is enough,
+ * even when the counter spans two bins. Returns the previous value of the counter.
+ * The zero count is exact for counters within one bin; racing sets of a counter spanning
+ * two bins may each see the other's half and miss its transition (see count_zero_counters).
+ * 
+ * counters: pointer to CounterBitSet
+ * idx: index of a counter to be set
+*/
+int set_to_max_atomic(CounterBitSet *counters, uint64 idx)
+{
+    uint32 mask = COUNTER_MASK(counters->bits_per_counter);
+    if (counters->layout == LAYOUT_PADDED)
+    {
+        uint64 bin = 0;
+        int shift = 0;
+        get_padded_slot(counters, idx, &bin, &shift);
+        int old = (__atomic_fetch_or(&(counters->raw_bits[bin]), mask << shift, __ATOMIC_RELAXED) >> shift) & mask;
+        if (! old)
+        {
+            __atomic_fetch_sub(&(counters->zero_count), 1, __ATOMIC_RELAXED);
+        }
+        return old;
+    }
+
+    uint64 bin_start = 0, bin_end = 0;
+    int bit_start = 0, bit_end = 0;
+    get_bin_range(counters, idx, &bin_start, &bin_end, &bit_start, &bit_end);
+
+    int old = 0;
+    if (bin_start == bin_end)
+    {
+        uint32 old_bin = __atomic_fetch_or(&(counters->raw_bits[bin_start]), (uint32)GEN_BITS_RANGE(bit_end, bit_start), __ATOMIC_RELAXED);
+        old = (old_bin >> (bit_end - 1)) & mask;
+    }
+    else
+    {
+        uint32 old_start = __atomic_fetch_or(&(counters->raw_bits[bin_start]), (uint32)GEN_BITS_RANGE(1, bit_start), __ATOMIC_RELAXED);
+        uint32 old_end = __atomic_fetch_or(&(counters->raw_bits[bin_end]), (uint32)GEN_BITS_RANGE(bit_end, BIN_BITS), __ATOMIC_RELAXED);
+        old = (old_start & GEN_BITS_RANGE(1, bit_start)) << (BIN_BITS - bit_end + 1) | \
+              (old_end & GEN_BITS_RANGE(bit_end, BIN_BITS)) >> (bit_end - 1);
+    }
+    if (! old)
+    {
+        __atomic_fetch_sub(&(counters->zero_count), 1, __ATOMIC_RELAXED);
+    }
+    return old;
+}
+
+/**
+ * Thread-safe decrement of a counter that lies in a single bin, i.e. LAYOUT_PADDED or
+ * bits_per_counter dividing 32. The decrement-if-nonzero is a CAS loop on the bin, so it
+ * never underflows into a neighbouring counter. Returns 1 iff the counter was decremented.
+ * 
+ * counters: pointer to CounterBitSet
+ * idx: index of a counter to be decremented
+*/
+int decrement_atomic(CounterBitSet *counters, uint64 idx)
+{
+    uint64 bin = 0;
+    int shift = 0;
+    if (counters->layout == LAYOUT_PADDED)
+    {
+        get_padded_slot(counters, idx, &bin, &shift);
+    }
+    else
+    {
+        uint64 s = counters->bits_per_counter * idx;
+        bin = s / BIN_BITS;
+        shift = BIN_BITS - counters->bits_per_counter - s % BIN_BITS;
+    }
+
+    uint32 mask = COUNTER_MASK(counters->bits_per_counter) << shift;
+    uint32 old = __atomic_load_n(&(counters->raw_bits[bin]), __ATOMIC_RELAXED);
+    do
+    {
+        if (! (old & mask))
+        {
+            return 0;
+        }
+    } while (! __atomic_compare_exchange_n(&(counters->raw_bits[bin]), &old, old - (1U << shift), 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+    if ((old & mask) == 1U << shift)
+    {
+        __atomic_fetch_add(&(counters->zero_count), 1, __ATOMIC_RELAXED);
+    }
+    return 1;
+}
+
+/**
+ * Whether counters never span two bins, as required by decrement_atomic.
+ * 
+ * counters: pointer to CounterBitSet
+*/
+int counters_word_aligned(CounterBitSet *counters)
+{
+    return counters->layout == LAYOUT_PADDED || BIN_BITS % counters->bits_per_counter == 0;
+}
+
+/**
+ * Thread-safe test_counter, reading bins with atomic loads.
+ * 
+ * counters: pointer to CounterBitSet
+ * idx: index of a queried counter
+*/
+int test_counter_atomic(CounterBitSet *counters, uint64 idx)
+{
+    if (counters->layout == LAYOUT_PADDED)
+    {
+        uint64 bin = 0;
+        int shift = 0;
+        get_padded_slot(counters, idx, &bin, &shift);
+        return (__atomic_load_n(&(counters->raw_bits[bin]), __ATOMIC_RELAXED) & (COUNTER_MASK(counters->bits_per_counter) << shift)) != 0;
+    }
+
+    uint64 bin_start = 0, bin_end = 0;
+    int bit_start = 0, bit_end = 0;
+    get_bin_range(counters, idx, &bin_start, &bin_end, &bit_start, &bit_end);
+
+    if (bin_start == bin_end)
+    {
+        return (__atomic_load_n(&(counters->raw_bits[bin_start]), __ATOMIC_RELAXED) & GEN_BITS_RANGE(bit_end, bit_start)) != 0;
+    }
+    else
+    {
+        return (__atomic_load_n(&(counters->raw_bits[bin_start]), __ATOMIC_RELAXED) & GEN_BITS_RANGE(1, bit_start)) || \
+               (__atomic_load_n(&(counters->raw_bits[bin_end]), __ATOMIC_RELAXED) & GEN_BITS_RANGE(bit_end, BIN_BITS));
+    }
+}
+
+
 /**
  * Release memory.
  * 
@@ -153,7 +864,10 @@ void set_to_max(CounterBitSet *counters, int idx)
 */
 void free_counters(CounterBitSet *counters)
 {
-    free(counters->raw_bits);
+    if (! counters->borrowed)
+    {
+        free(counters->raw_bits);
+    }
     counters->raw_bits = NULL;
 }
 
@@ -164,14 +878,15 @@ void free_counters(CounterBitSet *counters)
  * start_idx: start index of counter to be printed
  * end_idx: end index of counter to be printed
 */
-void print_counters(CounterBitSet *counters, int start_idx, int end_idx)
+void print_counters(CounterBitSet *counters, uint64 start_idx, uint64 end_idx)
 {
-    printf("num of counters: %d\n", counters->size);
+    printf("num of counters: %llu\n", counters->size);
     printf("bits per counter: %d\n", counters->bits_per_counter);
-    printf("num of bins: %d\n", counters->num_bins);
+    printf("num of bins: %llu\n", counters->num_bins);
+    printf("layout: %s, memory overhead: %.2f%%\n", counters->layout == LAYOUT_PADDED ? "padded" : "packed", 100 * counters_overhead(counters));
     
-    printf("%d--%d bins are: ", start_idx, end_idx - 1);
-    for (int i=start_idx; i<end_idx; ++i)
+    printf("%llu--%llu bins are: ", start_idx, end_idx - 1);
+    for (uint64 i=start_idx; i<end_idx; ++i)
     {
         printf("%08x ", counters->raw_bits[i]);
     }
@@ -2,21 +2,156 @@
 #define BITUTILS_H
 
 typedef unsigned int uint32;
+typedef unsigned long long uint64;
+
+#define BIN_BITS 32
+#define CACHE_LINE_BYTES 64
+#define COUNTER_MASK(bits) ((uint32)((1UL << (bits)) - 1))
+
+typedef enum CounterLayout
+{
+    LAYOUT_PACKED, // counters are back to back and may span two bins
+    LAYOUT_PADDED  // floor(32 / bits_per_counter) counters per bin, rest of the bin unused
+} CounterLayout;
 
 typedef struct CounterBitSet
 {
     uint32 *raw_bits;
-    int size; // num of counter
+    uint64 size; // num of counter
     int bits_per_counter;
-    int num_bins;
+    uint64 num_bins;
+    CounterLayout layout;
+    int counters_per_bin; // only for LAYOUT_PADDED
+    uint64 zero_count;    // number of zero counters, kept up to date by every update
+    int borrowed;         // raw_bits is owned elsewhere (e.g. a file mapping), not freed by free_counters
 } CounterBitSet;
 
-void init_counters(CounterBitSet *counters, int size, int bits_per_counter);
-void decrement(CounterBitSet *counters, int idx);
-void set_to_max(CounterBitSet *counters, int idx);
-int test_counter(CounterBitSet *counters, int idx);
+void init_counters(CounterBitSet *counters, uint64 size, int bits_per_counter);
+void init_counters_with_layout(CounterBitSet *counters, uint64 size, int bits_per_counter, CounterLayout layout);
+float counters_overhead(CounterBitSet *counters);
+void decrement(CounterBitSet *counters, uint64 idx);
+void decrement_range(CounterBitSet *counters, uint64 start, uint64 count);
+uint64 decrement_range_atomic(CounterBitSet *counters, uint64 start, uint64 count);
+uint64 count_zero_counters(CounterBitSet *counters);
+void set_to_max(CounterBitSet *counters, uint64 idx);
+int test_counter(CounterBitSet *counters, uint64 idx);
 void free_counters(CounterBitSet *counters);
-void print_counters(CounterBitSet *counters, int start_idx, int end_idx);
-int get_counter(CounterBitSet *counters, int idx);
+void print_counters(CounterBitSet *counters, uint64 start_idx, uint64 end_idx);
+int get_counter(CounterBitSet *counters, uint64 idx);
+int set_to_max_atomic(CounterBitSet *counters, uint64 idx);
+int decrement_atomic(CounterBitSet *counters, uint64 idx);
+int test_counter_atomic(CounterBitSet *counters, uint64 idx);
+int counters_word_aligned(CounterBitSet *counters);
+
+/**
+ * Index of the bin holding the first bit of i-th counter.
+*/
+static inline uint64 counter_bin(CounterBitSet *counters, uint64 idx)
+{
+    if (counters->layout == LAYOUT_PADDED)
+    {
+        return idx / counters->counters_per_bin;
+    }
+    return idx * counters->bits_per_counter / BIN_BITS;
+}
+
+/**
+ * Hint the cache to load the bin of i-th counter for a later read.
+*/
+static inline void prefetch_counter(CounterBitSet *counters, uint64 idx)
+{
+    __builtin_prefetch(&(counters->raw_bits[counter_bin(counters, idx)]), 0, 3);
+}
+
+
+/**
+ * Counter operations specialized for a compile-time counter width W, so that all shifts
+ * and masks are constants. Semantics match test_counter, decrement and set_to_max.
+ * 
+ * DEFINE_PACKED_COUNTER_OPS(W) defines test_counter_wW, decrement_wW and set_to_max_wW
+ * for LAYOUT_PACKED; the two-bin branch folds away when W divides BIN_BITS.
+ * DEFINE_PADDED_COUNTER_OPS(W) defines test_counter_pW, decrement_pW and set_to_max_pW
+ * for LAYOUT_PADDED.
+*/
+#define DEFINE_PACKED_COUNTER_OPS(W) \
+static inline int test_counter_w##W(CounterBitSet *counters, uint64 idx) \
+{ \
+    uint32 *bins = counters->raw_bits; \
+    uint64 s = (W) * idx, bin = s / BIN_BITS; \
+    unsigned int off = s % BIN_BITS; \
+    if (BIN_BITS % (W) == 0 || off + (W) <= BIN_BITS) \
+    { \
+        return (bins[bin] >> (BIN_BITS - (W) - off)) & COUNTER_MASK(W); \
+    } \
+    return (bins[bin] & COUNTER_MASK(BIN_BITS - off)) || (bins[bin + 1] >> (2 * BIN_BITS - (W) - off)); \
+} \
+static inline void decrement_w##W(CounterBitSet *counters, uint64 idx) \
+{ \
+    uint32 *bins = counters->raw_bits; \
+    uint64 s = (W) * idx, bin = s / BIN_BITS; \
+    unsigned int off = s % BIN_BITS; \
+    if (BIN_BITS % (W) == 0 || off + (W) <= BIN_BITS) \
+    { \
+        unsigned int shift = BIN_BITS - (W) - off; \
+        uint32 value = bins[bin] & (COUNTER_MASK(W) << shift); \
+        if (value) \
+        { \
+            bins[bin] -= 1U << shift; \
+            counters->zero_count += value == 1U << shift; \
+        } \
+        return; \
+    } \
+    unsigned int hi_bits = BIN_BITS - off, lo_shift = 2 * BIN_BITS - (W) - off; \
+    uint32 value = ((bins[bin] & COUNTER_MASK(hi_bits)) << ((W) - hi_bits)) | (bins[bin + 1] >> lo_shift); \
+    if (value) \
+    { \
+        value--; \
+        counters->zero_count += ! value; \
+        bins[bin] = (bins[bin] & ~COUNTER_MASK(hi_bits)) | (value >> ((W) - hi_bits)); \
+        bins[bin + 1] = (bins[bin + 1] & COUNTER_MASK(lo_shift)) | (value << lo_shift); \
+    } \
+} \
+static inline void set_to_max_w##W(CounterBitSet *counters, uint64 idx) \
+{ \
+    uint32 *bins = counters->raw_bits; \
+    uint64 s = (W) * idx, bin = s / BIN_BITS; \
+    unsigned int off = s % BIN_BITS; \
+    if (BIN_BITS % (W) == 0 || off + (W) <= BIN_BITS) \
+    { \
+        counters->zero_count -= ! (bins[bin] & (COUNTER_MASK(W) << (BIN_BITS - (W) - off))); \
+        bins[bin] |= COUNTER_MASK(W) << (BIN_BITS - (W) - off); \
+        return; \
+    } \
+    counters->zero_count -= ! ((bins[bin] & COUNTER_MASK(BIN_BITS - off)) | \
+                               (bins[bin + 1] & ~COUNTER_MASK(2 * BIN_BITS - (W) - off))); \
+    bins[bin] |= COUNTER_MASK(BIN_BITS - off); \
+    bins[bin + 1] |= ~COUNTER_MASK(2 * BIN_BITS - (W) - off); \
+}
+
+#define DEFINE_PADDED_COUNTER_OPS(W) \
+static inline int test_counter_p##W(CounterBitSet *counters, uint64 idx) \
+{ \
+    uint64 bin = idx / (BIN_BITS / (W)); \
+    unsigned int shift = BIN_BITS - (idx % (BIN_BITS / (W)) + 1) * (W); \
+    return (counters->raw_bits[bin] >> shift) & COUNTER_MASK(W); \
+} \
+static inline void decrement_p##W(CounterBitSet *counters, uint64 idx) \
+{ \
+    uint64 bin = idx / (BIN_BITS / (W)); \
+    unsigned int shift = BIN_BITS - (idx % (BIN_BITS / (W)) + 1) * (W); \
+    uint32 value = counters->raw_bits[bin] & (COUNTER_MASK(W) << shift); \
+    if (value) \
+    { \
+        counters->raw_bits[bin] -= 1U << shift; \
+        counters->zero_count += value == 1U << shift; \
+    } \
+} \
+static inline void set_to_max_p##W(CounterBitSet *counters, uint64 idx) \
+{ \
+    uint64 bin = idx / (BIN_BITS / (W)); \
+    unsigned int shift = BIN_BITS - (idx % (BIN_BITS / (W)) + 1) * (W); \
+    counters->zero_count -= ! (counters->raw_bits[bin] & (COUNTER_MASK(W) << shift)); \
+    counters->raw_bits[bin] |= COUNTER_MASK(W) << shift; \
+}
 
 #endif
@@ -0,0 +1,280 @@
+#include "stdio.h"
+#include "stdlib.h"
+#include "string.h"
+#include "fcntl.h"
+#include "unistd.h"
+#include "sys/mman.h"
+#include "sys/stat.h"
+
+#include "./dataset.h"
+
+#define DATASET_BYTE_ORDER 0x01020304 // reads back differently on a foreign-endian machine
+
+
+// Fixed header, followed by the column table: ids, labels, floats, then codes,
+// dictionary offsets and dictionary strings of each categorical column.
+typedef struct DatasetHeader
+{
+    char magic[8];
+    uint32 version;
+    uint32 byte_order;
+    uint64 num_rows;
+    uint32 num_float_features;
+    uint32 num_cat_features;
+    uint32 has_labels;
+    uint32 num_columns;
+    uint64 header_bytes;
+    uint64 file_bytes;
+} DatasetHeader;
+
+typedef struct DatasetColumn
+{
+    uint64 offset; // position in the file, a multiple of DATASET_PAGE_BYTES
+    uint64 bytes;
+    uint64 count;  // entries of a dictionary, unused for other columns
+} DatasetColumn;
+
+enum
+{
+    COLUMN_IDS,
+    COLUMN_LABELS,
+    COLUMN_FLOATS,
+    COLUMN_FIRST_CAT // then 3 columns per categorical feature
+};
+
+
+static uint64 round_to_page(uint64 bytes)
+{
+    return (bytes + DATASET_PAGE_BYTES - 1) / DATASET_PAGE_BYTES * DATASET_PAGE_BYTES;
+}
+
+/**
+ * Save a dataset, e.g. one built in memory by a conversion tool.
+ *
+ * dataset: pointer to a Dataset, labels may be NULL
+ * path: file to be written
+*/
+void save_dataset(Dataset *dataset, const char *path)
+{
+    int num_columns = COLUMN_FIRST_CAT + 3 * dataset->num_cat_features;
+    uint64 header_bytes = round_to_page(sizeof(DatasetHeader) + num_columns * sizeof(DatasetColumn));
+    DatasetHeader *header = (DatasetHeader *)calloc(1, header_bytes);
+    DatasetColumn *columns = (DatasetColumn *)(header + 1);
+    const void **data = (const void **)malloc(num_columns * sizeof(void *));
+
+    memcpy(header->magic, DATASET_FILE_MAGIC, sizeof(header->magic));
+    header->version = DATASET_FILE_VERSION;
+    header->byte_order = DATASET_BYTE_ORDER;
+    header->num_rows = dataset->num_rows;
+    header->num_float_features = dataset->num_float_features;
+    header->num_cat_features = dataset->num_cat_features;
+    header->has_labels = dataset->labels != NULL;
+    header->num_columns = num_columns;
+    header->header_bytes = header_bytes;
+
+    uint64 rows = dataset->num_rows;
+    columns[COLUMN_IDS].bytes = rows * sizeof(unsigned int);
+    data[COLUMN_IDS] = dataset->ids;
+    columns[COLUMN_LABELS].bytes = dataset->labels ? rows : 0;
+    data[COLUMN_LABELS] = dataset->labels;
+    columns[COLUMN_FLOATS].bytes = rows * dataset->num_float_features * sizeof(float);
+    data[COLUMN_FLOATS] = dataset->float_features;
+    for (int c=0; c<dataset->num_cat_features; ++c)
+    {
+        CatDictionary *dictionary = &(dataset->dictionaries[c]);
+        DatasetColumn *column = &(columns[COLUMN_FIRST_CAT + 3 * c]);
+        column[0].bytes = rows * sizeof(uint32);
+        column[1].bytes = dictionary->size * sizeof(uint64);
+        column[1].count = dictionary->size;
+        column[2].bytes = dictionary->strings_bytes;
+        data[COLUMN_FIRST_CAT + 3 * c] = dataset->cat_codes[c];
+        data[COLUMN_FIRST_CAT + 3 * c + 1] = dictionary->offsets;
+        data[COLUMN_FIRST_CAT + 3 * c + 2] = dictionary->strings;
+    }
+
+    uint64 offset = header_bytes;
+    for (int i=0; i<num_columns; ++i)
+    {
+        columns[i].offset = offset;
+        offset += round_to_page(columns[i].bytes);
+    }
+    header->file_bytes = offset;
+
+    FILE *fp = fopen(path, "wb");
+    if (fp == NULL)
+    {
+        printf("Write file %s failed.\n", path);
+        exit(1);
+    }
+    static const char zeros[DATASET_PAGE_BYTES];
+    int ok = fwrite(header, 1, header_bytes, fp) == header_bytes;
+    for (int i=0; ok && i<num_columns; ++i)
+    {
+        uint64 padding = round_to_page(columns[i].bytes) - columns[i].bytes;
+        ok = fwrite(data[i], 1, columns[i].bytes, fp) == columns[i].bytes
+            && fwrite(zeros, 1, padding, fp) == padding;
+    }
+    if (fclose(fp) != 0 || ! ok)
+    {
+        printf("Write file %s failed.\n", path);
+        exit(1);
+    }
+    free(data);
+    free(header);
+}
+
+static const void *column_data(Dataset *dataset, DatasetColumn *column, uint64 expected_bytes, const char *path)
+{
+    if (column->offset % DATASET_PAGE_BYTES || column->offset + column->bytes > dataset->length
+        || column->bytes != expected_bytes)
+    {
+        printf("%s has an invalid column (offset %llu, %llu bytes).\n", path, column->offset, column->bytes);
+        exit(1);
+    }
+    return (const char *)dataset->base + column->offset;
+}
+
+/**
+ * Open a dataset file. The file is mapped read-only and shared, pages are loaded when rows
+ * are first read, so opening takes the same time for any number of rows. Only the column
+ * pointers and dictionary descriptors are allocated.
+ * The header, column bounds and dictionaries are always checked. The categorical codes,
+ * which dataset_row uses as dictionary indices, only with verify since it reads every code.
+ * Release with close_dataset.
+ *
+ * dataset: pointer to the Dataset to be initialized
+ * path: file to be opened
+ * verify: check that every categorical code is within its dictionary
+*/
+void open_dataset(Dataset *dataset, const char *path, int verify)
+{
+    int fd = open(path, O_RDONLY);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) != 0)
+    {
+        printf("Read file %s failed.\n", path);
+        exit(1);
+    }
+    if ((uint64)st.st_size < sizeof(DatasetHeader))
+    {
+        printf("%s is not a dataset file.\n", path);
+        exit(1);
+    }
+    void *base = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (base == MAP_FAILED)
+    {
+        printf("Mapping %s failed.\n", path);
+        exit(1);
+    }
+    dataset->base = base;
+    dataset->length = st.st_size;
+
+    DatasetHeader *header = (DatasetHeader *)base;
+    if (memcmp(header->magic, DATASET_FILE_MAGIC, sizeof(header->magic)))
+    {
+        printf("%s is not a dataset file.\n", path);
+        exit(1);
+    }
+    if (header->version != DATASET_FILE_VERSION || header->byte_order != DATASET_BYTE_ORDER)
+    {
+        printf("%s was written by an incompatible version or machine (version %u).\n", path, header->version);
+        exit(1);
+    }
+    if (header->file_bytes != dataset->length || header->num_columns != COLUMN_FIRST_CAT + 3 * header->num_cat_features
+        || sizeof(DatasetHeader) + header->num_columns * sizeof(DatasetColumn) > header->header_bytes
+        || header->header_bytes > dataset->length)
+    {
+        printf("%s is truncated or its header is corrupted.\n", path);
+        exit(1);
+    }
+
+    uint64 rows = header->num_rows;
+    DatasetColumn *columns = (DatasetColumn *)(header + 1);
+    dataset->num_rows = rows;
+    dataset->num_float_features = header->num_float_features;
+    dataset->num_cat_features = header->num_cat_features;
+    dataset->ids = (const unsigned int *)column_data(dataset, &(columns[COLUMN_IDS]), rows * sizeof(unsigned int), path);
+    dataset->labels = header->has_labels ? (const unsigned char *)column_data(dataset, &(columns[COLUMN_LABELS]), rows, path) : NULL;
+    dataset->float_features = (const float *)column_data(dataset, &(columns[COLUMN_FLOATS]),
+                                                         rows * header->num_float_features * sizeof(float), path);
+
+    int num_cat = header->num_cat_features;
+    dataset->cat_codes = (const uint32 **)malloc(num_cat * sizeof(uint32 *));
+    dataset->dictionaries = (CatDictionary *)malloc(num_cat * sizeof(CatDictionary));
+    for (int c=0; c<num_cat; ++c)
+    {
+        DatasetColumn *column = &(columns[COLUMN_FIRST_CAT + 3 * c]);
+        CatDictionary *dictionary = &(dataset->dictionaries[c]);
+        dataset->cat_codes[c] = (const uint32 *)column_data(dataset, &(column[0]), rows * sizeof(uint32), path);
+        dictionary->size = column[1].count;
+        dictionary->offsets = (const uint64 *)column_data(dataset, &(column[1]), column[1].count * sizeof(uint64), path);
+        dictionary->strings_bytes = column[2].bytes;
+        dictionary->strings = (const char *)column_data(dataset, &(column[2]), column[2].bytes, path);
+        // every value must be NUL-terminated inside the dictionary
+        if (dictionary->size && (dictionary->strings_bytes == 0 || dictionary->strings[dictionary->strings_bytes - 1] != '\0'))
+        {
+            printf("%s has an invalid dictionary for categorical feature %d.\n", path, c);
+            exit(1);
+        }
+        for (uint32 v=0; v<dictionary->size; ++v)
+        {
+            if (dictionary->offsets[v] >= dictionary->strings_bytes)
+            {
+                printf("%s has an invalid dictionary for categorical feature %d.\n", path, c);
+                exit(1);
+            }
+        }
+        if (! verify)
+        {
+            continue;
+        }
+        // the largest code of the column must index its dictionary
+        uint32 max_code = 0;
+        for (uint64 i=0; i<rows; ++i)
+        {
+            max_code = dataset->cat_codes[c][i] > max_code ? dataset->cat_codes[c][i] : max_code;
+        }
+        if (rows && max_code >= dictionary->size)
+        {
+            printf("%s has code %u outside the %u values of categorical feature %d.\n", path, max_code, dictionary->size, c);
+            exit(1);
+        }
+    }
+}
+
+/**
+ * Unmap a dataset opened by open_dataset. Data views of its rows become invalid.
+ *
+ * dataset: pointer to a Dataset
+*/
+void close_dataset(Dataset *dataset)
+{
+    free(dataset->cat_codes);
+    free(dataset->dictionaries);
+    dataset->cat_codes = NULL;
+    dataset->dictionaries = NULL;
+    if (dataset->base != NULL)
+    {
+        munmap(dataset->base, dataset->length);
+        dataset->base = NULL;
+        dataset->length = 0;
+    }
+}
+
+/**
+ * Views of n consecutive rows, e.g. to feed the *_batch functions of learned filters.
+ *
+ * dataset: pointer to a Dataset
+ * start: first row
+ * n: number of rows
+ * rows: array of n Data to be filled
+ * cat_features: array of n * num_cat_features pointers
+*/
+void dataset_rows(Dataset *dataset, uint64 start, int n, Data *rows, const char **cat_features)
+{
+    for (int i=0; i<n; ++i)
+    {
+        dataset_row(dataset, start + i, &(rows[i]), cat_features + (uint64)i * dataset->num_cat_features);
+    }
+}
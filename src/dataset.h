@@ -0,0 +1,70 @@
+#ifndef DATASET_H
+#define DATASET_H
+
+#include "./bitutils.h"
+#include "./model.h"
+
+// Columnar dataset file: ids, optional labels, a row-major float matrix and dictionary
+// encoded categorical columns, each column starting on a DATASET_PAGE_BYTES boundary.
+// An opened dataset is a read-only mapping of the file; rows are handed out as Data views
+// pointing into it.
+#define DATASET_FILE_MAGIC "SLBFDATA"
+#define DATASET_FILE_VERSION 1
+#define DATASET_PAGE_BYTES 4096
+
+typedef struct CatDictionary
+{
+    uint32 size;           // number of distinct values
+    const uint64 *offsets; // [size], start of each value in strings
+    const char *strings;   // NUL-terminated values back to back
+    uint64 strings_bytes;
+} CatDictionary;
+
+typedef struct Dataset
+{
+    uint64 num_rows;
+    int num_float_features;
+    int num_cat_features;
+    const unsigned int *ids;       // [num_rows]
+    const unsigned char *labels;   // [num_rows], 1 for keys of the filter, NULL if unlabeled
+    const float *float_features;   // [num_rows * num_float_features], row-major
+    const uint32 **cat_codes;      // [num_cat_features][num_rows], codes into the dictionaries
+    CatDictionary *dictionaries;   // [num_cat_features]
+    // file mapping, NULL for a dataset built in memory
+    void *base;
+    uint64 length;
+} Dataset;
+
+void save_dataset(Dataset *dataset, const char *path);
+void open_dataset(Dataset *dataset, const char *path, int verify);
+void close_dataset(Dataset *dataset);
+
+/**
+ * View of row i as a Data object, without copying: features point into the dataset and
+ * cat_features into the dictionaries. cat_features is caller storage for the
+ * num_cat_features value pointers of the row, reused from one row to the next.
+ * Categorical codes are not checked here, open the dataset with verify unless the file
+ * is trusted.
+ *
+ * dataset: pointer to a Dataset
+ * i: row index
+ * row: pointer to the Data to be filled
+ * cat_features: array of num_cat_features pointers
+*/
+static inline void dataset_row(Dataset *dataset, uint64 i, Data *row, const char **cat_features)
+{
+    row->id = dataset->ids[i];
+    row->float_features = (float *)(dataset->float_features + i * dataset->num_float_features);
+    row->num_float_features = dataset->num_float_features;
+    for (int c=0; c<dataset->num_cat_features; ++c)
+    {
+        CatDictionary *dictionary = &(dataset->dictionaries[c]);
+        cat_features[c] = dictionary->strings + dictionary->offsets[dataset->cat_codes[c][i]];
+    }
+    row->cat_features = cat_features;
+    row->num_cat_features = dataset->num_cat_features;
+}
+
+void dataset_rows(Dataset *dataset, uint64 start, int n, Data *rows, const char **cat_features);
+
+#endif
@@ -3,183 +3,1259 @@
 #include "../include/ilog.h"
 #include "./filters.h"
 #include "./bitutils.h"
+#include "./perfstat.h"
 
 #include "stdio.h"
 #include "stdlib.h"
+#include "string.h"
+#include "math.h"
+#include "time.h"
 
 
 #define RANDOM_SEED1 123456789
 #define RANDOM_SEED2 987654321
+#define SHARD_SEED 192837465 // independent of the in-filter hash seeds
+
+#define HASH32_RANGE (1ULL << 32)
+
+#define BLOCK_LOG 9
+#define BLOCK_BITS (1 << BLOCK_LOG) // one 64-byte cache line
+#define BATCH_MAX_CODES 4096 // hash values per group of a batched query, kept on the stack
 
 static const unsigned char *ISAAC_SEED = (unsigned char*)"22333322";
 
 /**
  * Generate k independent uniformly distributed hash values in range 0...m-1.
  * For the theory, see https://www.eecs.harvard.edu/~michaelm/postscripts/rsa2008.pdf
+ * Values are 32-bit, so this mode only supports m <= 2^32.
+ * 
+ * data: pointer to the data
+ * length: size of data to calculate hash codes (num of bytes)
+ * k: number of hash functions
+ * m: range of hash codes
+ * hash_codes: pointer to the result to be stored
+*/
+void gen_k_hash32(const void *data, int length, int k, uint64 m, uint64 *hash_codes)
+{
+    unsigned int h1 = XXH32(data, length, RANDOM_SEED1);
+    unsigned int h2 = XXH32(data, length, RANDOM_SEED2);
+
+    for (int i=0; i<k; ++i)
+    {
+        hash_codes[i] = (unsigned int)(h1 + i * h2) % m;
+    }
+}
+
+/**
+ * Generate k hash values in range 0...m-1 from a single XXH64 call.
+ * The low and high halves of the 64-bit hash are the two double hashing seeds, and each
+ * value is mapped to [0, m) by multiply-shift instead of modulo.
+ * See https://lemire.me/blog/2016/06/27/a-fast-alternative-to-the-modulo-reduction/
+ * Beyond 2^32 values a second XXH64 call provides a full 64-bit step, so that the
+ * indices stay uniform over the whole range.
+ * 
+ * data: pointer to the data
+ * length: size of data to calculate hash codes (num of bytes)
+ * k: number of hash functions
+ * m: range of hash codes
+ * hash_codes: pointer to the result to be stored
+*/
+void gen_k_hash64(const void *data, int length, int k, uint64 m, uint64 *hash_codes)
+{
+    if (m <= HASH32_RANGE)
+    {
+        uint64 h = XXH64(data, length, RANDOM_SEED1);
+        unsigned int h1 = (unsigned int)h;
+        unsigned int h2 = (unsigned int)(h >> 32);
+
+        for (int i=0; i<k; ++i)
+        {
+            hash_codes[i] = ((uint64)(h1 + i * h2) * m) >> 32;
+        }
+    }
+    else
+    {
+        uint64 h1 = XXH64(data, length, RANDOM_SEED1);
+        uint64 h2 = XXH64(data, length, RANDOM_SEED2);
+
+        for (int i=0; i<k; ++i)
+        {
+            hash_codes[i] = ((unsigned __int128)(h1 + i * h2) * m) >> 64;
+        }
+    }
+}
+
+/**
+ * Generate k hash values in range 0...m-1 with the given hash mode.
+ * 
+ * mode: HASH_XXH32_MOD or HASH_XXH64_FASTRANGE
+ * data: pointer to the data
+ * length: size of data to calculate hash codes (num of bytes)
+ * k: number of hash functions
+ * m: range of hash codes
+ * hash_codes: pointer to the result to be stored
+*/
+void gen_k_hash(HashMode mode, const void *data, int length, int k, uint64 m, uint64 *hash_codes)
+{
+    PERF_BEGIN(PERF_HASH);
+    if (mode == HASH_XXH64_FASTRANGE)
+    {
+        gen_k_hash64(data, length, k, m, hash_codes);
+    }
+    else
+    {
+        gen_k_hash32(data, length, k, m, hash_codes);
+    }
+    PERF_END(PERF_HASH);
+}
+
+/**
+ * Batched membership test shared by BF and SBF. Keys are processed in groups of batch_size:
+ * all hash values of a group are computed and their bins prefetched first, then the
+ * counters are tested, so the cache misses of a whole group overlap. Hash values live on
+ * the stack, groups are capped at BATCH_MAX_CODES hash values, far more lines than the
+ * cache keeps in flight.
+ * 
+ * counters: pointer to the CounterBitSet of the filter
+ * mode: hash mode of the filter
+ * K: number of hash functions
+ * m: number of counters
+ * data: pointer to n keys stored back to back
+ * length: size of each key (num of bytes)
+ * n: number of keys
+ * batch_size: number of keys hashed and prefetched ahead of testing, at least 1 is used
+ * result: bitmap of (n + 63) / 64 words, bit i is set iff key i is reported present
+*/
+static void test_counters_batch(CounterBitSet *counters, HashMode mode, int K, uint64 m, void *data, int length, int n, int batch_size, uint64 *result)
+{
+    int max_batch = BATCH_MAX_CODES / K > 1 ? BATCH_MAX_CODES / K : 1;
+    batch_size = batch_size < max_batch ? batch_size : max_batch;
+    batch_size = batch_size > 1 ? batch_size : 1;
+    uint64 hash_codes[batch_size * K];
+    memset(result, 0, (n + 63) / 64 * sizeof(uint64));
+
+    for (int start=0; start<n; start+=batch_size)
+    {
+        int end = start + batch_size < n ? start + batch_size : n;
+        for (int j=start; j<end; ++j)
+        {
+            uint64 *codes = hash_codes + (size_t)(j - start) * K;
+            gen_k_hash(mode, (char *)data + (size_t)j * length, length, K, m, codes);
+            for (int i=0; i<K; ++i)
+            {
+                prefetch_counter(counters, codes[i]);
+            }
+        }
+        for (int j=start; j<end; ++j)
+        {
+            uint64 *codes = hash_codes + (size_t)(j - start) * K;
+            int present = 1;
+            for (int i=0; i<K && present; ++i)
+            {
+                present = test_counter(counters, codes[i]) != 0;
+            }
+            result[j / 64] |= (uint64)present << (j % 64);
+        }
+    }
+}
+
+/**
+ * Generate k hash values of a blocked Bloom filter. The block is chosen by the first hash
+ * and the k bit positions inside the block are derived from the second one, so all values
+ * fall in [block * BLOCK_BITS, (block + 1) * BLOCK_BITS). Supports up to 2^32 blocks.
+ * 
+ * data: pointer to the data
+ * length: size of data to calculate hash codes (num of bytes)
+ * k: number of hash functions
+ * num_blocks: number of blocks
+ * hash_codes: pointer to the result to be stored
+*/
+void gen_k_block_hash32(const void *data, int length, int k, uint64 num_blocks, uint64 *hash_codes)
+{
+    unsigned int h1 = XXH32(data, length, RANDOM_SEED1);
+    unsigned int h2 = XXH32(data, length, RANDOM_SEED2);
+
+    uint64 base = (h1 % num_blocks) * BLOCK_BITS;
+    for (int i=0; i<k; ++i)
+    {
+        // take the top BLOCK_LOG bits of a multiplicative remix of h2
+        h2 = h2 * 0x9e3779b1 + i;
+        hash_codes[i] = base + (h2 >> (32 - BLOCK_LOG));
+    }
+}
+
+
+/**
+ * Init a standard Bloom filter with the original XXH32 hashing (XXH64 beyond 2^32 bits).
+ * 
+ * bf: pointer to a BF
+ * K: number of hash functions
+ * m: number of bits
+*/
+void init_bf(BF *bf, int K, uint64 m)
+{
+    // the original hashing cannot address more than 2^32 bits
+    init_bf_with_hash(bf, K, m, m > HASH32_RANGE ? HASH_XXH64_FASTRANGE : HASH_XXH32_MOD);
+}
+
+/**
+ * Init a standard Bloom filter.
+ * 
+ * bf: pointer to a BF
+ * K: number of hash functions
+ * m: number of bits
+ * hash_mode: how hash values are generated, see HashMode
+*/
+void init_bf_with_hash(BF *bf, int K, uint64 m, HashMode hash_mode)
+{
+    if (hash_mode == HASH_XXH32_MOD && m > HASH32_RANGE)
+    {
+        printf("HASH_XXH32_MOD supports at most 2^32 bits, %llu provided.\n", m);
+        exit(1);
+    }
+
+    CounterBitSet bitset;
+    init_counters(&bitset, m, 1);
+    
+    bf->bitset = bitset;
+    bf->K = K;
+    bf->m = m;
+    bf->hash_mode = hash_mode;
+
+    bf->hash_codes = (uint64 *)malloc(K * sizeof(uint64));
+}
+
+/**
+ * Insert an element to Bloom filter.
+ * 
+ * bf: pointer to a BF
+ * data: pointer to the element to be inserted
+ * length: length of data (number of bytes used to calculate hash values)
+*/
+void insert_bf(BF *bf, void *data, int length)
+{
+    gen_k_hash(bf->hash_mode, data, length, bf->K, bf->m, bf->hash_codes);
+    PERF_BEGIN(PERF_SET_MAX);
+    for (int i=0; i<bf->K; ++i)
+    {
+        set_to_max(&(bf->bitset), bf->hash_codes[i]);
+    }
+    PERF_END(PERF_SET_MAX);
+}
+
+/**
+ * Membership query processing.
+ * 
+ * bf: pointer to a BF
+ * data: pointer to the queried element
+ * length: length of data (number of bytes used to calculate hash values)
+*/
+int test_bf(BF *bf, void *data, int length)
+{
+    gen_k_hash(bf->hash_mode, data, length, bf->K, bf->m, bf->hash_codes);
+    for (int i=0; i<bf->K; ++i)
+    {
+        if (! test_counter(&(bf->bitset), bf->hash_codes[i]))
+        {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+/**
+ * Thread-safe insert. Hash codes are kept on the caller's stack and bits are set with
+ * atomic fetch-or, so any number of threads may insert and query one BF concurrently
+ * through the *_concurrent functions.
+ * 
+ * bf: pointer to a BF
+ * data: pointer to the element to be inserted
+ * length: length of data (number of bytes used to calculate hash values)
+*/
+void insert_bf_concurrent(BF *bf, void *data, int length)
+{
+    uint64 hash_codes[bf->K];
+    gen_k_hash(bf->hash_mode, data, length, bf->K, bf->m, hash_codes);
+    PERF_BEGIN(PERF_SET_MAX);
+    for (int i=0; i<bf->K; ++i)
+    {
+        set_to_max_atomic(&(bf->bitset), hash_codes[i]);
+    }
+    PERF_END(PERF_SET_MAX);
+}
+
+/**
+ * Thread-safe membership query processing, see insert_bf_concurrent.
+ * 
+ * bf: pointer to a BF
+ * data: pointer to the queried element
+ * length: length of data (number of bytes used to calculate hash values)
+*/
+int test_bf_concurrent(BF *bf, void *data, int length)
+{
+    uint64 hash_codes[bf->K];
+    gen_k_hash(bf->hash_mode, data, length, bf->K, bf->m, hash_codes);
+    for (int i=0; i<bf->K; ++i)
+    {
+        if (! test_counter_atomic(&(bf->bitset), hash_codes[i]))
+        {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+/**
+ * Batched membership query processing with software prefetching.
+ * 
+ * bf: pointer to a BF
+ * data: pointer to n keys stored back to back
+ * length: length of each key (number of bytes used to calculate hash values)
+ * n: number of keys
+ * batch_size: number of keys hashed and prefetched ahead of testing
+ * result: bitmap of (n + 63) / 64 words, bit i is set iff key i is reported present
+*/
+void test_bf_batch(BF *bf, void *data, int length, int n, int batch_size, uint64 *result)
+{
+    test_counters_batch(&(bf->bitset), bf->hash_mode, bf->K, bf->m, data, length, n, batch_size, result);
+}
+
+/**
+ * Release memory allocated to BF.
+ * 
+ * bf: pointer to a BF
+*/
+void free_bf(BF *bf)
+{
+    free_counters(&(bf->bitset));
+    free(bf->hash_codes);
+}
+
+/**
+ * Expected false positive rate of a standard Bloom filter, (1 - e^{-Kn/m})^K.
+ * 
+ * K: number of hash functions
+ * m: number of bits
+ * n: number of inserted elements
+*/
+double bf_false_positive_rate(int K, uint64 m, uint64 n)
+{
+    return pow(1 - exp(-(double)K * n / m), K);
+}
+
+/**
+ * Init a blocked Bloom filter. m is rounded up to a whole number of blocks.
+ * 
+ * bbf: pointer to a BBF
+ * K: number of hash functions
+ * m: number of bits
+*/
+void init_bbf(BBF *bbf, int K, uint64 m)
+{
+    uint64 num_blocks = (m + BLOCK_BITS - 1) / BLOCK_BITS;
+
+    CounterBitSet bitset;
+    init_counters(&bitset, num_blocks * BLOCK_BITS, 1);
+
+    bbf->bitset = bitset;
+    bbf->K = K;
+    bbf->m = num_blocks * BLOCK_BITS;
+    bbf->num_blocks = num_blocks;
+
+    bbf->hash_codes = (uint64 *)malloc(K * sizeof(uint64));
+}
+
+/**
+ * Insert an element to a blocked Bloom filter.
+ * 
+ * bbf: pointer to a BBF
+ * data: pointer to the element to be inserted
+ * length: length of data (number of bytes used to calculate hash values)
+*/
+void insert_bbf(BBF *bbf, void *data, int length)
+{
+    PERF_BEGIN(PERF_HASH);
+    gen_k_block_hash32(data, length, bbf->K, bbf->num_blocks, bbf->hash_codes);
+    PERF_END(PERF_HASH);
+    PERF_BEGIN(PERF_SET_MAX);
+    for (int i=0; i<bbf->K; ++i)
+    {
+        set_to_max(&(bbf->bitset), bbf->hash_codes[i]);
+    }
+    PERF_END(PERF_SET_MAX);
+}
+
+/**
+ * Membership query processing. Touches a single cache line.
+ * 
+ * bbf: pointer to a BBF
+ * data: pointer to the queried element
+ * length: length of data (number of bytes used to calculate hash values)
+*/
+int test_bbf(BBF *bbf, void *data, int length)
+{
+    PERF_BEGIN(PERF_HASH);
+    gen_k_block_hash32(data, length, bbf->K, bbf->num_blocks, bbf->hash_codes);
+    PERF_END(PERF_HASH);
+    for (int i=0; i<bbf->K; ++i)
+    {
+        if (! test_counter(&(bbf->bitset), bbf->hash_codes[i]))
+        {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+/**
+ * Release memory allocated to BBF.
+ * 
+ * bbf: pointer to a BBF
+*/
+void free_bbf(BBF *bbf)
+{
+    free_counters(&(bbf->bitset));
+    free(bbf->hash_codes);
+}
+
+/**
+ * Expected false positive rate of a blocked Bloom filter.
+ * The load of a block is Poisson with mean n / num_blocks, and a block holding i elements
+ * behaves like a standard Bloom filter of BLOCK_BITS bits with i elements.
+ * 
+ * K: number of hash functions
+ * m: number of bits
+ * n: number of inserted elements
+*/
+double bbf_false_positive_rate(int K, uint64 m, uint64 n)
+{
+    uint64 num_blocks = (m + BLOCK_BITS - 1) / BLOCK_BITS;
+    double lambda = (double)n / num_blocks;
+    int max_load = (int)(lambda + 10 * sqrt(lambda) + 20);
+
+    double fpr = 0;
+    double log_p = -lambda; // log of Poisson(0; lambda)
+    for (int i=0; i<=max_load; ++i)
+    {
+        if (i > 0)
+        {
+            log_p += log(lambda) - log(i);
+        }
+        double fill = 1 - pow(1 - 1.0 / BLOCK_BITS, (double)K * i);
+        fpr += exp(log_p) * pow(fill, K);
+    }
+    return fpr;
+}
+
+/**
+ * Smallest number of bits (whole blocks) for which a blocked Bloom filter holding n elements
+ * reaches the target false positive rate. Typically a few percent above the standard BF size.
+ * 
+ * K: number of hash functions
+ * n: number of elements to be inserted
+ * fpr: target false positive rate
+*/
+uint64 bbf_bits_for_fpr(int K, uint64 n, double fpr)
+{
+    // a standard BF of this size is a lower bound
+    double bf_bits = -(double)K * n / log(1 - pow(fpr, 1.0 / K));
+    uint64 lo = (uint64)(bf_bits / BLOCK_BITS);
+    uint64 hi = lo + 1;
+    while (bbf_false_positive_rate(K, hi * BLOCK_BITS, n) > fpr)
+    {
+        lo = hi;
+        hi *= 2;
+    }
+    while (hi - lo > 1)
+    {
+        uint64 mid = lo + (hi - lo) / 2;
+        if (bbf_false_positive_rate(K, mid * BLOCK_BITS, n) > fpr)
+        {
+            lo = mid;
+        }
+        else
+        {
+            hi = mid;
+        }
+    }
+    return hi * BLOCK_BITS;
+}
+
+/**
+ * Draw a uniform random counter index in [0, m) for decrementing.
+ * Filters below 2^32 counters use isaac_next_uint as before, so existing experiments
+ * stay reproducible; larger ones combine two ISAAC outputs with multiply-shift.
+ * 
+ * isaac: random number generator of the SBF or of a concurrent writer
+ * m: number of counters
+*/
+static inline uint64 next_counter_index(isaac_ctx *isaac, uint64 m)
+{
+    if (m < HASH32_RANGE)
+    {
+        return isaac_next_uint(isaac, m);
+    }
+    uint64 r = (uint64)isaac_next_uint32(isaac) << 32 | isaac_next_uint32(isaac);
+    return ((unsigned __int128)r * m) >> 64;
+}
+
+/**
+ * Draw the next random counter index of an SBF with its configured generator. wyrand
+ * indices are generated RNG_BLOCK at a time and handed out from the block.
+ * 
+ * sbf: pointer to an SBF
+*/
+static inline uint64 next_sbf_index(SBF *sbf)
+{
+    if (sbf->rng == RNG_ISAAC)
+    {
+        return next_counter_index(&(sbf->isaac), sbf->m);
+    }
+    if (sbf->block_pos == RNG_BLOCK)
+    {
+        wyrand_fill_bounded(&(sbf->wyrand), sbf->m, sbf->index_block, RNG_BLOCK);
+        sbf->block_pos = 0;
+    }
+    return sbf->index_block[sbf->block_pos++];
+}
+
+/**
+ * Decrement P consecutive counters starting at a random position, wrapping around m.
+ * 
+ * sbf: pointer to an SBF
+*/
+static inline void decrement_sbf_range(SBF *sbf)
+{
+    uint64 start = next_sbf_index(sbf);
+    uint64 remaining = sbf->P;
+    while (remaining)
+    {
+        uint64 count = sbf->m - start < remaining ? sbf->m - start : remaining;
+        decrement_range(&(sbf->counters), start, count);
+        remaining -= count;
+        start = 0;
+    }
+}
+
+/**
+ * Define insert_sbf_NAME, insert_sbf_range_NAME and test_sbf_NAME on top of the given
+ * counter operations. The generated loops are the bodies of insert_sbf and test_sbf.
+*/
+#define DEFINE_SBF_OPS(NAME, DECREMENT, SET_TO_MAX, TEST_COUNTER) \
+static void insert_sbf_##NAME(SBF *sbf, void *data, int length) \
+{ \
+    PERF_BEGIN(PERF_DECREMENT); \
+    for (int i=0; i<sbf->P; ++i) \
+    { \
+        DECREMENT(&(sbf->counters), next_sbf_index(sbf)); \
+    } \
+    PERF_END(PERF_DECREMENT); \
+    gen_k_hash(sbf->hash_mode, data, length, sbf->K, sbf->m, sbf->hash_codes); \
+    PERF_BEGIN(PERF_SET_MAX); \
+    for (int i=0; i<sbf->K; ++i) \
+    { \
+        SET_TO_MAX(&(sbf->counters), sbf->hash_codes[i]); \
+    } \
+    PERF_END(PERF_SET_MAX); \
+} \
+static void insert_sbf_range_##NAME(SBF *sbf, void *data, int length) \
+{ \
+    PERF_BEGIN(PERF_DECREMENT); \
+    decrement_sbf_range(sbf); \
+    PERF_END(PERF_DECREMENT); \
+    gen_k_hash(sbf->hash_mode, data, length, sbf->K, sbf->m, sbf->hash_codes); \
+    PERF_BEGIN(PERF_SET_MAX); \
+    for (int i=0; i<sbf->K; ++i) \
+    { \
+        SET_TO_MAX(&(sbf->counters), sbf->hash_codes[i]); \
+    } \
+    PERF_END(PERF_SET_MAX); \
+} \
+static int test_sbf_##NAME(SBF *sbf, void *data, int length) \
+{ \
+    gen_k_hash(sbf->hash_mode, data, length, sbf->K, sbf->m, sbf->hash_codes); \
+    for (int i=0; i<sbf->K; ++i) \
+    { \
+        if (! TEST_COUNTER(&(sbf->counters), sbf->hash_codes[i])) \
+        { \
+            return 0; \
+        } \
+    } \
+    return 1; \
+}
+
+DEFINE_PACKED_COUNTER_OPS(1)
+DEFINE_PACKED_COUNTER_OPS(2)
+DEFINE_PACKED_COUNTER_OPS(3)
+DEFINE_PACKED_COUNTER_OPS(4)
+DEFINE_PACKED_COUNTER_OPS(8)
+DEFINE_PADDED_COUNTER_OPS(3)
+
+DEFINE_SBF_OPS(generic, decrement, set_to_max, test_counter)
+DEFINE_SBF_OPS(w1, decrement_w1, set_to_max_w1, test_counter_w1)
+DEFINE_SBF_OPS(w2, decrement_w2, set_to_max_w2, test_counter_w2)
+DEFINE_SBF_OPS(w3, decrement_w3, set_to_max_w3, test_counter_w3)
+DEFINE_SBF_OPS(w4, decrement_w4, set_to_max_w4, test_counter_w4)
+DEFINE_SBF_OPS(w8, decrement_w8, set_to_max_w8, test_counter_w8)
+DEFINE_SBF_OPS(p3, decrement_p3, set_to_max_p3, test_counter_p3)
+
+/**
+ * Insert and query of a DECREMENT_TIMED SBF. Inserts only set counters; both run
+ * concurrently with the SBFAger sweeping the same counters, so they use atomic accesses.
+*/
+static void insert_sbf_timed(SBF *sbf, void *data, int length)
+{
+    gen_k_hash(sbf->hash_mode, data, length, sbf->K, sbf->m, sbf->hash_codes);
+    PERF_BEGIN(PERF_SET_MAX);
+    for (int i=0; i<sbf->K; ++i)
+    {
+        set_to_max_atomic(&(sbf->counters), sbf->hash_codes[i]);
+    }
+    PERF_END(PERF_SET_MAX);
+}
+
+static int test_sbf_timed(SBF *sbf, void *data, int length)
+{
+    gen_k_hash(sbf->hash_mode, data, length, sbf->K, sbf->m, sbf->hash_codes);
+    for (int i=0; i<sbf->K; ++i)
+    {
+        if (! test_counter_atomic(&(sbf->counters), sbf->hash_codes[i]))
+        {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+#define USE_SBF_OPS(SBF_PTR, NAME) \
+    do \
+    { \
+        (SBF_PTR)->insert_fn = (SBF_PTR)->decrement_mode == DECREMENT_RANGE ? insert_sbf_range_##NAME : insert_sbf_##NAME; \
+        (SBF_PTR)->test_fn = test_sbf_##NAME; \
+    } while (0)
+
+/**
+ * Pick the specialized insert/test routines for the counter width and layout.
+ * Widths dividing BIN_BITS have the same bit positions in both layouts.
+ * 
+ * sbf: pointer to an SBF
+*/
+static void select_sbf_ops(SBF *sbf)
+{
+    if (sbf->decrement_mode == DECREMENT_TIMED)
+    {
+        sbf->insert_fn = insert_sbf_timed;
+        sbf->test_fn = test_sbf_timed;
+        return;
+    }
+    USE_SBF_OPS(sbf, generic);
+    if (sbf->counters.layout == LAYOUT_PADDED && sbf->bits_per_counter == 3)
+    {
+        USE_SBF_OPS(sbf, p3);
+        return;
+    }
+    if (sbf->counters.layout == LAYOUT_PADDED && BIN_BITS % sbf->bits_per_counter)
+    {
+        return;
+    }
+    switch (sbf->bits_per_counter)
+    {
+        case 1: USE_SBF_OPS(sbf, w1); break;
+        case 2: USE_SBF_OPS(sbf, w2); break;
+        case 3: USE_SBF_OPS(sbf, w3); break;
+        case 4: USE_SBF_OPS(sbf, w4); break;
+        case 8: USE_SBF_OPS(sbf, w8); break;
+        default: break;
+    }
+}
+
+/**
+ * Fill SBF options with the defaults used by init_sbf.
+ * 
+ * options: pointer to SBFOptions
+*/
+void default_sbf_options(SBFOptions *options)
+{
+    options->layout = LAYOUT_PACKED;
+    options->hash_mode = HASH_XXH32_MOD;
+    options->decrement_mode = DECREMENT_RANDOM;
+    options->rng = RNG_ISAAC;
+}
+
+/**
+ * Init a stable Bloom filter with default options.
+ * 
+ * sbf: pointer to an SBF
+ * P: number of counters to be decremented
+ * K: number of counters to be set
+ * m: number of counters
+ * bits_per_counter: bits used per counter
+*/
+void init_sbf(SBF *sbf, int P, int K, uint64 m, int bits_per_counter)
+{
+    SBFOptions options;
+    default_sbf_options(&options);
+    if (m > HASH32_RANGE)
+    {
+        // the original hashing cannot address more than 2^32 counters
+        options.hash_mode = HASH_XXH64_FASTRANGE;
+    }
+    init_sbf_with_options(sbf, P, K, m, bits_per_counter, &options);
+}
+
+/**
+ * Init a stable Bloom filter.
+ * 
+ * sbf: pointer to an SBF
+ * P: number of counters to be decremented
+ * K: number of counters to be set
+ * m: number of counters
+ * bits_per_counter: bits used per counter
+ * options: counter layout, hash mode etc., see default_sbf_options
+*/
+void init_sbf_with_options(SBF *sbf, int P, int K, uint64 m, int bits_per_counter, SBFOptions *options)
+{
+    if (options->hash_mode == HASH_XXH32_MOD && m > HASH32_RANGE)
+    {
+        printf("HASH_XXH32_MOD supports at most 2^32 counters, %llu provided.\n", m);
+        exit(1);
+    }
+
+    CounterBitSet counters;
+    init_counters_with_layout(&counters, m, bits_per_counter, options->layout);
+    init_sbf_with_counters(sbf, P, K, &counters, options);
+}
+
+/**
+ * Initialize an SBF around an existing counter array (freshly allocated or e.g. mapped
+ * from a file). The SBF takes over the counters; m, width and layout are taken from them.
+ * 
+ * sbf: pointer to an SBF
+ * P: number of counters to be decremented per insert
+ * K: number of hash functions
+ * counters: pointer to the CounterBitSet to be used
+ * options: pointer to SBFOptions, options->layout is ignored
+*/
+void init_sbf_with_counters(SBF *sbf, int P, int K, CounterBitSet *counters, SBFOptions *options)
+{
+    if (options->decrement_mode == DECREMENT_TIMED && ! counters_word_aligned(counters))
+    {
+        printf("DECREMENT_TIMED needs counters within one bin, use LAYOUT_PADDED for %d-bit counters.\n", counters->bits_per_counter);
+        exit(1);
+    }
+
+    sbf->counters = *counters;
+    sbf->P = P;
+    sbf->K = K;
+    sbf->m = counters->size;
+    sbf->bits_per_counter = counters->bits_per_counter;
+    sbf->hash_mode = options->hash_mode;
+    sbf->decrement_mode = options->decrement_mode;
+    
+    sbf->hash_codes = (uint64 *)malloc(K * sizeof(uint64));
+
+    isaac_ctx isaac;
+    isaac_init(&isaac, ISAAC_SEED, sizeof(ISAAC_SEED));
+    sbf->isaac = isaac;
+
+    sbf->rng = options->rng;
+    wyrand_seed(&(sbf->wyrand), XXH64(ISAAC_SEED, 8, 0));
+    sbf->index_block = (uint64 *)malloc(RNG_BLOCK * sizeof(uint64));
+    sbf->block_pos = RNG_BLOCK;
+
+    select_sbf_ops(sbf);
+}
+
+/**
+ * Insert an element to an SBF.
+ * 
+ * sbf: pointer to an SBF
+ * data: pointer to element to be inserted
+ * length: length of data (number of bytes used to calculate hash values)
+*/
+void insert_sbf(SBF *sbf, void *data, int length)
+{
+    sbf->insert_fn(sbf, data, length);
+}
+
+/**
+ * Membership query processing.
+ * 
+ * sbf: pointer to an SBF
+ * data: pointer to element to be inserted
+ * length: length of data (number of bytes used to calculate hash values)
+*/
+int test_sbf(SBF *sbf, void *data, int length)
+{
+    return sbf->test_fn(sbf, data, length);
+}
+
+/**
+ * Batched membership query processing with software prefetching.
+ * 
+ * sbf: pointer to an SBF
+ * data: pointer to n keys stored back to back
+ * length: length of each key (number of bytes used to calculate hash values)
+ * n: number of keys
+ * batch_size: number of keys hashed and prefetched ahead of testing
+ * result: bitmap of (n + 63) / 64 words, bit i is set iff key i is reported present
+*/
+void test_sbf_batch(SBF *sbf, void *data, int length, int n, int batch_size, uint64 *result)
+{
+    test_counters_batch(&(sbf->counters), sbf->hash_mode, sbf->K, sbf->m, data, length, n, batch_size, result);
+}
+
+/**
+ * Seed the random number generators from the SBF seed and an id, giving every concurrent
+ * writer or shard its own streams.
+ * 
+ * isaac: ISAAC generator to be seeded
+ * wyrand: wyrand generator to be seeded
+ * id: writer or shard id
+*/
+static void seed_rng(isaac_ctx *isaac, WyRand *wyrand, int id)
+{
+    unsigned char seed[8 + sizeof(int)];
+    memcpy(seed, ISAAC_SEED, 8);
+    memcpy(seed + 8, &id, sizeof(int));
+    isaac_init(isaac, seed, sizeof(seed));
+    wyrand_seed(wyrand, XXH64(seed, sizeof(seed), 0));
+}
+
+/**
+ * Draw the next random counter index of a concurrent writer, with the generator kind
+ * configured for its SBF.
+ * 
+ * writer: pointer to an SBFWriter
+*/
+static inline uint64 next_writer_index(SBFWriter *writer)
+{
+    if (writer->sbf->rng == RNG_ISAAC)
+    {
+        return next_counter_index(&(writer->isaac), writer->sbf->m);
+    }
+    return wyrand_next_bounded(&(writer->wyrand), writer->sbf->m);
+}
+
+/**
+ * Init a writer for concurrent inserts into a shared SBF. Every writer owns its random
+ * number generator, seeded from the SBF seed and writer_id, so decrements need no shared
+ * state besides the counters themselves. Counters must not span two bins, i.e. the SBF
+ * uses LAYOUT_PADDED or a bits_per_counter dividing 32.
+ * 
+ * writer: pointer to an SBFWriter
+ * sbf: pointer to the shared SBF
+ * writer_id: distinct id of the writer (e.g. thread index)
+*/
+void init_sbf_writer(SBFWriter *writer, SBF *sbf, int writer_id)
+{
+    if (! counters_word_aligned(&(sbf->counters)))
+    {
+        printf("Concurrent SBF inserts need counters within one bin, use LAYOUT_PADDED for %d-bit counters.\n", sbf->bits_per_counter);
+        exit(1);
+    }
+
+    seed_rng(&(writer->isaac), &(writer->wyrand), writer_id);
+
+    writer->sbf = sbf;
+    writer->decremented = 0;
+    writer->added = 0;
+}
+
+/**
+ * Thread-safe insert. The P decrements are compare-and-swap loops that never take
+ * a counter below zero (one per bin of the range in DECREMENT_RANGE mode, as
+ * decrement_range does for insert_sbf), the K counters are set with atomic fetch-or. Writers may run
+ * concurrently with each other and with test_sbf_concurrent.
+ * 
+ * writer: pointer to the SBFWriter of the calling thread
+ * data: pointer to element to be inserted
+ * length: length of data (number of bytes used to calculate hash values)
+*/
+void insert_sbf_concurrent(SBFWriter *writer, void *data, int length)
+{
+    SBF *sbf = writer->sbf;
+    int max = COUNTER_MASK(sbf->bits_per_counter);
+    uint64 hash_codes[sbf->K];
+
+    PERF_BEGIN(PERF_DECREMENT);
+    if (sbf->decrement_mode == DECREMENT_RANGE)
+    {
+        // P consecutive counters wrapping around m, see decrement_sbf_range
+        uint64 start = next_writer_index(writer);
+        uint64 remaining = sbf->P;
+        while (remaining)
+        {
+            uint64 count = sbf->m - start < remaining ? sbf->m - start : remaining;
+            writer->decremented += decrement_range_atomic(&(sbf->counters), start, count);
+            remaining -= count;
+            start = 0;
+        }
+    }
+    else if (sbf->decrement_mode == DECREMENT_RANDOM)
+    {
+        for (int i=0; i<sbf->P; ++i)
+        {
+            writer->decremented += decrement_atomic(&(sbf->counters), next_writer_index(writer));
+        }
+    }
+    PERF_END(PERF_DECREMENT);
+    gen_k_hash(sbf->hash_mode, data, length, sbf->K, sbf->m, hash_codes);
+    PERF_BEGIN(PERF_SET_MAX);
+    for (int i=0; i<sbf->K; ++i)
+    {
+        writer->added += max - set_to_max_atomic(&(sbf->counters), hash_codes[i]);
+    }
+    PERF_END(PERF_SET_MAX);
+}
+
+/**
+ * Thread-safe membership query processing, see insert_sbf_concurrent.
+ * 
+ * sbf: pointer to an SBF
+ * data: pointer to the queried element
+ * length: length of data (number of bytes used to calculate hash values)
+*/
+int test_sbf_concurrent(SBF *sbf, void *data, int length)
+{
+    uint64 hash_codes[sbf->K];
+    gen_k_hash(sbf->hash_mode, data, length, sbf->K, sbf->m, hash_codes);
+    for (int i=0; i<sbf->K; ++i)
+    {
+        if (! test_counter_atomic(&(sbf->counters), hash_codes[i]))
+        {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+/**
+ * Release memory allocated to sbf.
+ * 
+ * sbf: pointer to an SBF
+*/
+void free_sbf(SBF *sbf)
+{
+    free_counters(&(sbf->counters));
+    free(sbf->hash_codes);
+    free(sbf->index_block);
+}
+
+static double ager_now()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+/**
+ * Age the counters of the ager's SBF by elapsed seconds. Every counter is decremented
+ * max = 2^bits - 1 times per retention period, i.e. m * max / retention counter
+ * decrements per second, applied to the segment following the cursor.
  * 
- * data: pointer to the data
- * length: size of data to calculate hash codes (num of bytes)
- * k: number of hash functions
- * m: range of hash codes
- * hash_codes: pointer to the result to be stored
+ * ager: pointer to an SBFAger
+ * elapsed: seconds to account for
 */
-void gen_k_hash32(const void *data, int length, int k, int m, unsigned int *hash_codes)
+void advance_sbf_ager(SBFAger *ager, double elapsed)
 {
-    unsigned int h1 = XXH32(data, length, RANDOM_SEED1);
-    unsigned int h2 = XXH32(data, length, RANDOM_SEED2);
+    SBF *sbf = ager->sbf;
+    ager->owed += elapsed * sbf->m * COUNTER_MASK(sbf->bits_per_counter) / ager->retention;
+    uint64 count = (uint64)ager->owed;
+    ager->owed -= count;
+    ager->decremented += count;
+    ager->sweeps++;
 
-    for (int i=0; i<k; ++i)
+    while (count)
     {
-        hash_codes[i] = (h1 + i * h2) % m;
+        uint64 segment = sbf->m - ager->cursor < count ? sbf->m - ager->cursor : count;
+        decrement_range_atomic(&(sbf->counters), ager->cursor, segment);
+        ager->cursor = (ager->cursor + segment) % sbf->m;
+        count -= segment;
     }
 }
 
+static void *sbf_ager_main(void *arg)
+{
+    SBFAger *ager = (SBFAger *)arg;
+    struct timespec pause;
+    pause.tv_sec = (time_t)ager->interval;
+    pause.tv_nsec = (long)((ager->interval - pause.tv_sec) * 1e9);
+    while (__atomic_load_n(&(ager->running), __ATOMIC_ACQUIRE))
+    {
+        nanosleep(&pause, NULL);
+        double now = ager_now();
+        advance_sbf_ager(ager, now - ager->last_time);
+        ager->last_time = now;
+    }
+    return NULL;
+}
 
 /**
- * Init a standard Bloom filter.
+ * Start a background thread aging a DECREMENT_TIMED SBF by wall-clock time instead of
+ * insert count, so the retention window does not depend on the insert rate. Every interval
+ * the thread decrements the next rolling segment of counters, sized so that a counter set
+ * to max reaches zero after retention seconds without new inserts. Inserts and queries may
+ * run concurrently from one other thread (insert_sbf uses the SBF's hash code buffer), or
+ * from many through SBFWriters and test_sbf_concurrent.
  * 
- * bf: pointer to a BF
- * K: number of hash functions
- * m: number of bits
+ * ager: pointer to an SBFAger
+ * sbf: pointer to an SBF initialized with DECREMENT_TIMED
+ * retention: seconds until an untouched counter at max reaches zero
+ * interval: seconds between two sweeps
 */
-void init_bf(BF *bf, int K, int m)
+void start_sbf_ager(SBFAger *ager, SBF *sbf, double retention, double interval)
 {
-    CounterBitSet bitset;
-    init_counters(&bitset, m, 1);
-    
-    bf->bitset = bitset;
-    bf->K = K;
-    bf->m = m;
+    if (sbf->decrement_mode != DECREMENT_TIMED)
+    {
+        printf("SBFAger needs an SBF initialized with DECREMENT_TIMED.\n");
+        exit(1);
+    }
+    ager->sbf = sbf;
+    ager->retention = retention;
+    ager->interval = interval;
+    ager->cursor = 0;
+    ager->owed = 0;
+    ager->sweeps = 0;
+    ager->decremented = 0;
+    ager->last_time = ager_now();
+    ager->running = 1;
+    if (pthread_create(&(ager->thread), NULL, sbf_ager_main, ager))
+    {
+        printf("Create aging thread failed.\n");
+        exit(1);
+    }
+}
 
-    bf->hash_codes = (unsigned int *)malloc(K * sizeof(unsigned int));
+/**
+ * Stop the aging thread and wait for it to finish its current sweep.
+ * 
+ * ager: pointer to a running SBFAger
+*/
+void stop_sbf_ager(SBFAger *ager)
+{
+    __atomic_store_n(&(ager->running), 0, __ATOMIC_RELEASE);
+    pthread_join(ager->thread, NULL);
 }
 
 /**
- * Insert an element to Bloom filter.
+ * Fill statistics of an SBF in O(1), from the zero count the counters keep up to date.
+ * The false positive rate is the current one, (1 - zero ratio)^K. May be called while
+ * other threads update the filter.
  * 
- * bf: pointer to a BF
- * data: pointer to the element to be inserted
- * length: length of data (number of bytes used to calculate hash values)
+ * sbf: pointer to an SBF
+ * stats: pointer to SBFStats to be filled
 */
-void insert_bf(BF *bf, void *data, int length)
+void sbf_stats(SBF *sbf, SBFStats *stats)
 {
-    gen_k_hash32(data, length, bf->K, bf->m, bf->hash_codes);
-    for (int i=0; i<bf->K; ++i)
-    {
-        set_to_max(&(bf->bitset), bf->hash_codes[i]);
-    }
+    stats->counters = sbf->m;
+    stats->zero_counters = __atomic_load_n(&(sbf->counters.zero_count), __ATOMIC_RELAXED);
+    stats->zero_ratio = (double)stats->zero_counters / sbf->m;
+    stats->false_positive_rate = pow(1 - stats->zero_ratio, sbf->K);
 }
 
 /**
- * Membership query processing.
+ * Recount the zero counters of an SBF from scratch (see count_zero_counters) and fill its
+ * statistics. Must not run concurrently with updates.
  * 
- * bf: pointer to a BF
- * data: pointer to the queried element
- * length: length of data (number of bytes used to calculate hash values)
+ * sbf: pointer to an SBF
+ * stats: pointer to SBFStats to be filled
 */
-int test_bf(BF *bf, void *data, int length)
+void recount_sbf_stats(SBF *sbf, SBFStats *stats)
 {
-    gen_k_hash32(data, length, bf->K, bf->m, bf->hash_codes);
-    for (int i=0; i<bf->K; ++i)
+    count_zero_counters(&(sbf->counters));
+    sbf_stats(sbf, stats);
+}
+
+
+/**
+ * Init a sharded stable Bloom filter: num_shards independent SBFs of m / num_shards counters
+ * each (rounded up), with keys routed by a hash independent of the in-shard hashing.
+ * Each shard has its own counters, random number generator and hash code buffer, none of
+ * which share a cache line with another shard, so threads writing distinct shards do not
+ * contend. A shard must not be written by two threads at once; route keys so that every
+ * shard has a single owner, see sharded_sbf_shard.
+ * 
+ * ssbf: pointer to a ShardedSBF
+ * num_shards: number of shards
+ * P: number of counters to be decremented per insert
+ * K: number of counters to be set per insert
+ * m: total number of counters
+ * bits_per_counter: bits used per counter
+ * options: options of every shard, see default_sbf_options
+*/
+void init_sharded_sbf(ShardedSBF *ssbf, int num_shards, int P, int K, uint64 m, int bits_per_counter, SBFOptions *options)
+{
+    ssbf->num_shards = num_shards;
+    size_t shard_bytes = (num_shards * sizeof(SBFShard) + CACHE_LINE_BYTES - 1) / CACHE_LINE_BYTES * CACHE_LINE_BYTES;
+    ssbf->shards = (SBFShard *)aligned_alloc(CACHE_LINE_BYTES, shard_bytes);
+    if (ssbf->shards == NULL)
     {
-        if (! test_counter(&(bf->bitset), bf->hash_codes[i]))
+        printf("Memory allocation failed.\n");
+        exit(1);
+    }
+
+    uint64 shard_m = (m + num_shards - 1) / num_shards;
+    size_t hash_bytes = (K * sizeof(uint64) + CACHE_LINE_BYTES - 1) / CACHE_LINE_BYTES * CACHE_LINE_BYTES;
+    for (int s=0; s<num_shards; ++s)
+    {
+        SBF *sbf = &(ssbf->shards[s].sbf);
+        init_sbf_with_options(sbf, P, K, shard_m, bits_per_counter, options);
+        seed_rng(&(sbf->isaac), &(sbf->wyrand), s);
+        // hash codes are written on every insert, keep them off other shards' lines
+        free(sbf->hash_codes);
+        sbf->hash_codes = (uint64 *)aligned_alloc(CACHE_LINE_BYTES, hash_bytes);
+        if (sbf->hash_codes == NULL)
         {
-            return 0;
+            printf("Memory allocation failed.\n");
+            exit(1);
         }
     }
-    return 1;
 }
 
 /**
- * Release memory allocated to BF.
+ * Shard an element is routed to.
  * 
- * bf: pointer to a BF
+ * ssbf: pointer to a ShardedSBF
+ * data: pointer to the element
+ * length: length of data (number of bytes used to calculate hash values)
 */
-void free_bf(BF *bf)
+int sharded_sbf_shard(ShardedSBF *ssbf, void *data, int length)
 {
-    free_counters(&(bf->bitset));
-    free(bf->hash_codes);
+    uint64 h = XXH64(data, length, SHARD_SEED);
+    return ((h >> 32) * ssbf->num_shards) >> 32;
 }
 
 /**
- * Init a stable Bloom filter.
+ * Insert an element to its shard.
  * 
- * sbf: pointer to an SBF
- * P: number of counters to be decremented
- * K: number of counters to be set
- * m: number of counters
- * bits_per_counter: bits used per counter
+ * ssbf: pointer to a ShardedSBF
+ * data: pointer to element to be inserted
+ * length: length of data (number of bytes used to calculate hash values)
 */
-void init_sbf(SBF *sbf, int P, int K, int m, int bits_per_counter)
+void insert_sharded_sbf(ShardedSBF *ssbf, void *data, int length)
 {
-    CounterBitSet counters;
-    init_counters(&counters, m, bits_per_counter);
-
-    sbf->counters = counters;
-    sbf->P = P;
-    sbf->K = K;
-    sbf->m = m;
-    
-    sbf->hash_codes = (unsigned int *)malloc(K * sizeof(unsigned int));
-
-    isaac_ctx isaac;
-    isaac_init(&isaac, ISAAC_SEED, sizeof(ISAAC_SEED));
-    sbf->isaac = isaac;
+    insert_sbf(&(ssbf->shards[sharded_sbf_shard(ssbf, data, length)].sbf), data, length);
 }
 
 /**
- * Insert an element to an SBF.
+ * Membership query processing on the element's shard.
  * 
- * sbf: pointer to an SBF
- * data: pointer to element to be inserted
+ * ssbf: pointer to a ShardedSBF
+ * data: pointer to the queried element
  * length: length of data (number of bytes used to calculate hash values)
 */
-void insert_sbf(SBF *sbf, void *data, int length)
+int test_sharded_sbf(ShardedSBF *ssbf, void *data, int length)
+{
+    return test_sbf(&(ssbf->shards[sharded_sbf_shard(ssbf, data, length)].sbf), data, length);
+}
+
+/**
+ * Ratio of zero counters over all shards.
+ * 
+ * ssbf: pointer to a ShardedSBF
+*/
+double sharded_sbf_zero_ratio(ShardedSBF *ssbf)
 {
-    // first decrement P counters
-    for (int i=0; i<sbf->P; ++i)
+    double zeros = 0, total = 0;
+    for (int s=0; s<ssbf->num_shards; ++s)
     {
-        decrement(&(sbf->counters), isaac_next_uint(&(sbf->isaac), sbf->m));
+        SBFStats stats;
+        sbf_stats(&(ssbf->shards[s].sbf), &stats);
+        zeros += stats.zero_counters;
+        total += stats.counters;
     }
-    // then set K counters to Max
-    gen_k_hash32(data, length, sbf->K, sbf->m, sbf->hash_codes);
-    for (int i=0; i<sbf->K; ++i)
+    return zeros / total;
+}
+
+/**
+ * Current false positive rate estimated from the shards' fill. A new key lands on a
+ * shard uniformly at random and is a false positive there with probability
+ * (1 - zero ratio)^K.
+ * 
+ * ssbf: pointer to a ShardedSBF
+*/
+double sharded_sbf_false_positive_rate(ShardedSBF *ssbf)
+{
+    double fpr = 0;
+    for (int s=0; s<ssbf->num_shards; ++s)
     {
-        set_to_max(&(sbf->counters), sbf->hash_codes[i]);
+        SBFStats stats;
+        sbf_stats(&(ssbf->shards[s].sbf), &stats);
+        fpr += stats.false_positive_rate;
     }
+    return fpr / ssbf->num_shards;
 }
 
 /**
- * Membership query processing.
+ * Release memory allocated to a sharded SBF.
  * 
- * sbf: pointer to an SBF
- * data: pointer to element to be inserted
- * length: length of data (number of bytes used to calculate hash values)
+ * ssbf: pointer to a ShardedSBF
 */
-int test_sbf(SBF *sbf, void *data, int length)
+void free_sharded_sbf(ShardedSBF *ssbf)
 {
-    gen_k_hash32(data, length, sbf->K, sbf->m, sbf->hash_codes);
-    for (int i=0; i<sbf->K; ++i)
+    for (int s=0; s<ssbf->num_shards; ++s)
     {
-        if (! test_counter(&(sbf->counters), sbf->hash_codes[i]))
-        {
-            return 0;
-        }
+        free_sbf(&(ssbf->shards[s].sbf));
     }
-    return 1;
+    free(ssbf->shards);
+    ssbf->shards = NULL;
 }
 
+
 /**
- * Release memory allocated to sbf.
+ * [DEBUG USAGE] Print how often each stage decided a learned filter query.
  * 
- * sbf: pointer to an SBF
+ * stats: pointer to QueryStats
 */
-void free_sbf(SBF *sbf)
+void print_query_stats(QueryStats *stats)
 {
-    free_counters(&(sbf->counters));
-    free(sbf->hash_codes);
+    double queries = stats->queries ? (double)stats->queries : 1;
+    printf("queries: %llu, model calls: %llu (%.2f%%), backup calls: %llu (%.2f%%)\n",
+           stats->queries, stats->model_calls, 100 * stats->model_calls / queries,
+           stats->backup_calls, 100 * stats->backup_calls / queries);
+    printf("decided by model: %.2f%%, by backup: %.2f%%, negatives: %.2f%%\n",
+           100 * stats->decided_by_model / queries, 100 * stats->decided_by_backup / queries,
+           100 * stats->negatives / queries);
 }
 
+/**
+ * Score the Data whose backup filter probe missed with one batched model call, and set
+ * their result bits when the model is positive.
+ * 
+ * model: pointer to a Model
+ * raw_tau: decision threshold of the model in raw score space, see raw_threshold
+ * data: array of queried Data objects
+ * misses: indices into data of the backup misses
+ * num_misses: number of backup misses
+ * result: bitmap of query results
+ * stats: pointer to the QueryStats to be updated
+*/
+static void score_backup_misses(Model *model, float raw_tau, Data *data, int *misses, int num_misses, uint64 *result, QueryStats *stats)
+{
+    Data *pending = (Data *)malloc(num_misses * sizeof(Data));
+    float *scores = (float *)malloc(num_misses * sizeof(float));
+    for (int j=0; j<num_misses; ++j)
+    {
+        pending[j] = data[misses[j]];
+    }
+    predict_raw_batch(model, pending, num_misses, scores);
+    stats->model_calls += num_misses;
+    for (int j=0; j<num_misses; ++j)
+    {
+        if (scores[j] > raw_tau)
+        {
+            stats->decided_by_model++;
+            result[misses[j] / 64] |= 1ULL << (misses[j] % 64);
+        }
+        else
+        {
+            stats->negatives++;
+        }
+    }
+    free(pending);
+    free(scores);
+}
 
 /**
  * Init a Learned Bloom filter.
@@ -190,14 +1266,28 @@ void free_sbf(SBF *sbf)
  * m: number of bits used in the backup filter
  * tau: decision threshold of the model
 */
-void init_lbf(LBF *lbf, Model *model, int K, int m, float tau)
+void init_lbf(LBF *lbf, Model *model, int K, uint64 m, float tau)
 {
     BF bf;
     init_bf(&bf, K, m);
 
     lbf->bf = bf;
     lbf->tau = tau;
+    lbf->raw_tau = raw_threshold(model, tau);
     lbf->model = *model;
+    lbf->order = MODEL_FIRST;
+    memset(&(lbf->stats), 0, sizeof(QueryStats));
+}
+
+/**
+ * Choose which stage an LBF query consults first.
+ * 
+ * lbf: pointer to an LBF
+ * order: MODEL_FIRST or BACKUP_FIRST
+*/
+void set_lbf_query_order(LBF *lbf, QueryOrder order)
+{
+    lbf->order = order;
 }
 
 
@@ -210,7 +1300,7 @@ void init_lbf(LBF *lbf, Model *model, int K, int m, float tau)
 */
 void insert_lbf(LBF *lbf, Data *data, int length)
 {
-    if (predict(&(lbf->model), data) < lbf->tau)
+    if (predict_raw(&(lbf->model), data) < lbf->raw_tau)
     {
         insert_bf(&(lbf->bf), &(data->id), length);
     }
@@ -226,14 +1316,128 @@ void insert_lbf(LBF *lbf, Data *data, int length)
 */
 int test_lbf(LBF *lbf, Data *data, int length)
 {
-    if (predict(&(lbf->model), data) > lbf->tau)
+    lbf->stats.queries++;
+    if (lbf->order == BACKUP_FIRST)
+    {
+        lbf->stats.backup_calls++;
+        if (test_bf(&(lbf->bf), &(data->id), length))
+        {
+            lbf->stats.decided_by_backup++;
+            return 1;
+        }
+        lbf->stats.model_calls++;
+        if (predict_raw(&(lbf->model), data) > lbf->raw_tau)
+        {
+            lbf->stats.decided_by_model++;
+            return 1;
+        }
+        lbf->stats.negatives++;
+        return 0;
+    }
+
+    lbf->stats.model_calls++;
+    if (predict_raw(&(lbf->model), data) > lbf->raw_tau)
     {
+        lbf->stats.decided_by_model++;
         return 1;
     }
     else
     {
-        return test_bf(&(lbf->bf), &(data->id), length);
+        lbf->stats.backup_calls++;
+        if (test_bf(&(lbf->bf), &(data->id), length))
+        {
+            lbf->stats.decided_by_backup++;
+            return 1;
+        }
+        lbf->stats.negatives++;
+        return 0;
+    }
+}
+
+/**
+ * Insert a batch of elements to the learned Bloom filter. The model scores the whole
+ * batch in one call, then keys below tau are routed to the backup filter.
+ * 
+ * lbf: pointer to an LBF
+ * data: array of n Data objects to be inserted
+ * length: number of bytes to be used to calculate hash codes
+ * n: number of Data objects
+*/
+void insert_lbf_batch(LBF *lbf, Data *data, int length, int n)
+{
+    float *scores = (float *)malloc(n * sizeof(float));
+    predict_raw_batch(&(lbf->model), data, n, scores);
+    for (int i=0; i<n; ++i)
+    {
+        if (scores[i] < lbf->raw_tau)
+        {
+            insert_bf(&(lbf->bf), &(data[i].id), length);
+        }
+    }
+    free(scores);
+}
+
+/**
+ * Batched membership test query processing.
+ * 
+ * lbf: pointer to an LBF
+ * data: array of n queried Data objects
+ * length: number of bytes to be used to calculate hash codes
+ * n: number of Data objects
+ * result: bitmap of (n + 63) / 64 words, bit i is set iff data[i] is reported present
+*/
+void test_lbf_batch(LBF *lbf, Data *data, int length, int n, uint64 *result)
+{
+    memset(result, 0, (n + 63) / 64 * sizeof(uint64));
+    lbf->stats.queries += n;
+    if (lbf->order == BACKUP_FIRST)
+    {
+        int *misses = (int *)malloc(n * sizeof(int));
+        int num_misses = 0;
+        lbf->stats.backup_calls += n;
+        for (int i=0; i<n; ++i)
+        {
+            if (test_bf(&(lbf->bf), &(data[i].id), length))
+            {
+                lbf->stats.decided_by_backup++;
+                result[i / 64] |= 1ULL << (i % 64);
+            }
+            else
+            {
+                misses[num_misses++] = i;
+            }
+        }
+        score_backup_misses(&(lbf->model), lbf->raw_tau, data, misses, num_misses, result, &(lbf->stats));
+        free(misses);
+        return;
+    }
+
+    float *scores = (float *)malloc(n * sizeof(float));
+    predict_raw_batch(&(lbf->model), data, n, scores);
+    lbf->stats.model_calls += n;
+    for (int i=0; i<n; ++i)
+    {
+        int present = 1;
+        if (scores[i] > lbf->raw_tau)
+        {
+            lbf->stats.decided_by_model++;
+        }
+        else
+        {
+            lbf->stats.backup_calls++;
+            present = test_bf(&(lbf->bf), &(data[i].id), length);
+            if (present)
+            {
+                lbf->stats.decided_by_backup++;
+            }
+            else
+            {
+                lbf->stats.negatives++;
+            }
+        }
+        result[i / 64] |= (uint64)present << (i % 64);
     }
+    free(scores);
 }
 
 /**
@@ -244,10 +1448,7 @@ int test_lbf(LBF *lbf, Data *data, int length)
 void free_lbf(LBF *lbf)
 {
     free_bf(&(lbf->bf));
-    if (lbf->model.catboost_model_handle)
-    {
-        ModelCalcerDelete(lbf->model.catboost_model_handle);
-    }
+    free_model(&(lbf->model));
 }
 
 /**
@@ -261,7 +1462,7 @@ void free_lbf(LBF *lbf)
  * bits_per_counter: bits used per counter
  * tau: decision threshold of the model
 */
-void init_sslbf(SSLBF *sslbf, Model *model, int P, int K, int m, int bits_per_counter, float tau)
+void init_sslbf(SSLBF *sslbf, Model *model, int P, int K, uint64 m, int bits_per_counter, float tau)
 {
     SBF sbf;
     init_sbf(&sbf, P, K, m, bits_per_counter);
@@ -269,6 +1470,20 @@ void init_sslbf(SSLBF *sslbf, Model *model, int P, int K, int m, int bits_per_co
     sslbf->sbf = sbf;
     sslbf->model = *model;
     sslbf->tau = tau;
+    sslbf->raw_tau = raw_threshold(model, tau);
+    sslbf->order = MODEL_FIRST;
+    memset(&(sslbf->stats), 0, sizeof(QueryStats));
+}
+
+/**
+ * Choose which stage an SSLBF query consults first.
+ * 
+ * sslbf: pointer to an SSLBF
+ * order: MODEL_FIRST or BACKUP_FIRST
+*/
+void set_sslbf_query_order(SSLBF *sslbf, QueryOrder order)
+{
+    sslbf->order = order;
 }
 
 /**
@@ -280,7 +1495,7 @@ void init_sslbf(SSLBF *sslbf, Model *model, int P, int K, int m, int bits_per_co
 */
 void insert_sslbf(SSLBF *sslbf, Data *data, int length)
 {
-    if (predict(&(sslbf->model), data) < sslbf->tau)
+    if (predict_raw(&(sslbf->model), data) < sslbf->raw_tau)
     {
         insert_sbf(&(sslbf->sbf), &(data->id), length);
     }
@@ -295,14 +1510,128 @@ void insert_sslbf(SSLBF *sslbf, Data *data, int length)
 */
 int test_sslbf(SSLBF *sslbf, Data *data, int length)
 {
-    if (predict(&(sslbf->model), data) > sslbf->tau)
+    sslbf->stats.queries++;
+    if (sslbf->order == BACKUP_FIRST)
+    {
+        sslbf->stats.backup_calls++;
+        if (test_sbf(&(sslbf->sbf), &(data->id), length))
+        {
+            sslbf->stats.decided_by_backup++;
+            return 1;
+        }
+        sslbf->stats.model_calls++;
+        if (predict_raw(&(sslbf->model), data) > sslbf->raw_tau)
+        {
+            sslbf->stats.decided_by_model++;
+            return 1;
+        }
+        sslbf->stats.negatives++;
+        return 0;
+    }
+
+    sslbf->stats.model_calls++;
+    if (predict_raw(&(sslbf->model), data) > sslbf->raw_tau)
     {
+        sslbf->stats.decided_by_model++;
         return 1;
     }
     else
     {
-        return test_sbf(&(sslbf->sbf), &(data->id), length);
+        sslbf->stats.backup_calls++;
+        if (test_sbf(&(sslbf->sbf), &(data->id), length))
+        {
+            sslbf->stats.decided_by_backup++;
+            return 1;
+        }
+        sslbf->stats.negatives++;
+        return 0;
+    }
+}
+
+/**
+ * Insert a batch of elements to the SSLBF. The model scores the whole batch in one call,
+ * then keys below tau are routed to the backup SBF.
+ * 
+ * sslbf: pointer to an SSLBF
+ * data: array of n Data objects to be inserted
+ * length: number of bytes to be used to calculate hash codes
+ * n: number of Data objects
+*/
+void insert_sslbf_batch(SSLBF *sslbf, Data *data, int length, int n)
+{
+    float *scores = (float *)malloc(n * sizeof(float));
+    predict_raw_batch(&(sslbf->model), data, n, scores);
+    for (int i=0; i<n; ++i)
+    {
+        if (scores[i] < sslbf->raw_tau)
+        {
+            insert_sbf(&(sslbf->sbf), &(data[i].id), length);
+        }
+    }
+    free(scores);
+}
+
+/**
+ * Batched membership test query processing.
+ * 
+ * sslbf: pointer to an SSLBF
+ * data: array of n queried Data objects
+ * length: number of bytes to be used to calculate hash codes
+ * n: number of Data objects
+ * result: bitmap of (n + 63) / 64 words, bit i is set iff data[i] is reported present
+*/
+void test_sslbf_batch(SSLBF *sslbf, Data *data, int length, int n, uint64 *result)
+{
+    memset(result, 0, (n + 63) / 64 * sizeof(uint64));
+    sslbf->stats.queries += n;
+    if (sslbf->order == BACKUP_FIRST)
+    {
+        int *misses = (int *)malloc(n * sizeof(int));
+        int num_misses = 0;
+        sslbf->stats.backup_calls += n;
+        for (int i=0; i<n; ++i)
+        {
+            if (test_sbf(&(sslbf->sbf), &(data[i].id), length))
+            {
+                sslbf->stats.decided_by_backup++;
+                result[i / 64] |= 1ULL << (i % 64);
+            }
+            else
+            {
+                misses[num_misses++] = i;
+            }
+        }
+        score_backup_misses(&(sslbf->model), sslbf->raw_tau, data, misses, num_misses, result, &(sslbf->stats));
+        free(misses);
+        return;
+    }
+
+    float *scores = (float *)malloc(n * sizeof(float));
+    predict_raw_batch(&(sslbf->model), data, n, scores);
+    sslbf->stats.model_calls += n;
+    for (int i=0; i<n; ++i)
+    {
+        int present = 1;
+        if (scores[i] > sslbf->raw_tau)
+        {
+            sslbf->stats.decided_by_model++;
+        }
+        else
+        {
+            sslbf->stats.backup_calls++;
+            present = test_sbf(&(sslbf->sbf), &(data[i].id), length);
+            if (present)
+            {
+                sslbf->stats.decided_by_backup++;
+            }
+            else
+            {
+                sslbf->stats.negatives++;
+            }
+        }
+        result[i / 64] |= (uint64)present << (i % 64);
     }
+    free(scores);
 }
 
 /**
@@ -312,16 +1641,19 @@ int test_sslbf(SSLBF *sslbf, Data *data, int length)
 */
 void free_sslbf(SSLBF *sslbf)
 {
-    ModelCalcerDelete(&(sslbf->model));
+    free_model(&(sslbf->model));
     free_sbf(&(sslbf->sbf));
 }
 
 /**
- * Find idx of x belonging to which interval
+ * Find idx of x belonging to which interval. intervals holds the len bounds of len - 1
+ * intervals; x below the first bound falls in the first interval and x above the last
+ * bound in the last one, so the result is always a valid group of a GSLBF.
 */
 static int lookup_interval(float *intervals, int len, float x)
 {
-    int lo = 0, hi = len;
+    PERF_BEGIN(PERF_INTERVAL);
+    int lo = 0, hi = len - 1;
     int idx;
     while ((hi - lo) > 1)
     {
@@ -335,6 +1667,7 @@ static int lookup_interval(float *intervals, int len, float x)
             hi = idx;
         }
     }
+    PERF_END(PERF_INTERVAL);
     return lo;
 }
 
@@ -350,7 +1683,7 @@ static int lookup_interval(float *intervals, int len, float x)
  * tau_array: array of decision thresholds [of size g+1]
  * g: number of groups
 */
-void init_gslbf(GSLBF *gslbf, Model *model, int *P_array, int *K_array, int *m_array, int *bits_per_counter_array, float *tau_array, int g)
+void init_gslbf(GSLBF *gslbf, Model *model, int *P_array, int *K_array, uint64 *m_array, int *bits_per_counter_array, float *tau_array, int g)
 {
     SBF *SBF_array = (SBF *)malloc(g * sizeof(SBF));
     for (int i=0; i<g; ++i)
@@ -362,6 +1695,11 @@ void init_gslbf(GSLBF *gslbf, Model *model, int *P_array, int *K_array, int *m_a
     gslbf->SBF_array = SBF_array;
     gslbf->model = *model;
     gslbf->tau_array = tau_array;
+    gslbf->raw_tau_array = (float *)malloc((g + 1) * sizeof(float));
+    for (int i=0; i<=g; ++i)
+    {
+        gslbf->raw_tau_array[i] = raw_threshold(model, tau_array[i]);
+    }
     gslbf->g = g;
 }
 
@@ -374,9 +1712,9 @@ void init_gslbf(GSLBF *gslbf, Model *model, int *P_array, int *K_array, int *m_a
 */
 void insert_gslbf(GSLBF *gslbf, Data *data, int length)
 {
-    float score = predict(&(gslbf->model), data);
-    int idx = lookup_interval(gslbf->tau_array, gslbf->g + 1, score);
-    insert_sbf(&(gslbf->SBF_array[idx]), data, length);
+    float score = predict_raw(&(gslbf->model), data);
+    int idx = lookup_interval(gslbf->raw_tau_array, gslbf->g + 1, score);
+    insert_sbf(&(gslbf->SBF_array[idx]), &(data->id), length);
 }
 
 /**
@@ -388,19 +1726,70 @@ void insert_gslbf(GSLBF *gslbf, Data *data, int length)
 */
 int test_gslbf(GSLBF *gslbf, Data *data, int length)
 {
-    float score = predict(&(gslbf->model), data);
-    int idx = lookup_interval(gslbf->tau_array, gslbf->g + 1, score);
-    return test_sbf(&(gslbf->SBF_array[idx]), data, length);
+    float score = predict_raw(&(gslbf->model), data);
+    int idx = lookup_interval(gslbf->raw_tau_array, gslbf->g + 1, score);
+    return test_sbf(&(gslbf->SBF_array[idx]), &(data->id), length);
+}
+
+/**
+ * Insert a batch of elements to the GSLBF. The model scores the whole batch in one call,
+ * then each key is routed to the SBF of its score interval.
+ * 
+ * gslbf: pointer to an GSLBF
+ * data: array of n Data objects to be inserted
+ * length: number of bytes to be used to calculate hash codes
+ * n: number of Data objects
+*/
+void insert_gslbf_batch(GSLBF *gslbf, Data *data, int length, int n)
+{
+    float *scores = (float *)malloc(n * sizeof(float));
+    predict_raw_batch(&(gslbf->model), data, n, scores);
+    for (int i=0; i<n; ++i)
+    {
+        int idx = lookup_interval(gslbf->raw_tau_array, gslbf->g + 1, scores[i]);
+        insert_sbf(&(gslbf->SBF_array[idx]), &(data[i].id), length);
+    }
+    free(scores);
+}
+
+/**
+ * Batched membership test query processing.
+ * 
+ * gslbf: pointer to an GSLBF
+ * data: array of n queried Data objects
+ * length: number of bytes to be used to calculate hash codes
+ * n: number of Data objects
+ * result: bitmap of (n + 63) / 64 words, bit i is set iff data[i] is reported present
+*/
+void test_gslbf_batch(GSLBF *gslbf, Data *data, int length, int n, uint64 *result)
+{
+    float *scores = (float *)malloc(n * sizeof(float));
+    predict_raw_batch(&(gslbf->model), data, n, scores);
+    memset(result, 0, (n + 63) / 64 * sizeof(uint64));
+    for (int i=0; i<n; ++i)
+    {
+        int idx = lookup_interval(gslbf->raw_tau_array, gslbf->g + 1, scores[i]);
+        int present = test_sbf(&(gslbf->SBF_array[idx]), &(data[i].id), length);
+        result[i / 64] |= (uint64)present << (i % 64);
+    }
+    free(scores);
 }
 
 /**
- * Release memory allocated to gslbf.
+ * Release memory allocated to gslbf, including its model. tau_array is left to the
+ * caller of init_gslbf.
  * 
  * gslbf: pointer to an GSLBF
 */
 void free_gslbf(GSLBF *gslbf)
 {
-    ModelCalcerDelete(&(gslbf->model));
+    free_model(&(gslbf->model));
+    for (int i=0; i<gslbf->g; ++i)
+    {
+        free_sbf(&(gslbf->SBF_array[i]));
+    }
     free(gslbf->SBF_array);
     gslbf->SBF_array = NULL;
+    free(gslbf->raw_tau_array);
+    gslbf->raw_tau_array = NULL;
 }
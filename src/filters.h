@@ -3,53 +3,211 @@
 
 #include "./bitutils.h"
 #include "./model.h"
+#include "./rng.h"
 #include "../include/isaac.h"
+#include "pthread.h"
+
+// Hash value generation
+typedef enum HashMode
+{
+    HASH_XXH32_MOD,      // two XXH32 calls reduced with % m (original layout of existing filters)
+    HASH_XXH64_FASTRANGE // one XXH64 call reduced with multiply-shift
+} HashMode;
+
+void gen_k_hash(HashMode mode, const void *data, int length, int k, uint64 m, uint64 *hash_codes);
+
 
 // Standard Bloom Filters
 typedef struct BF
 {
     CounterBitSet bitset;
-    unsigned int *hash_codes;
+    uint64 *hash_codes;
     int K;
-    int m;
+    uint64 m;
+    HashMode hash_mode;
 } BF;
 
-void init_bf(BF *bf, int K, int m);
+void init_bf(BF *bf, int K, uint64 m);
+void init_bf_with_hash(BF *bf, int K, uint64 m, HashMode hash_mode);
 void insert_bf(BF *bf, void *data, int length);
 int test_bf(BF *bf, void *data, int length);
+void test_bf_batch(BF *bf, void *data, int length, int n, int batch_size, uint64 *result);
+void insert_bf_concurrent(BF *bf, void *data, int length);
+int test_bf_concurrent(BF *bf, void *data, int length);
 void free_bf(BF *bf);
+double bf_false_positive_rate(int K, uint64 m, uint64 n);
+
+
+// Blocked Bloom Filters (all K bits of a key lie in one cache line)
+typedef struct BBF
+{
+    CounterBitSet bitset;
+    uint64 *hash_codes;
+    int K;
+    uint64 m; // rounded up to a multiple of the block size
+    uint64 num_blocks;
+} BBF;
+
+void init_bbf(BBF *bbf, int K, uint64 m);
+void insert_bbf(BBF *bbf, void *data, int length);
+int test_bbf(BBF *bbf, void *data, int length);
+void free_bbf(BBF *bbf);
+double bbf_false_positive_rate(int K, uint64 m, uint64 n);
+uint64 bbf_bits_for_fpr(int K, uint64 n, double fpr);
 
 
 // Stable Bloom Filters
+typedef enum DecrementMode
+{
+    DECREMENT_RANDOM, // P independent random counters per insert
+    DECREMENT_RANGE,  // P consecutive counters from one random position (wrapping)
+    DECREMENT_TIMED   // no decrements on insert, counters are aged by an SBFAger
+} DecrementMode;
+
+typedef struct SBFOptions
+{
+    CounterLayout layout;
+    HashMode hash_mode;
+    DecrementMode decrement_mode;
+    RngMode rng;
+} SBFOptions;
+
 typedef struct SBF
 {
     CounterBitSet counters;
+    RngMode rng;
     isaac_ctx isaac;
-    unsigned int *hash_codes;
+    WyRand wyrand;
+    uint64 *index_block; // pre-generated wyrand counter indices
+    int block_pos;       // next unused entry of index_block
+    uint64 *hash_codes;
     int P;
     int K;
-    int m;
+    uint64 m;
     int bits_per_counter;
+    HashMode hash_mode;
+    DecrementMode decrement_mode;
+    // insert/test routines specialized for the counter width, chosen at init
+    void (*insert_fn)(struct SBF *sbf, void *data, int length);
+    int (*test_fn)(struct SBF *sbf, void *data, int length);
 } SBF;
 
-void init_sbf(SBF *sbf, int P, int K, int m, int bits_per_counter);
+void default_sbf_options(SBFOptions *options);
+void init_sbf(SBF *sbf, int P, int K, uint64 m, int bits_per_counter);
+void init_sbf_with_options(SBF *sbf, int P, int K, uint64 m, int bits_per_counter, SBFOptions *options);
+void init_sbf_with_counters(SBF *sbf, int P, int K, CounterBitSet *counters, SBFOptions *options);
 void insert_sbf(SBF *sbf, void *data, int length);
 int test_sbf(SBF *sbf, void *data, int length);
+void test_sbf_batch(SBF *sbf, void *data, int length, int n, int batch_size, uint64 *result);
 void free_sbf(SBF *sbf);
 
+typedef struct SBFStats
+{
+    uint64 counters;
+    uint64 zero_counters;
+    double zero_ratio;
+    double false_positive_rate; // current rate, (1 - zero_ratio)^K
+} SBFStats;
+
+void sbf_stats(SBF *sbf, SBFStats *stats);
+void recount_sbf_stats(SBF *sbf, SBFStats *stats);
+
+// Per-thread handle for concurrent SBF inserts
+typedef struct SBFWriter
+{
+    SBF *sbf;
+    isaac_ctx isaac;
+    WyRand wyrand;
+    uint64 decremented; // counters actually decremented by this writer
+    uint64 added;       // total amount added to counters by set_to_max
+} SBFWriter;
+
+void init_sbf_writer(SBFWriter *writer, SBF *sbf, int writer_id);
+void insert_sbf_concurrent(SBFWriter *writer, void *data, int length);
+int test_sbf_concurrent(SBF *sbf, void *data, int length);
+
+
+// Wall-clock aging of a DECREMENT_TIMED SBF by a background thread
+typedef struct SBFAger
+{
+    SBF *sbf;
+    double retention;   // seconds for a counter at max to reach zero without new inserts
+    double interval;    // seconds between two sweeps
+    uint64 cursor;      // next counter to be decremented, sweeps roll over the array
+    double owed;        // fractional counter decrements carried to the next sweep
+    double last_time;   // time of the last sweep
+    uint64 sweeps;
+    uint64 decremented; // counter decrements done (counters visited, zero or not)
+    int running;
+    pthread_t thread;
+} SBFAger;
+
+void start_sbf_ager(SBFAger *ager, SBF *sbf, double retention, double interval);
+void advance_sbf_ager(SBFAger *ager, double elapsed);
+void stop_sbf_ager(SBFAger *ager);
+
+
+// Sharded Stable Bloom Filters
+typedef struct SBFShard
+{
+    SBF sbf;
+} __attribute__((aligned(CACHE_LINE_BYTES))) SBFShard; // shards never share a cache line
+
+typedef struct ShardedSBF
+{
+    SBFShard *shards;
+    int num_shards;
+} ShardedSBF;
+
+void init_sharded_sbf(ShardedSBF *ssbf, int num_shards, int P, int K, uint64 m, int bits_per_counter, SBFOptions *options);
+int sharded_sbf_shard(ShardedSBF *ssbf, void *data, int length);
+void insert_sharded_sbf(ShardedSBF *ssbf, void *data, int length);
+int test_sharded_sbf(ShardedSBF *ssbf, void *data, int length);
+double sharded_sbf_zero_ratio(ShardedSBF *ssbf);
+double sharded_sbf_false_positive_rate(ShardedSBF *ssbf);
+void free_sharded_sbf(ShardedSBF *ssbf);
+
+
+// Query order of learned filters with a single backup filter. Both orders give the same
+// answer (model positive OR backup positive), BACKUP_FIRST skips the model on backup hits.
+typedef enum QueryOrder
+{
+    MODEL_FIRST,
+    BACKUP_FIRST
+} QueryOrder;
+
+// Which stage decided each query answer
+typedef struct QueryStats
+{
+    uint64 queries;
+    uint64 model_calls;
+    uint64 backup_calls;
+    uint64 decided_by_model;  // positive from the model
+    uint64 decided_by_backup; // positive from the backup filter
+    uint64 negatives;         // both stages consulted
+} QueryStats;
+
+void print_query_stats(QueryStats *stats);
+
 
 // Learned Bloom Filters
 typedef struct LBF
 {
     Model model;
     float tau;
+    float raw_tau; // tau in raw score space, compared against predict_raw
     BF bf;
+    QueryOrder order;
+    QueryStats stats;
 } LBF;
 
 
-void init_lbf(LBF *lbf, Model *model, int K, int m, float tau);
+void init_lbf(LBF *lbf, Model *model, int K, uint64 m, float tau);
+void set_lbf_query_order(LBF *lbf, QueryOrder order);
 void insert_lbf(LBF *lbf, Data *data, int length);
 int test_lbf(LBF *lbf, Data *data, int length);
+void insert_lbf_batch(LBF *lbf, Data *data, int length, int n);
+void test_lbf_batch(LBF *lbf, Data *data, int length, int n, uint64 *result);
 void free_lbf(LBF *lbf);
 
 
@@ -58,13 +216,19 @@ typedef struct SSLBF
 {
     Model model;
     float tau;
+    float raw_tau; // tau in raw score space, compared against predict_raw
     SBF sbf;
+    QueryOrder order;
+    QueryStats stats;
 } SSLBF;
 
 
-void init_sslbf(SSLBF *sslbf, Model *model, int P, int K, int m, int bits_per_counter, float tau);
+void init_sslbf(SSLBF *sslbf, Model *model, int P, int K, uint64 m, int bits_per_counter, float tau);
+void set_sslbf_query_order(SSLBF *sslbf, QueryOrder order);
 void insert_sslbf(SSLBF *sslbf, Data *data, int length);
 int test_sslbf(SSLBF *sslbf, Data *data, int length);
+void insert_sslbf_batch(SSLBF *sslbf, Data *data, int length, int n);
+void test_sslbf_batch(SSLBF *sslbf, Data *data, int length, int n, uint64 *result);
 void free_sslbf(SSLBF *sslbf);
 
 // Grouping Stable Learned Bloom Filters
@@ -72,13 +236,16 @@ typedef struct GSLBF
 {
     Model model;
     float *tau_array;
+    float *raw_tau_array; // tau_array in raw score space
     SBF *SBF_array;
     int g;
 } GSLBF;
 
-void init_gslbf(GSLBF *gslbf, Model *model, int *P_array, int *K_array, int *m_array, int *bits_per_counter_array, float *tau_array, int g);
+void init_gslbf(GSLBF *gslbf, Model *model, int *P_array, int *K_array, uint64 *m_array, int *bits_per_counter_array, float *tau_array, int g);
 void insert_gslbf(GSLBF *gslbf, Data *data, int length);
 int test_gslbf(GSLBF *gslbf, Data *data, int length);
+void insert_gslbf_batch(GSLBF *gslbf, Data *data, int length, int n);
+void test_gslbf_batch(GSLBF *gslbf, Data *data, int length, int n, uint64 *result);
 void free_gslbf(GSLBF *gslbf);
 
 #endif
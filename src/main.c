@@ -3,14 +3,22 @@
 #include "stdlib.h"
 #include "math.h"
 #include "time.h"
+#include "assert.h"
+#include "pthread.h"
 
 #ifdef WIN32
 #include <windows.h>
 #else
 #include <unistd.h>
+#include <sys/wait.h>
 #endif
 
 #include "./filters.h"
+#include "./persist.h"
+#include "./simd.h"
+#include "./workload.h"
+#include "./perfstat.h"
+#include "./dataset.h"
 #include "../include/isaac.h"
 
 #define PI 3.14159265358979
@@ -27,10 +35,20 @@ static float gauss_rand(isaac_ctx *isaac)
     return cosf(2 * PI * v) * sqrtf(-2 * logf(u));
 }
 
+/**
+ * Monotonic wall-clock time in seconds.
+*/
+static double now_seconds()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
 /**
  * Test standard Bloom filter performance.
 */
-static void exp_bf()
+static void exp_bf(HashMode hash_mode)
 {
     // setting of expected 10000000 elements with 0.01 false positive rate
     int max_range = 10000000;
@@ -38,20 +56,20 @@ static void exp_bf()
     int k = 6;
 
     BF bf;
-    init_bf(&bf, k, m);
+    init_bf_with_hash(&bf, k, m, hash_mode);
 
-    clock_t start, end;
+    double start, end;
     
-    start = clock();
+    start = now_seconds();
     for (int i=0; i<max_range; ++i)
     {
         insert_bf(&bf, &i, sizeof(int));
     }
-    end = clock();
-    printf("Inserting %d items using time: %.3f sec.\n", max_range, (end - start)/(float)CLOCKS_PER_SEC);
+    end = now_seconds();
+    printf("Inserting %d items using time: %.3f sec.\n", max_range, end - start);
 
     // test query
-    start = clock();
+    start = now_seconds();
     for (int i=0; i<max_range; ++i)
     {
         if (! test_bf(&bf, &i, sizeof(int)))
@@ -65,9 +83,9 @@ static void exp_bf()
             printf("false negative %d\n", i);
         }
     }
-    end = clock();
+    end = now_seconds();
     printf("pass false negative test.\n");
-    printf("Querying %d items using time: %.3f sec.\n", max_range, (end - start)/(float)CLOCKS_PER_SEC);
+    printf("Querying %d items using time: %.3f sec.\n", max_range, end - start);
 
     // false positive rate
     int wrong = 0;
@@ -86,25 +104,69 @@ static void exp_bf()
 }
 
 /**
- * Calculate the ratio of counters with zero in an SBF.
+ * Test blocked Bloom filter performance, sized for the same FPR as exp_bf.
 */
-static float get_zero_ratio(SBF *sbf)
+static void exp_bbf()
 {
-    int zero_count = 0;
-    for (int i=0; i<sbf->m; i++)
+    int max_range = 10000000;
+    int k = 6;
+    uint64 m = bbf_bits_for_fpr(k, max_range, 0.01);
+    printf("blocked BF uses %llu bits (standard BF: %d bits).\n", m, (int)(max_range * 9.584));
+
+    BBF bbf;
+    init_bbf(&bbf, k, m);
+
+    double start, end;
+
+    start = now_seconds();
+    for (int i=0; i<max_range; ++i)
+    {
+        insert_bbf(&bbf, &i, sizeof(int));
+    }
+    end = now_seconds();
+    printf("Inserting %d items using time: %.3f sec.\n", max_range, end - start);
+
+    start = now_seconds();
+    for (int i=0; i<max_range; ++i)
     {
-        if (! test_counter(&(sbf->counters), i))
+        if (! test_bbf(&bbf, &i, sizeof(int)))
         {
-            zero_count ++;
+            printf("false negative %d\n", i);
+        }
+    }
+    end = now_seconds();
+    printf("pass false negative test.\n");
+    printf("Querying %d items using time: %.3f sec.\n", max_range, end - start);
+
+    int wrong = 0;
+    int total = 0;
+    for (int i=max_range; i<max_range * 2; ++i)
+    {
+        if (test_bbf(&bbf, &i, sizeof(int)))
+        {
+            wrong++;
         }
+        total++;
     }
-    return (float)zero_count / sbf->m;
+
+    printf("false positive rate is: %.5f (expected %.5f)\n", (float)wrong / total, bbf_false_positive_rate(k, bbf.m, max_range));
+    free_bbf(&bbf);
+}
+
+/**
+ * Ratio of counters with zero in an SBF, kept up to date by the filter.
+*/
+static float get_zero_ratio(SBF *sbf)
+{
+    SBFStats stats;
+    sbf_stats(sbf, &stats);
+    return (float)stats.zero_ratio;
 }
 
 /**
- * Test SBF performance.
+ * Test SBF performance. The zero rate converges to the stable point of the decrement mode.
 */
-static void exp_sbf()
+static void exp_sbf(CounterLayout layout, DecrementMode decrement_mode)
 {
     int max_range = 100000;
     int m = 10000;
@@ -112,8 +174,18 @@ static void exp_sbf()
     int P = 6;
     int bits_per_counter = 3;
 
+    SBFOptions options;
+    default_sbf_options(&options);
+    options.layout = layout;
+    options.decrement_mode = decrement_mode;
+
     SBF sbf;
-    init_sbf(&sbf, P, K, m, bits_per_counter);
+    init_sbf_with_options(&sbf, P, K, m, bits_per_counter, &options);
+    printf("%s layout, memory overhead: %.2f%%\n", layout == LAYOUT_PADDED ? "padded" : "packed", 100 * counters_overhead(&(sbf.counters)));
+    if (decrement_mode == DECREMENT_RANGE)
+    {
+        printf("decrementing %d consecutive counters per insert\n", P);
+    }
 
     // insert
     for (int i=0; i<max_range; ++i)
@@ -128,12 +200,2249 @@ static void exp_sbf()
     free_sbf(&sbf);
 }
 
-int main(int argc, char const *argv[])
+/**
+ * Test SBF insert throughput with the exp_sbf configuration.
+*/
+static void exp_sbf_throughput(CounterLayout layout, DecrementMode decrement_mode)
+{
+    int max_range = 10000000;
+    int m = 10000;
+    int K = 6;
+    int P = 6;
+    int bits_per_counter = 3;
+
+    SBFOptions options;
+    default_sbf_options(&options);
+    options.layout = layout;
+    options.decrement_mode = decrement_mode;
+
+    SBF sbf;
+    init_sbf_with_options(&sbf, P, K, m, bits_per_counter, &options);
+
+    double start, end;
+    start = now_seconds();
+    for (int i=0; i<max_range; ++i)
+    {
+        insert_sbf(&sbf, &i, sizeof(int));
+    }
+    end = now_seconds();
+    float seconds = end - start;
+    printf("%s layout, %s decrement: inserting %d items using time: %.3f sec (%.2f M inserts/sec).\n",
+           layout == LAYOUT_PADDED ? "padded" : "packed", decrement_mode == DECREMENT_RANGE ? "range" : "random",
+           max_range, seconds, max_range / seconds / 1e6);
+
+    free_sbf(&sbf);
+}
+
+/**
+ * Compare a sweep decrementing every counter one by one against decrement_range, and check
+ * that both leave the same counters.
+ * 
+ * bits_per_counter: counter width
+ * layout: counter layout
+*/
+static void exp_bulk_decrement(int bits_per_counter, CounterLayout layout)
+{
+    uint64 m = 1 << 24;
+    CounterBitSet one, bulk;
+    init_counters_with_layout(&one, m, bits_per_counter, layout);
+    init_counters_with_layout(&bulk, m, bits_per_counter, layout);
+    for (uint64 i=0; i<m; i+=3)
+    {
+        set_to_max(&one, i);
+        set_to_max(&bulk, i);
+    }
+
+    int rounds = 8;
+    double one_time = 0, bulk_time = 0;
+    for (int r=0; r<rounds; ++r)
+    {
+        double start = now_seconds();
+        for (uint64 i=0; i<m; ++i)
+        {
+            decrement(&one, i);
+        }
+        one_time += now_seconds() - start;
+
+        start = now_seconds();
+        decrement_range(&bulk, 0, m);
+        bulk_time += now_seconds() - start;
+    }
+    assert(memcmp(one.raw_bits, bulk.raw_bits, one.num_bins * sizeof(uint32)) == 0);
+
+    printf("%d-bit %s: per counter %.3f ns/counter, decrement_range %.3f ns/counter (%.1fx)\n",
+           bits_per_counter, layout == LAYOUT_PADDED ? "padded" : "packed",
+           1e9 * one_time / rounds / m, 1e9 * bulk_time / rounds / m, one_time / bulk_time);
+
+    free_counters(&one);
+    free_counters(&bulk);
+}
+
+/**
+ * Test wall-clock aging. A burst of keys is inserted into a DECREMENT_TIMED SBF and queried
+ * again as time passes: keys must stay present for about (max - 1) / max of the retention
+ * window and be gone after it, whatever the insert rate was. Also compares the insert cost
+ * with the per-insert random decrements.
+*/
+static void exp_sbf_timed()
+{
+    int burst = 100000;
+    uint64 m = 1 << 22;
+    double retention = 2.0;
+    SBFOptions options;
+    default_sbf_options(&options);
+    options.layout = LAYOUT_PADDED;
+    options.decrement_mode = DECREMENT_TIMED;
+    SBF sbf;
+    init_sbf_with_options(&sbf, 6, 6, m, 3, &options);
+
+    SBFAger ager;
+    start_sbf_ager(&ager, &sbf, retention, 0.01);
+    double start = now_seconds();
+    for (int i=0; i<burst; ++i)
+    {
+        insert_sbf(&sbf, &i, sizeof(int));
+    }
+    double insert_time = now_seconds() - start;
+
+    for (int step=1; step<=10; ++step)
+    {
+        usleep(250000);
+        int present = 0;
+        for (int i=0; i<burst; ++i)
+        {
+            present += test_sbf(&sbf, &i, sizeof(int));
+        }
+        printf("%.2f s: %.2f%% of the burst present, zero rate %.2f%%\n",
+               now_seconds() - start, 100.0 * present / burst, 100 * get_zero_ratio(&sbf));
+    }
+    stop_sbf_ager(&ager);
+    printf("%llu sweeps, %.2f full passes\n", ager.sweeps, (double)ager.decremented / m);
+    free_sbf(&sbf);
+
+    options.decrement_mode = DECREMENT_RANDOM;
+    init_sbf_with_options(&sbf, 6, 6, m, 3, &options);
+    double random_start = now_seconds();
+    for (int i=0; i<burst; ++i)
+    {
+        insert_sbf(&sbf, &i, sizeof(int));
+    }
+    double random_time = now_seconds() - random_start;
+    printf("insert: timed %.1f ns, random decrements %.1f ns\n", 1e9 * insert_time / burst, 1e9 * random_time / burst);
+    free_sbf(&sbf);
+}
+
+/**
+ * Compare the cost of monitoring the zero rate of a large SBF: the former scan with
+ * test_counter, the popcount recount and the live count, which must all agree.
+ * 
+ * layout: counter layout
+ * bits_per_counter: counter width
+*/
+static void exp_zero_tracking(CounterLayout layout, int bits_per_counter)
+{
+    uint64 m = 1ULL << 28;
+    SBFOptions options;
+    default_sbf_options(&options);
+    options.layout = layout;
+    SBF sbf;
+    init_sbf_with_options(&sbf, 6, 6, m, bits_per_counter, &options);
+    for (int i=0; i<10000000; ++i)
+    {
+        insert_sbf(&sbf, &i, sizeof(int));
+    }
+
+    double start = now_seconds();
+    uint64 scanned = 0;
+    for (uint64 i=0; i<m; ++i)
+    {
+        scanned += ! test_counter(&(sbf.counters), i);
+    }
+    double scan_time = now_seconds() - start;
+
+    SBFStats live, recount;
+    start = now_seconds();
+    sbf_stats(&sbf, &live);
+    double live_time = now_seconds() - start;
+    start = now_seconds();
+    recount_sbf_stats(&sbf, &recount);
+    double recount_time = now_seconds() - start;
+    assert(live.zero_counters == scanned && recount.zero_counters == scanned);
+
+    printf("%d-bit %s, zero rate %.4f%%: scan %.3f s, recount %.3f s, live %.1f us\n",
+           bits_per_counter, layout == LAYOUT_PADDED ? "padded" : "packed", 100 * live.zero_ratio,
+           scan_time, recount_time, 1e6 * live_time);
+    free_sbf(&sbf);
+}
+
+/**
+ * Save an SSLBF and a GSLBF of the given model, reopen them with checksum verification
+ * and check that the copies, whose model is loaded again from model_path, answer every
+ * query like the originals.
+*/
+static void check_learned_persistence(char *path, ModelType type, char *model_path, int num_float_features)
+{
+    int num_docs = 200000;
+    float *features = (float *)malloc((size_t)num_docs * num_float_features * sizeof(float));
+    Data *data = (Data *)malloc(num_docs * sizeof(Data));
+    isaac_ctx isaac;
+    isaac_init(&isaac, ISAAC_SEED, sizeof(ISAAC_SEED));
+    for (int i=0; i<num_docs; ++i)
+    {
+        for (int j=0; j<num_float_features; ++j)
+        {
+            features[(size_t)i * num_float_features + j] = gauss_rand(&isaac);
+        }
+        Data d = {i, features + (size_t)i * num_float_features, num_float_features, NULL, 0};
+        data[i] = d;
+    }
+    FilterMapping mapping;
+
+    Model model = {0};
+    load_model(&model, type, model_path);
+    SSLBF sslbf, opened_sslbf;
+    init_sslbf(&sslbf, &model, 6, 6, 1 << 20, 3, 0.5);
+    for (int i=0; i<num_docs/2; ++i)
+    {
+        insert_sslbf(&sslbf, &data[i], sizeof(unsigned int));
+    }
+    save_sslbf(&sslbf, path, model_path);
+    open_sslbf(&opened_sslbf, path, &mapping, 1);
+    for (int i=0; i<num_docs; ++i)
+    {
+        assert(test_sslbf(&opened_sslbf, &data[i], sizeof(unsigned int)) == test_sslbf(&sslbf, &data[i], sizeof(unsigned int)));
+    }
+    free_sslbf(&opened_sslbf);
+    close_filter_mapping(&mapping);
+    free_sslbf(&sslbf);
+
+    int P[3] = {6, 6, 6}, K[3] = {6, 6, 6}, bits[3] = {3, 3, 3};
+    uint64 m[3] = {1 << 18, 1 << 18, 1 << 18};
+    float tau[4] = {0, 0.3, 0.6, 1};
+    memset(&model, 0, sizeof(Model));
+    load_model(&model, type, model_path);
+    GSLBF gslbf, opened_gslbf;
+    init_gslbf(&gslbf, &model, P, K, m, bits, tau, 3);
+    for (int i=0; i<num_docs/2; ++i)
+    {
+        insert_gslbf(&gslbf, &data[i], sizeof(unsigned int));
+    }
+    save_gslbf(&gslbf, path, model_path);
+    open_gslbf(&opened_gslbf, path, &mapping, 1);
+    assert(opened_gslbf.g == 3 && ! memcmp(opened_gslbf.tau_array, tau, sizeof(tau)));
+    for (int i=0; i<num_docs; ++i)
+    {
+        assert(test_gslbf(&opened_gslbf, &data[i], sizeof(unsigned int)) == test_gslbf(&gslbf, &data[i], sizeof(unsigned int)));
+    }
+    free_gslbf(&opened_gslbf);
+    close_filter_mapping(&mapping);
+    free_gslbf(&gslbf);
+
+    printf("SSLBF and GSLBF round trips OK with the %s model %s\n", type == BOOST ? "boost" : "logistic", model_path);
+    free(features);
+    free(data);
+    remove(path);
+}
+
+/**
+ * Save an SBF and a BF, reopen them through mmap and check that the copies answer every
+ * query like the originals and, for the SBF, keep decrementing the same counters.
+ * Reports the cost of opening against rebuilding the filter. Then checks that a flipped
+ * payload byte fails verification, and round trips SSLBF and GSLBF with the logistic
+ * model and, when given, a boost model (cbm) taking boost_features float features.
+*/
+static void exp_persistence(char *path, char *logistic_path, char *boost_path, int boost_features)
+{
+    int max_range = 10000000;
+    SBFOptions options;
+    default_sbf_options(&options);
+    options.rng = RNG_WYRAND;
+    SBF sbf;
+    double start = now_seconds();
+    init_sbf_with_options(&sbf, 6, 6, 1ULL << 26, 3, &options);
+    for (int i=0; i<max_range; ++i)
+    {
+        insert_sbf(&sbf, &i, sizeof(int));
+    }
+    double build_time = now_seconds() - start;
+
+    start = now_seconds();
+    save_sbf(&sbf, path);
+    double save_time = now_seconds() - start;
+
+    SBF opened;
+    FilterMapping mapping;
+    start = now_seconds();
+    open_sbf(&opened, path, &mapping, 0);
+    double open_time = now_seconds() - start;
+    start = now_seconds();
+    int hits = 0;
+    for (int i=max_range-1000; i<max_range; ++i)
+    {
+        hits += test_sbf(&opened, &i, sizeof(int));
+    }
+    double first_query_time = now_seconds() - start;
+
+    for (int i=0; i<2*max_range; ++i)
+    {
+        assert(test_sbf(&opened, &i, sizeof(int)) == test_sbf(&sbf, &i, sizeof(int)));
+    }
+    for (int i=max_range; i<max_range+1000000; ++i)
+    {
+        insert_sbf(&sbf, &i, sizeof(int));
+        insert_sbf(&opened, &i, sizeof(int));
+    }
+    assert(! memcmp(sbf.counters.raw_bits, opened.counters.raw_bits, sbf.counters.num_bins * sizeof(uint32)));
+    assert(sbf.counters.zero_count == opened.counters.zero_count);
+    free_sbf(&opened);
+    close_filter_mapping(&mapping);
+
+    start = now_seconds();
+    open_sbf(&opened, path, &mapping, 1);
+    double verify_time = now_seconds() - start;
+    free_sbf(&opened);
+    close_filter_mapping(&mapping);
+
+    printf("SBF %llu bytes: build %.3f s, save %.3f s, open %.1f us (+%.1f us for 1000 first queries, %d hits), open with checksum %.3f s\n",
+           sbf.counters.num_bins * sizeof(uint32), build_time, save_time, 1e6 * open_time, 1e6 * first_query_time, hits, verify_time);
+    free_sbf(&sbf);
+
+    BF bf, opened_bf;
+    init_bf(&bf, 6, 1ULL << 27);
+    for (int i=0; i<max_range; ++i)
+    {
+        insert_bf(&bf, &i, sizeof(int));
+    }
+    save_bf(&bf, path);
+    open_bf(&opened_bf, path, &mapping, 1);
+    for (int i=0; i<2*max_range; ++i)
+    {
+        assert(test_bf(&opened_bf, &i, sizeof(int)) == test_bf(&bf, &i, sizeof(int)));
+    }
+    printf("BF round trip OK\n");
+    free_bf(&opened_bf);
+    close_filter_mapping(&mapping);
+    free_bf(&bf);
+
+    // corrupt a payload byte, a verified open must then fail; it exits, so it runs in a child
+    FILE *fp = fopen(path, "r+b");
+    fseek(fp, 0, SEEK_END);
+    long middle = ftell(fp) / 2;
+    fseek(fp, middle, SEEK_SET);
+    int byte = fgetc(fp);
+    fseek(fp, middle, SEEK_SET);
+    fputc(byte ^ 0x10, fp);
+    fclose(fp);
+    fflush(NULL);
+    pid_t pid = fork();
+    if (pid == 0)
+    {
+        open_bf(&opened_bf, path, &mapping, 1);
+        _exit(0);
+    }
+    int status;
+    waitpid(pid, &status, 0);
+    assert(WIFEXITED(status) && WEXITSTATUS(status) == 1);
+    open_bf(&opened_bf, path, &mapping, 0); // unverified opens do not read the payload
+    free_bf(&opened_bf);
+    close_filter_mapping(&mapping);
+    printf("corrupted payload rejected\n");
+    remove(path);
+
+    Model logistic = {0};
+    load_model(&logistic, LOGISTIC, logistic_path);
+    int logistic_features = logistic.num_weights;
+    free_model(&logistic);
+    check_learned_persistence(path, LOGISTIC, logistic_path, logistic_features);
+    if (boost_path != NULL)
+    {
+        check_learned_persistence(path, BOOST, boost_path, boost_features);
+    }
+    else
+    {
+        printf("no boost model given, skipped the boost round trips\n");
+    }
+}
+
+/**
+ * Ingest into an SBF while snapshots are taken every few million inserts, and report the
+ * pause of each snapshot and the ingest rate with and without snapshots running.
+ * The last snapshot must open with a valid checksum.
+*/
+static void exp_snapshot(char *path)
+{
+    int max_range = 20000000;
+    int period = 2000000;
+    SBFOptions options;
+    default_sbf_options(&options);
+    options.rng = RNG_WYRAND;
+
+    for (int with_snapshots=0; with_snapshots<2; ++with_snapshots)
+    {
+        SBF sbf;
+        init_sbf_with_options(&sbf, 6, 6, 1ULL << 28, 3, &options);
+        FilterSnapshot snapshot;
+        snapshot.pid = 0;
+        int taken = 0, skipped = 0;
+        double max_pause = 0, total_pause = 0, max_duration = 0;
+
+        double start = now_seconds();
+        for (int i=0; i<max_range; ++i)
+        {
+            if (with_snapshots && i % period == period - 1)
+            {
+                if (snapshot.pid != 0 && ! poll_filter_snapshot(&snapshot, 0))
+                {
+                    skipped++; // previous one still being written
+                }
+                else
+                {
+                    if (taken)
+                    {
+                        max_duration = snapshot.duration > max_duration ? snapshot.duration : max_duration;
+                    }
+                    start_sbf_snapshot(&sbf, path, &snapshot);
+                    taken++;
+                    total_pause += snapshot.pause;
+                    max_pause = snapshot.pause > max_pause ? snapshot.pause : max_pause;
+                }
+            }
+            insert_sbf(&sbf, &i, sizeof(int));
+        }
+        double seconds = now_seconds() - start;
+
+        if (! with_snapshots)
+        {
+            printf("no snapshots: %.2f M inserts/sec\n", max_range / seconds / 1e6);
+            free_sbf(&sbf);
+            continue;
+        }
+        assert(poll_filter_snapshot(&snapshot, 1) == 1);
+        max_duration = snapshot.duration > max_duration ? snapshot.duration : max_duration;
+        printf("%d snapshots (%d skipped): %.2f M inserts/sec, pause avg %.1f us max %.1f us, write up to %.3f s\n",
+               taken, skipped, max_range / seconds / 1e6, 1e6 * total_pause / taken, 1e6 * max_pause, max_duration);
+
+        SBF restored;
+        FilterMapping mapping;
+        open_sbf(&restored, path, &mapping, 1);
+        SBFStats stats;
+        recount_sbf_stats(&restored, &stats);
+        assert(stats.zero_counters == restored.counters.zero_count);
+        free_sbf(&restored);
+        close_filter_mapping(&mapping);
+        free_sbf(&sbf);
+        remove(path);
+    }
+}
+
+/**
+ * Write a synthetic labeled dataset (Gaussian features, two categorical columns, every
+ * other row a key), reopen it and check every row view against the source arrays.
+ * Reports the cost of opening and of scanning all rows through views. The file is kept
+ * for the benchmark driver, e.g. main -f sslbf -M model -L path.
+*/
+static void exp_dataset(char *path, uint64 num_rows, int num_float_features)
+{
+    int dictionary_sizes[2] = {16, 1000};
+    unsigned int *ids = (unsigned int *)malloc(num_rows * sizeof(unsigned int));
+    unsigned char *labels = (unsigned char *)malloc(num_rows);
+    float *features = (float *)malloc(num_rows * num_float_features * sizeof(float));
+    uint32 *codes[2];
+    uint64 *offsets[2];
+    char *strings[2];
+    CatDictionary dictionaries[2];
+    isaac_ctx isaac;
+    isaac_init(&isaac, ISAAC_SEED, sizeof(ISAAC_SEED));
+    for (int c=0; c<2; ++c)
+    {
+        codes[c] = (uint32 *)malloc(num_rows * sizeof(uint32));
+        offsets[c] = (uint64 *)malloc(dictionary_sizes[c] * sizeof(uint64));
+        strings[c] = (char *)malloc(dictionary_sizes[c] * 16);
+        uint64 bytes = 0;
+        for (int v=0; v<dictionary_sizes[c]; ++v)
+        {
+            offsets[c][v] = bytes;
+            bytes += sprintf(strings[c] + bytes, "c%d_%d", c, v) + 1;
+        }
+        dictionaries[c].size = dictionary_sizes[c];
+        dictionaries[c].offsets = offsets[c];
+        dictionaries[c].strings = strings[c];
+        dictionaries[c].strings_bytes = bytes;
+    }
+    for (uint64 i=0; i<num_rows; ++i)
+    {
+        ids[i] = (unsigned int)i;
+        labels[i] = i % 2 == 0;
+        for (int j=0; j<num_float_features; ++j)
+        {
+            features[i * num_float_features + j] = gauss_rand(&isaac);
+        }
+        codes[0][i] = i % dictionary_sizes[0];
+        codes[1][i] = (i * 7919) % dictionary_sizes[1];
+    }
+    Dataset source = {num_rows, num_float_features, 2, ids, labels, features, (const uint32 **)codes, dictionaries, NULL, 0};
+    double start = now_seconds();
+    save_dataset(&source, path);
+    double save_time = now_seconds() - start;
+
+    Dataset dataset;
+    start = now_seconds();
+    open_dataset(&dataset, path, 0);
+    double open_time = now_seconds() - start;
+    close_dataset(&dataset);
+    start = now_seconds();
+    open_dataset(&dataset, path, 1);
+    double verify_time = now_seconds() - start;
+
+    // first scan faults the pages in, the second one reads them from memory
+    Data row;
+    const char *cat_features[2];
+    double scan_time[2];
+    float sum = 0;
+    for (int pass=0; pass<2; ++pass)
+    {
+        start = now_seconds();
+        for (uint64 i=0; i<num_rows; ++i)
+        {
+            dataset_row(&dataset, i, &row, cat_features);
+            sum += row.float_features[row.num_float_features - 1] + row.cat_features[1][0];
+        }
+        scan_time[pass] = now_seconds() - start;
+    }
+
+    for (uint64 i=0; i<num_rows; ++i)
+    {
+        dataset_row(&dataset, i, &row, cat_features);
+        assert(row.id == ids[i] && dataset.labels[i] == labels[i] && row.num_float_features == num_float_features);
+        assert(! memcmp(row.float_features, features + i * num_float_features, num_float_features * sizeof(float)));
+        assert(row.num_cat_features == 2);
+        for (int c=0; c<2; ++c)
+        {
+            assert(! strcmp(row.cat_features[c], strings[c] + offsets[c][codes[c][i]]));
+        }
+    }
+    printf("%llu rows x %d floats, %llu bytes: save %.3f s, open %.1f us (%.3f s verified), scan %.1f M rows/sec (%.1f M rows/sec cold), sum %g\n",
+           num_rows, num_float_features, dataset.length, save_time, 1e6 * open_time, verify_time, num_rows / scan_time[1] / 1e6,
+           num_rows / scan_time[0] / 1e6, sum);
+    close_dataset(&dataset);
+
+    // a code past its dictionary must fail a verified open; it exits, so it runs in a child
+    codes[1][num_rows / 2] = dictionary_sizes[1];
+    save_dataset(&source, path);
+    fflush(NULL);
+    pid_t pid = fork();
+    if (pid == 0)
+    {
+        open_dataset(&dataset, path, 1);
+        _exit(0);
+    }
+    int status;
+    waitpid(pid, &status, 0);
+    assert(WIFEXITED(status) && WEXITSTATUS(status) == 1);
+    codes[1][num_rows / 2] = (num_rows / 2 * 7919) % dictionary_sizes[1];
+    save_dataset(&source, path);
+    printf("invalid categorical code rejected\n");
+    free(ids);
+    free(labels);
+    free(features);
+    for (int c=0; c<2; ++c)
+    {
+        free(codes[c]);
+        free(offsets[c]);
+        free(strings[c]);
+    }
+}
+
+/**
+ * Compare the ISAAC and wyrand backends of SBF decrements: insert throughput with the
+ * exp_sbf configuration on a small and a cache-exceeding filter, and the stable-point
+ * zero rate, which must not depend on the generator.
+*/
+static void exp_sbf_rng(CounterLayout layout)
+{
+    int max_range = 10000000;
+    uint64 sizes[2] = {10000, 1ULL << 26};
+    RngMode rngs[2] = {RNG_ISAAC, RNG_WYRAND};
+
+    for (int r=0; r<2; ++r)
+    {
+        for (int j=0; j<2; ++j)
+        {
+            SBFOptions options;
+            default_sbf_options(&options);
+            options.layout = layout;
+            options.rng = rngs[r];
+            SBF sbf;
+            init_sbf_with_options(&sbf, 6, 6, sizes[j], 3, &options);
+
+            double start = now_seconds();
+            for (int i=0; i<max_range; ++i)
+            {
+                insert_sbf(&sbf, &i, sizeof(int));
+            }
+            double seconds = now_seconds() - start;
+            printf("%s, m=%llu: %.2f M inserts/sec, zero rate %.3f%%\n", rngs[r] == RNG_ISAAC ? "isaac" : "wyrand",
+                   sizes[j], max_range / seconds / 1e6, 100 * get_zero_ratio(&sbf));
+            free_sbf(&sbf);
+        }
+    }
+}
+
+/**
+ * Compare scalar and batched (prefetching) queries of BF and SBF, in ns per key.
+ * Half of the queried keys are present.
+*/
+static void exp_batch_query(int batch_size)
 {
-    // parse command line arguments
+    if (batch_size < 1)
+    {
+        printf("Batch size must be positive.\n");
+        exit(1);
+    }
+    int max_range = 10000000;
+    int num_queries = 2 * max_range;
+    int *keys = (int *)malloc(num_queries * sizeof(int));
+    uint64 *result = (uint64 *)malloc((num_queries + 63) / 64 * sizeof(uint64));
+    for (int i=0; i<num_queries; ++i)
+    {
+        keys[i] = i;
+    }
+
+    BF bf;
+    init_bf(&bf, 6, max_range * 9.584);
+    SBF sbf;
+    init_sbf(&sbf, 6, 6, max_range * 10, 3);
+    for (int i=0; i<max_range; ++i)
+    {
+        insert_bf(&bf, &i, sizeof(int));
+        insert_sbf(&sbf, &i, sizeof(int));
+    }
+
+    double start, end;
+    int positives = 0;
+
+    start = now_seconds();
+    for (int i=0; i<num_queries; ++i)
+    {
+        positives += test_bf(&bf, &keys[i], sizeof(int));
+    }
+    end = now_seconds();
+    printf("BF scalar: %.2f ns/key, %d positives.\n", (end - start) * 1e9 / num_queries, positives);
+
+    start = now_seconds();
+    test_bf_batch(&bf, keys, sizeof(int), num_queries, batch_size, result);
+    end = now_seconds();
+    positives = 0;
+    for (int i=0; i<(num_queries + 63) / 64; ++i)
+    {
+        positives += __builtin_popcountll(result[i]);
+    }
+    printf("BF batch of %d: %.2f ns/key, %d positives.\n", batch_size, (end - start) * 1e9 / num_queries, positives);
 
-    // exp_bf();
-    exp_sbf();
+    positives = 0;
+    start = now_seconds();
+    for (int i=0; i<num_queries; ++i)
+    {
+        positives += test_sbf(&sbf, &keys[i], sizeof(int));
+    }
+    end = now_seconds();
+    printf("SBF scalar: %.2f ns/key, %d positives.\n", (end - start) * 1e9 / num_queries, positives);
+
+    start = now_seconds();
+    test_sbf_batch(&sbf, keys, sizeof(int), num_queries, batch_size, result);
+    end = now_seconds();
+    positives = 0;
+    for (int i=0; i<(num_queries + 63) / 64; ++i)
+    {
+        positives += __builtin_popcountll(result[i]);
+    }
+    printf("SBF batch of %d: %.2f ns/key, %d positives.\n", batch_size, (end - start) * 1e9 / num_queries, positives);
+
+    free_bf(&bf);
+    free_sbf(&sbf);
+    free(keys);
+    free(result);
+}
+
+/**
+ * Compare logistic dot-product kernels of every SIMD level, per row and batched.
+*/
+static void exp_dot_product(int num_features)
+{
+    int num_rows = 200000;
+    isaac_ctx isaac;
+    isaac_init(&isaac, ISAAC_SEED, sizeof(ISAAC_SEED));
+
+    float *matrix = (float *)malloc((size_t)num_rows * num_features * sizeof(float));
+    float *weights = (float *)malloc(num_features * sizeof(float));
+    const float **rows = (const float **)malloc(num_rows * sizeof(float *));
+    float *scores = (float *)malloc(num_rows * sizeof(float));
+    float *expected = (float *)malloc(num_rows * sizeof(float));
+    for (size_t i=0; i<(size_t)num_rows * num_features; ++i)
+    {
+        matrix[i] = isaac_next_signed_float(&isaac);
+    }
+    for (int i=0; i<num_features; ++i)
+    {
+        weights[i] = gauss_rand(&isaac);
+    }
+    for (int r=0; r<num_rows; ++r)
+    {
+        rows[r] = matrix + (size_t)r * num_features;
+    }
+
+    double gigabytes = (double)num_rows * num_features * sizeof(float) / 1e9;
+    SimdLevel supported = simd_level();
+    for (int level=SIMD_SCALAR; level<=supported; ++level)
+    {
+        set_simd_level(level);
+        double start = now_seconds();
+        for (int r=0; r<num_rows; ++r)
+        {
+            scores[r] = dot_product(rows[r], weights, num_features);
+        }
+        float single = now_seconds() - start;
+        if (level == SIMD_SCALAR)
+        {
+            memcpy(expected, scores, num_rows * sizeof(float));
+        }
+
+        start = now_seconds();
+        dot_product_batch(rows, weights, num_rows, num_features, scores);
+        float batch = now_seconds() - start;
+
+        float max_error = 0;
+        for (int r=0; r<num_rows; ++r)
+        {
+            max_error = fmaxf(max_error, fabsf(scores[r] - expected[r]));
+        }
+        printf("%s: %.2f ns/row (%.2f GB/s), batch %.2f ns/row (%.2f GB/s), max error %.2e\n",
+               simd_level_name(level), single * 1e9 / num_rows, gigabytes / single,
+               batch * 1e9 / num_rows, gigabytes / batch, max_error);
+    }
+    set_simd_level(supported);
+
+    free(matrix);
+    free(weights);
+    free(rows);
+    free(scores);
+    free(expected);
+}
+
+/**
+ * Check that the native oblivious tree evaluator scores like CatBoost on the same model,
+ * exported both as cbm and json, and compare their speed.
+*/
+static void exp_model_parity(char *cbm_path, char *json_path, int num_float_features)
+{
+    int num_docs = 100000;
+    isaac_ctx isaac;
+    isaac_init(&isaac, ISAAC_SEED, sizeof(ISAAC_SEED));
+
+    Model boost = {0}, tree = {0};
+    load_model(&boost, BOOST, cbm_path);
+    load_model(&tree, OBLIVIOUS, json_path);
+
+    float *features = (float *)malloc((size_t)num_docs * num_float_features * sizeof(float));
+    Data *data = (Data *)malloc(num_docs * sizeof(Data));
+    float *boost_scores = (float *)malloc(num_docs * sizeof(float));
+    float *tree_scores = (float *)malloc(num_docs * sizeof(float));
+    for (int i=0; i<num_docs; ++i)
+    {
+        for (int j=0; j<num_float_features; ++j)
+        {
+            features[(size_t)i * num_float_features + j] = gauss_rand(&isaac);
+        }
+        Data d = {i, features + (size_t)i * num_float_features, num_float_features, NULL, 0};
+        data[i] = d;
+    }
+
+    double start = now_seconds();
+    predict_batch(&boost, data, num_docs, boost_scores);
+    float boost_time = now_seconds() - start;
+    start = now_seconds();
+    predict_batch(&tree, data, num_docs, tree_scores);
+    float tree_time = now_seconds() - start;
+
+    float max_error = 0;
+    for (int i=0; i<num_docs; ++i)
+    {
+        float error = fabsf(boost_scores[i] - tree_scores[i]);
+        max_error = fmaxf(max_error, error);
+        assert(error <= 1e-5 * (1 + fabsf(boost_scores[i])));
+        assert(predict(&tree, &data[i]) == tree_scores[i]);
+    }
+    printf("score parity passed, max error %.2e.\n", max_error);
+    printf("catboost: %.2f ns/doc, native: %.2f ns/doc.\n", boost_time * 1e9 / num_docs, tree_time * 1e9 / num_docs);
+
+    free_model(&boost);
+    free_model(&tree);
+    free(features);
+    free(data);
+    free(boost_scores);
+    free(tree_scores);
+}
+
+/**
+ * Route keys whose scores fall outside the threshold grid of a GSLBF: thresholds
+ * [0.2, 0.5, 0.8] for two groups and logistic scores spread far beyond both ends.
+ * Such keys belong to the first or last group and must be found right after insertion,
+ * by single and batched queries.
+*/
+static void exp_gslbf_scores()
+{
+    int num_docs = 100000;
+    int P[2] = {6, 6}, K[2] = {6, 6}, bits[2] = {3, 3};
+    uint64 m[2] = {1 << 20, 1 << 20};
+    float tau[3] = {0.2, 0.5, 0.8};
+    Model model = {0};
+    model.type = LOGISTIC;
+    model.weights = (float *)malloc(sizeof(float));
+    model.weights[0] = 1;
+    model.num_weights = 1;
+
+    GSLBF gslbf;
+    init_gslbf(&gslbf, &model, P, K, m, bits, tau, 2);
+    float *features = (float *)malloc(num_docs * sizeof(float));
+    Data *data = (Data *)malloc(num_docs * sizeof(Data));
+    int outside = 0;
+    for (int i=0; i<num_docs; ++i)
+    {
+        features[i] = 20.0 * i / num_docs - 10; // logits from -10 to 10
+        Data d = {i, &features[i], 1, NULL, 0};
+        data[i] = d;
+        outside += features[i] <= gslbf.raw_tau_array[0] || features[i] > gslbf.raw_tau_array[2];
+        insert_gslbf(&gslbf, &data[i], sizeof(unsigned int));
+        assert(test_gslbf(&gslbf, &data[i], sizeof(unsigned int)));
+    }
+
+    int batch = 64;
+    uint64 result[1];
+    for (int i=0; i+batch<=num_docs; i+=batch)
+    {
+        insert_gslbf_batch(&gslbf, data + i, sizeof(unsigned int), batch);
+        test_gslbf_batch(&gslbf, data + i, sizeof(unsigned int), batch, result);
+        assert(result[0] == ~0ULL);
+    }
+    printf("GSLBF scores outside the thresholds: %d of %d keys, all found.\n", outside, num_docs);
+
+    free_gslbf(&gslbf);
+    free(features);
+    free(data);
+}
+
+typedef struct BFWorker
+{
+    BF *bf;
+    int start;
+    int end;
+    int false_negatives;
+} BFWorker;
+
+static void *bf_insert_worker(void *arg)
+{
+    BFWorker *worker = (BFWorker *)arg;
+    for (int i=worker->start; i<worker->end; ++i)
+    {
+        insert_bf_concurrent(worker->bf, &i, sizeof(int));
+    }
+    return NULL;
+}
+
+static void *bf_query_worker(void *arg)
+{
+    BFWorker *worker = (BFWorker *)arg;
+    for (int i=worker->start; i<worker->end; ++i)
+    {
+        if (! test_bf_concurrent(worker->bf, &i, sizeof(int)))
+        {
+            worker->false_negatives++;
+        }
+    }
+    return NULL;
+}
+
+/**
+ * Test a BF shared by num_threads threads, each inserting then querying its own key range.
+*/
+static void exp_bf_concurrent(int num_threads)
+{
+    int max_range = 10000000;
+    BF bf;
+    init_bf(&bf, 6, max_range * 9.584);
+
+    pthread_t *threads = (pthread_t *)malloc(num_threads * sizeof(pthread_t));
+    BFWorker *workers = (BFWorker *)malloc(num_threads * sizeof(BFWorker));
+    for (int t=0; t<num_threads; ++t)
+    {
+        workers[t].bf = &bf;
+        workers[t].start = (long long)max_range * t / num_threads;
+        workers[t].end = (long long)max_range * (t + 1) / num_threads;
+        workers[t].false_negatives = 0;
+    }
+
+    double start = now_seconds();
+    for (int t=0; t<num_threads; ++t)
+    {
+        pthread_create(&threads[t], NULL, bf_insert_worker, &workers[t]);
+    }
+    for (int t=0; t<num_threads; ++t)
+    {
+        pthread_join(threads[t], NULL);
+    }
+    double insert_time = now_seconds() - start;
+
+    start = now_seconds();
+    for (int t=0; t<num_threads; ++t)
+    {
+        pthread_create(&threads[t], NULL, bf_query_worker, &workers[t]);
+    }
+    int false_negatives = 0;
+    for (int t=0; t<num_threads; ++t)
+    {
+        pthread_join(threads[t], NULL);
+        false_negatives += workers[t].false_negatives;
+    }
+    double query_time = now_seconds() - start;
+
+    printf("%d threads: %.2f M inserts/sec, %.2f M queries/sec, %d false negatives.\n",
+           num_threads, max_range / insert_time / 1e6, max_range / query_time / 1e6, false_negatives);
+
+    free(threads);
+    free(workers);
+    free_bf(&bf);
+}
+
+typedef struct SBFWorker
+{
+    SBFWriter writer;
+    int start;
+    int end;
+} SBFWorker;
+
+static void *sbf_insert_worker(void *arg)
+{
+    SBFWorker *worker = (SBFWorker *)arg;
+    for (int i=worker->start; i<worker->end; ++i)
+    {
+        insert_sbf_concurrent(&(worker->writer), &i, sizeof(int));
+    }
+    return NULL;
+}
+
+/**
+ * Stress test of concurrent SBF inserts. A small SBF keeps num_threads writers contending
+ * on the same bins; afterwards the counters must add up to everything set minus everything
+ * decremented, no counter may exceed its maximum and no padding bit may be set. Lost
+ * updates or a borrow into a neighbouring counter break one of these invariants.
+ * 
+ * num_threads: number of writer threads
+ * layout: counter layout of the shared SBF
+ * decrement_mode: DECREMENT_RANDOM or DECREMENT_RANGE
+*/
+static void exp_sbf_concurrent(int num_threads, CounterLayout layout, DecrementMode decrement_mode)
+{
+    int max_range = 10000000;
+    uint64 m = 4096;
+    int bits_per_counter = layout == LAYOUT_PADDED ? 3 : 4;
+    SBF sbf;
+    SBFOptions options;
+    default_sbf_options(&options);
+    options.layout = layout;
+    options.decrement_mode = decrement_mode;
+    init_sbf_with_options(&sbf, 10, 3, m, bits_per_counter, &options);
+
+    pthread_t *threads = (pthread_t *)malloc(num_threads * sizeof(pthread_t));
+    SBFWorker *workers = (SBFWorker *)malloc(num_threads * sizeof(SBFWorker));
+    for (int t=0; t<num_threads; ++t)
+    {
+        init_sbf_writer(&(workers[t].writer), &sbf, t);
+        workers[t].start = (long long)max_range * t / num_threads;
+        workers[t].end = (long long)max_range * (t + 1) / num_threads;
+    }
+
+    double start = now_seconds();
+    for (int t=0; t<num_threads; ++t)
+    {
+        pthread_create(&threads[t], NULL, sbf_insert_worker, &workers[t]);
+    }
+    for (int t=0; t<num_threads; ++t)
+    {
+        pthread_join(threads[t], NULL);
+    }
+    double insert_time = now_seconds() - start;
+
+    uint64 expected = 0;
+    for (int t=0; t<num_threads; ++t)
+    {
+        expected += workers[t].writer.added - workers[t].writer.decremented;
+    }
+    uint64 total = 0;
+    for (uint64 i=0; i<m; ++i)
+    {
+        int counter = get_counter(&(sbf.counters), i);
+        assert(counter <= (int)COUNTER_MASK(bits_per_counter));
+        total += counter;
+    }
+    if (layout == LAYOUT_PADDED)
+    {
+        // counters fill each bin from the top, the low bits are padding
+        uint32 padding = COUNTER_MASK(BIN_BITS - sbf.counters.counters_per_bin * bits_per_counter);
+        for (uint64 b=0; b<sbf.counters.num_bins; ++b)
+        {
+            assert((sbf.counters.raw_bits[b] & padding) == 0);
+        }
+    }
+
+    printf("%d threads, %s decrements: %.2f M inserts/sec, counter sum %llu, expected %llu -> %s\n",
+           num_threads, decrement_mode == DECREMENT_RANGE ? "range" : "random", max_range / insert_time / 1e6,
+           total, expected, total == expected ? "OK" : "MISMATCH");
+
+    free(threads);
+    free(workers);
+    free_sbf(&sbf);
+}
+
+typedef struct ShardWorker
+{
+    ShardedSBF *ssbf;
+    int *keys;
+    int num_keys;
+} ShardWorker;
+
+static void *shard_insert_worker(void *arg)
+{
+    ShardWorker *worker = (ShardWorker *)arg;
+    for (int i=0; i<worker->num_keys; ++i)
+    {
+        insert_sharded_sbf(worker->ssbf, &(worker->keys[i]), sizeof(int));
+    }
+    return NULL;
+}
+
+/**
+ * Test sharded SBF ingest. Keys are routed to threads up front, thread t owning the shards
+ * s with s % num_threads == t, so every shard has a single writer and threads never touch
+ * each other's counters.
+ * 
+ * num_threads: number of writer threads
+ * num_shards: number of shards, at least num_threads
+*/
+static void exp_sharded_sbf(int num_threads, int num_shards)
+{
+    if (num_threads < 1 || num_shards < num_threads)
+    {
+        printf("Threads must be positive and shards at least threads.\n");
+        exit(1);
+    }
+    int max_range = 10000000;
+    uint64 m = 1 << 24;
+    SBFOptions options;
+    default_sbf_options(&options);
+    options.layout = LAYOUT_PADDED;
+    ShardedSBF ssbf;
+    init_sharded_sbf(&ssbf, num_shards, 6, 6, m, 3, &options);
+
+    // route keys to their shard owners
+    pthread_t *threads = (pthread_t *)malloc(num_threads * sizeof(pthread_t));
+    ShardWorker *workers = (ShardWorker *)malloc(num_threads * sizeof(ShardWorker));
+    int *owner = (int *)malloc(max_range * sizeof(int));
+    for (int t=0; t<num_threads; ++t)
+    {
+        workers[t].ssbf = &ssbf;
+        workers[t].num_keys = 0;
+    }
+    for (int i=0; i<max_range; ++i)
+    {
+        owner[i] = sharded_sbf_shard(&ssbf, &i, sizeof(int)) % num_threads;
+        workers[owner[i]].num_keys++;
+    }
+    for (int t=0; t<num_threads; ++t)
+    {
+        workers[t].keys = (int *)malloc(workers[t].num_keys * sizeof(int));
+        workers[t].num_keys = 0;
+    }
+    for (int i=0; i<max_range; ++i)
+    {
+        workers[owner[i]].keys[workers[owner[i]].num_keys++] = i;
+    }
+
+    double start = now_seconds();
+    for (int t=0; t<num_threads; ++t)
+    {
+        pthread_create(&threads[t], NULL, shard_insert_worker, &workers[t]);
+    }
+    for (int t=0; t<num_threads; ++t)
+    {
+        pthread_join(threads[t], NULL);
+    }
+    double insert_time = now_seconds() - start;
+
+    int wrong = 0;
+    for (int i=max_range; i<max_range * 2; ++i)
+    {
+        wrong += test_sharded_sbf(&ssbf, &i, sizeof(int));
+    }
+
+    printf("%d threads, %d shards: %.2f M inserts/sec, zero rate %.2f%%, fpr %.5f (estimated %.5f)\n",
+           num_threads, num_shards, max_range / insert_time / 1e6, 100 * sharded_sbf_zero_ratio(&ssbf),
+           (double)wrong / max_range, sharded_sbf_false_positive_rate(&ssbf));
+
+    for (int t=0; t<num_threads; ++t)
+    {
+        free(workers[t].keys);
+    }
+    free(owner);
+    free(threads);
+    free(workers);
+    free_sharded_sbf(&ssbf);
+}
+
+// Benchmark driver: one filter, one workload, parameters from the command line
+typedef enum BenchFilter
+{
+    BENCH_BF,
+    BENCH_BBF,
+    BENCH_SBF,
+    BENCH_SSLBF,
+    BENCH_GSLBF
+} BenchFilter;
+
+typedef enum BenchWorkload
+{
+    WORKLOAD_SEQUENTIAL, // keys 0, 1, 2, ...
+    WORKLOAD_UNIFORM,    // keys spread over the 64-bit range by a bijective hash of the index
+    // streams: each key is queried (is it a duplicate?) then inserted, see workload.h
+    WORKLOAD_ZIPF,
+    WORKLOAD_WINDOW,
+    WORKLOAD_BURSTY
+} BenchWorkload;
+
+static const char *BENCH_FILTER_NAMES[] = {"bf", "bbf", "sbf", "sslbf", "gslbf"};
+static const char *BENCH_WORKLOAD_NAMES[] = {"sequential", "uniform", "zipf", "window", "bursty"};
+static const char *MODEL_TYPE_NAMES[] = {"logistic", "boost", "oblivious"};
+static const char *LAYOUT_NAMES[] = {"packed", "padded"};
+static const char *DECREMENT_NAMES[] = {"random", "range"};
+static const char *RNG_NAMES[] = {"isaac", "wyrand"};
+static const char *HASH_NAMES[] = {"xxh32", "xxh64"};
+
+#define STREAM_CHUNK 1024 // stream events prepared, then timed, together
+
+typedef struct BenchConfig
+{
+    BenchFilter filter;
+    BenchWorkload workload;
+    int K;
+    int P;
+    uint64 m;
+    int bits_per_counter;
+    float tau;
+    int g;                  // groups of a GSLBF, thresholds evenly spaced over [0, 1]
+    SBFOptions options;
+    HashMode bf_hash_mode;
+    ModelType model_type;
+    char *model_path;
+    int num_float_features;
+    uint64 keys;
+    uint64 queries;
+    int threads;
+    int sample;             // latency of one op out of sample is recorded, 0 for none
+    int json;
+    StreamOptions stream;
+    uint64 report_interval; // stream events per row of the error rate timeline
+    char *dataset_path;     // rows of a dataset file instead of generated keys and documents
+} BenchConfig;
+
+typedef struct Bench
+{
+    BenchConfig config;
+    BF bf;
+    BBF bbf;
+    SBF sbf;
+    SSLBF sslbf;
+    GSLBF gslbf;
+    Model model;
+    Data *data;             // learned filters: keys + queries / 2 documents, STREAM_CHUNK for streams
+    float *features;
+    Dataset dataset;        // opened with -L, rows are viewed in place
+} Bench;
+
+// Throughput and latency distribution of one phase
+typedef struct OpStats
+{
+    uint64 ops;
+    double seconds;
+    uint64 *latencies;      // sampled per-op latencies in ns
+    uint64 num_latencies;
+    uint64 members;         // queried keys that were inserted
+    uint64 false_negatives;
+    uint64 false_positives;
+} OpStats;
+
+typedef struct BenchWorker
+{
+    Bench *bench;
+    SBFWriter writer;
+    int insert;
+    uint64 start;
+    uint64 end;
+    OpStats stats;
+} BenchWorker;
+
+static void bench_usage()
+{
+    printf("usage: main [options], runs the built-in experiment without options, main -x lists the others\n"
+           "  -f filter      bf, bbf, sbf, sslbf or gslbf (sbf)\n"
+           "  -K k -P p      hash functions, counters decremented per insert (6, 6)\n"
+           "  -m m           bits or counters (10 per key)\n"
+           "  -b bits        bits per counter (3)\n"
+           "  -t tau -g g    learned filter threshold, GSLBF groups (0.5, 2)\n"
+           "  -l layout      packed or padded (packed)\n"
+           "  -d mode        decrement mode random or range (random)\n"
+           "  -r rng         isaac or wyrand (isaac)\n"
+           "  -H hash        xxh32 or xxh64 (xxh32 up to 2^32 slots)\n"
+           "  -y type -M path  model type (logistic, boost, oblivious) and file of learned filters\n"
+           "  -F n           float features per document (from the model)\n"
+           "  -L path        keys and documents from a dataset file: labeled rows are inserted, all\n"
+           "                 rows queried; without labels the first -n rows (half) are inserted\n"
+           "  -n keys -q queries  inserted keys and queries, half of them members (1000000, keys)\n"
+           "  -T threads     BF and SBF only (1)\n"
+           "  -w workload    sequential, uniform, or the streams zipf, window, bursty (sequential)\n"
+           "  -z s -u n      zipf exponent and number of distinct keys (1.0, keys)\n"
+           "  -D d -R r      window: duplicate distance and ratio (1000, 0.5)\n"
+           "  -B n -O n      bursty: events per phase, recent keys repeated between bursts (100000, 1000)\n"
+           "  -I n           stream events per timeline row (keys / 20)\n"
+           "  -s sample      record the latency of one op (stream event) out of sample, for the\n"
+           "                 percentiles; off by default as the timers add to the measured time\n"
+           "  -j             JSON output\n");
+}
+
+static int parse_name(const char *value, const char **names, int num_names, char option)
+{
+    for (int i=0; i<num_names; ++i)
+    {
+        if (! strcmp(value, names[i]))
+        {
+            return i;
+        }
+    }
+    printf("Invalid value %s for -%c.\n", value, option);
+    bench_usage();
+    exit(1);
+}
+
+static void parse_bench_config(BenchConfig *config, Dataset *dataset, int argc, char *argv[])
+{
+    memset(config, 0, sizeof(BenchConfig));
+    config->filter = BENCH_SBF;
+    config->workload = WORKLOAD_SEQUENTIAL;
+    config->K = 6;
+    config->P = 6;
+    config->bits_per_counter = 3;
+    config->tau = 0.5;
+    config->g = 2;
+    default_sbf_options(&(config->options));
+    config->bf_hash_mode = HASH_XXH32_MOD;
+    config->model_type = LOGISTIC;
+    config->keys = 1000000;
+    config->threads = 1;
+    default_stream_options(&(config->stream));
+    config->stream.universe = 0;
+    int hash_set = 0, keys_set = 0;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "f:K:P:m:b:t:g:l:d:r:H:y:M:F:L:n:q:T:w:s:z:u:D:R:B:O:I:jh")) != -1)
+    {
+        switch (opt)
+        {
+            case 'f': config->filter = parse_name(optarg, BENCH_FILTER_NAMES, 5, opt); break;
+            case 'K': config->K = atoi(optarg); break;
+            case 'P': config->P = atoi(optarg); break;
+            case 'm': config->m = strtoull(optarg, NULL, 10); break;
+            case 'b': config->bits_per_counter = atoi(optarg); break;
+            case 't': config->tau = atof(optarg); break;
+            case 'g': config->g = atoi(optarg); break;
+            case 'l': config->options.layout = parse_name(optarg, LAYOUT_NAMES, 2, opt); break;
+            case 'd': config->options.decrement_mode = parse_name(optarg, DECREMENT_NAMES, 2, opt); break;
+            case 'r': config->options.rng = parse_name(optarg, RNG_NAMES, 2, opt); break;
+            case 'H':
+                config->options.hash_mode = config->bf_hash_mode = parse_name(optarg, HASH_NAMES, 2, opt);
+                hash_set = 1;
+                break;
+            case 'y': config->model_type = parse_name(optarg, MODEL_TYPE_NAMES, 3, opt); break;
+            case 'M': config->model_path = optarg; break;
+            case 'F': config->num_float_features = atoi(optarg); break;
+            case 'L': config->dataset_path = optarg; break;
+            case 'n': config->keys = strtoull(optarg, NULL, 10); keys_set = 1; break;
+            case 'q': config->queries = strtoull(optarg, NULL, 10); break;
+            case 'T': config->threads = atoi(optarg); break;
+            case 'w': config->workload = parse_name(optarg, BENCH_WORKLOAD_NAMES, 5, opt); break;
+            case 's': config->sample = atoi(optarg); break;
+            case 'z': config->stream.zipf_exponent = atof(optarg); break;
+            case 'u': config->stream.universe = strtoull(optarg, NULL, 10); break;
+            case 'D': config->stream.distance = strtoull(optarg, NULL, 10); break;
+            case 'R': config->stream.duplicate_ratio = atof(optarg); break;
+            case 'B': config->stream.burst_length = strtoull(optarg, NULL, 10); break;
+            case 'O': config->stream.hot_keys = strtoull(optarg, NULL, 10); break;
+            case 'I': config->report_interval = strtoull(optarg, NULL, 10); break;
+            case 'j': config->json = 1; break;
+            default:
+                bench_usage();
+                exit(opt == 'h' ? 0 : 1);
+        }
+    }
+
+    if (config->dataset_path != NULL)
+    {
+        if (config->workload != WORKLOAD_SEQUENTIAL)
+        {
+            printf("Dataset rows are inserted and queried in order, -w does not apply to -L.\n");
+            exit(1);
+        }
+        open_dataset(dataset, config->dataset_path, 1);
+        if (dataset->labels != NULL)
+        {
+            config->keys = 0;
+            for (uint64 i=0; i<dataset->num_rows; ++i)
+            {
+                config->keys += dataset->labels[i] != 0;
+            }
+        }
+        else if (! keys_set || config->keys > dataset->num_rows)
+        {
+            config->keys = dataset->num_rows / 2;
+        }
+        config->queries = dataset->num_rows;
+    }
+    if (config->m == 0)
+    {
+        config->m = 10 * config->keys;
+    }
+    if (config->queries == 0)
+    {
+        config->queries = config->keys;
+    }
+    if (config->stream.universe == 0)
+    {
+        config->stream.universe = config->keys;
+    }
+    if (config->report_interval == 0)
+    {
+        config->report_interval = config->keys / 20 ? config->keys / 20 : 1;
+    }
+    if (! hash_set && config->m > 0xffffffffULL)
+    {
+        config->options.hash_mode = config->bf_hash_mode = HASH_XXH64_FASTRANGE;
+    }
+    if (config->K <= 0 || config->keys == 0 || config->threads <= 0 || config->sample < 0 || config->g <= 0)
+    {
+        printf("K, keys, threads and groups must be positive, sample not negative.\n");
+        exit(1);
+    }
+    if (config->threads > 1 && config->workload >= WORKLOAD_ZIPF)
+    {
+        printf("Streams are replayed in order, use -T 1 for %s.\n", BENCH_WORKLOAD_NAMES[config->workload]);
+        exit(1);
+    }
+    if (config->threads > 1 && config->filter != BENCH_BF && config->filter != BENCH_SBF)
+    {
+        printf("Only bf and sbf support concurrent inserts, use -T 1 for %s.\n", BENCH_FILTER_NAMES[config->filter]);
+        exit(1);
+    }
+    if ((config->filter == BENCH_SSLBF || config->filter == BENCH_GSLBF) && config->model_path == NULL)
+    {
+        printf("Learned filters need a model, see -y and -M.\n");
+        exit(1);
+    }
+    if (config->filter == BENCH_SSLBF || config->filter == BENCH_GSLBF)
+    {
+        // learned filters hash the 32-bit Data id, generated keys must stay distinct in it
+        config->stream.key_bits = 32;
+        uint64 generated = config->workload >= WORKLOAD_ZIPF ? config->keys : config->keys + (config->queries + 1) / 2;
+        if (config->dataset_path == NULL && generated > 1ULL << 32)
+        {
+            printf("Learned filters use 32-bit ids, %llu keys do not fit.\n", generated);
+            exit(1);
+        }
+    }
+}
+
+/**
+ * Key of the i-th element of the workload. Indices below config->keys are inserted,
+ * the others are only queried.
+*/
+static uint64 bench_key(BenchConfig *config, uint64 i)
+{
+    if (config->workload == WORKLOAD_UNIFORM)
+    {
+        return workload_key(i, config->stream.key_bits);
+    }
+    return i;
+}
+
+/**
+ * Index of the j-th query: even queries hit inserted keys, odd queries keys never inserted.
+ * Dataset rows are all queried in order.
+*/
+static uint64 bench_query_index(BenchConfig *config, uint64 j)
+{
+    if (config->dataset_path != NULL)
+    {
+        return j;
+    }
+    return j % 2 ? config->keys + j / 2 : (j / 2) % config->keys;
+}
+
+/**
+ * Whether the i-th element is inserted: a labeled dataset row, or one of the first keys.
+*/
+static inline int bench_member(Bench *bench, uint64 i)
+{
+    return bench->dataset.labels != NULL ? bench->dataset.labels[i] != 0 : i < bench->config.keys;
+}
+
+static void init_bench(Bench *bench)
+{
+    BenchConfig *config = &(bench->config);
+    switch (config->filter)
+    {
+        case BENCH_BF:
+            init_bf_with_hash(&(bench->bf), config->K, config->m, config->bf_hash_mode);
+            break;
+        case BENCH_BBF:
+            init_bbf(&(bench->bbf), config->K, config->m);
+            break;
+        case BENCH_SBF:
+            init_sbf_with_options(&(bench->sbf), config->P, config->K, config->m, config->bits_per_counter, &(config->options));
+            break;
+        default:
+            break;
+    }
+    if (config->filter != BENCH_SSLBF && config->filter != BENCH_GSLBF)
+    {
+        return;
+    }
+
+    load_model(&(bench->model), config->model_type, config->model_path);
+    if (config->dataset_path != NULL)
+    {
+        config->num_float_features = bench->dataset.num_float_features;
+    }
+    if (config->num_float_features == 0)
+    {
+        config->num_float_features = config->model_type == LOGISTIC ? bench->model.num_weights
+            : config->model_type == OBLIVIOUS ? bench->model.oblivious->num_float_features : 0;
+    }
+    if (config->num_float_features <= 0)
+    {
+        printf("Number of float features unknown for this model, see -F.\n");
+        exit(1);
+    }
+
+    // documents with Gaussian features, one per key that is inserted or queried, streams
+    // fill one chunk of documents at a time from their keys and dataset rows are viewed by
+    // the workers
+    uint64 num_data = config->dataset_path != NULL ? 0 : config->workload >= WORKLOAD_ZIPF ? STREAM_CHUNK : config->keys + (config->queries + 1) / 2;
+    int f = config->num_float_features;
+    bench->data = num_data ? (Data *)malloc(num_data * sizeof(Data)) : NULL;
+    bench->features = num_data ? (float *)malloc(num_data * f * sizeof(float)) : NULL;
+    isaac_ctx isaac;
+    isaac_init(&isaac, ISAAC_SEED, sizeof(ISAAC_SEED));
+    for (uint64 i=0; i<num_data; ++i)
+    {
+        bench->data[i].id = (unsigned int)bench_key(config, i);
+        bench->data[i].float_features = bench->features + i * f;
+        bench->data[i].num_float_features = f;
+        bench->data[i].cat_features = NULL;
+        bench->data[i].num_cat_features = 0;
+        for (int j=0; j<f; ++j)
+        {
+            bench->features[i * f + j] = gauss_rand(&isaac);
+        }
+    }
+
+    if (config->filter == BENCH_SSLBF)
+    {
+        init_sslbf(&(bench->sslbf), &(bench->model), config->P, config->K, config->m, config->bits_per_counter, config->tau);
+        return;
+    }
+    int g = config->g;
+    int *P_array = (int *)malloc(g * sizeof(int));
+    int *K_array = (int *)malloc(g * sizeof(int));
+    int *bits_array = (int *)malloc(g * sizeof(int));
+    uint64 *m_array = (uint64 *)malloc(g * sizeof(uint64));
+    float *tau_array = (float *)malloc((g + 1) * sizeof(float));
+    for (int i=0; i<g; ++i)
+    {
+        P_array[i] = config->P;
+        K_array[i] = config->K;
+        bits_array[i] = config->bits_per_counter;
+        m_array[i] = config->m / g;
+    }
+    for (int i=0; i<=g; ++i)
+    {
+        tau_array[i] = (float)i / g;
+    }
+    init_gslbf(&(bench->gslbf), &(bench->model), P_array, K_array, m_array, bits_array, tau_array, g);
+    free(P_array);
+    free(K_array);
+    free(bits_array);
+    free(m_array);
+}
+
+static void free_bench(Bench *bench)
+{
+    switch (bench->config.filter)
+    {
+        case BENCH_BF: free_bf(&(bench->bf)); break;
+        case BENCH_BBF: free_bbf(&(bench->bbf)); break;
+        case BENCH_SBF: free_sbf(&(bench->sbf)); break;
+        // the learned filters own the model they were initialized with
+        case BENCH_SSLBF: free_sslbf(&(bench->sslbf)); break;
+        case BENCH_GSLBF:
+        {
+            float *tau_array = bench->gslbf.tau_array;
+            free_gslbf(&(bench->gslbf));
+            free(tau_array);
+            break;
+        }
+    }
+    free(bench->data);
+    free(bench->features);
+    if (bench->dataset.base != NULL)
+    {
+        close_dataset(&(bench->dataset));
+    }
+}
+
+/**
+ * Insert or query a key, return the query answer. Learned filters use the document.
+*/
+static inline int bench_op(BenchWorker *worker, uint64 key, Data *document)
+{
+    Bench *bench = worker->bench;
+    int concurrent = bench->config.threads > 1;
+    switch (bench->config.filter)
+    {
+        case BENCH_BF:
+            if (worker->insert)
+            {
+                concurrent ? insert_bf_concurrent(&(bench->bf), &key, sizeof(uint64)) : insert_bf(&(bench->bf), &key, sizeof(uint64));
+                return 1;
+            }
+            return concurrent ? test_bf_concurrent(&(bench->bf), &key, sizeof(uint64)) : test_bf(&(bench->bf), &key, sizeof(uint64));
+        case BENCH_BBF:
+            if (worker->insert)
+            {
+                insert_bbf(&(bench->bbf), &key, sizeof(uint64));
+                return 1;
+            }
+            return test_bbf(&(bench->bbf), &key, sizeof(uint64));
+        case BENCH_SBF:
+            if (worker->insert)
+            {
+                concurrent ? insert_sbf_concurrent(&(worker->writer), &key, sizeof(uint64)) : insert_sbf(&(bench->sbf), &key, sizeof(uint64));
+                return 1;
+            }
+            return concurrent ? test_sbf_concurrent(&(bench->sbf), &key, sizeof(uint64)) : test_sbf(&(bench->sbf), &key, sizeof(uint64));
+        case BENCH_SSLBF:
+            if (worker->insert)
+            {
+                insert_sslbf(&(bench->sslbf), document, sizeof(unsigned int));
+                return 1;
+            }
+            return test_sslbf(&(bench->sslbf), document, sizeof(unsigned int));
+        case BENCH_GSLBF:
+            if (worker->insert)
+            {
+                insert_gslbf(&(bench->gslbf), document, sizeof(unsigned int));
+                return 1;
+            }
+            return test_gslbf(&(bench->gslbf), document, sizeof(unsigned int));
+    }
+    return 0;
+}
+
+static inline uint64 now_nanoseconds()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void *bench_worker(void *arg)
+{
+    BenchWorker *worker = (BenchWorker *)arg;
+    BenchConfig *config = &(worker->bench->config);
+    OpStats *stats = &(worker->stats);
+    Dataset *dataset = &(worker->bench->dataset);
+    uint64 sample = config->sample;
+    stats->latencies = (uint64 *)malloc((sample ? (worker->end - worker->start) / sample + 1 : 1) * sizeof(uint64));
+    // dataset rows are viewed one at a time through the same Data
+    Data view;
+    const char **cat_features = dataset->base != NULL ? (const char **)malloc((dataset->num_cat_features + 1) * sizeof(char *)) : NULL;
+    uint64 skipped = 0;
+
+    for (uint64 j=worker->start; j<worker->end; ++j)
+    {
+        uint64 i = worker->insert ? j : bench_query_index(config, j);
+        uint64 key = bench_key(config, i);
+        Data *document = worker->bench->data ? &(worker->bench->data[i]) : NULL;
+        if (dataset->base != NULL)
+        {
+            if (worker->insert && ! bench_member(worker->bench, i))
+            {
+                skipped++;
+                continue;
+            }
+            dataset_row(dataset, i, &view, cat_features);
+            key = view.id;
+            document = &view;
+        }
+        int answer;
+        if (sample && j % sample == 0)
+        {
+            uint64 begin = now_nanoseconds();
+            answer = bench_op(worker, key, document);
+            stats->latencies[stats->num_latencies++] = now_nanoseconds() - begin;
+        }
+        else
+        {
+            answer = bench_op(worker, key, document);
+        }
+        if (! worker->insert)
+        {
+            int member = bench_member(worker->bench, i);
+            stats->members += member;
+            stats->false_negatives += member && ! answer;
+            stats->false_positives += ! member && answer;
+        }
+    }
+    stats->ops = worker->end - worker->start - skipped;
+    free(cat_features);
+    return NULL;
+}
+
+static int compare_uint64(const void *a, const void *b)
+{
+    uint64 x = *(const uint64 *)a, y = *(const uint64 *)b;
+    return (x > y) - (x < y);
+}
+
+static uint64 percentile(OpStats *stats, double q)
+{
+    return stats->num_latencies ? stats->latencies[(uint64)(q * (stats->num_latencies - 1))] : 0;
+}
+
+/**
+ * Run one phase (all inserts or all queries) split evenly over the configured threads
+ * and merge the worker statistics into stats.
+*/
+static void run_bench_phase(Bench *bench, int insert, OpStats *stats)
+{
+    int threads = bench->config.threads;
+    uint64 ops = insert ? bench->config.keys : bench->config.queries;
+    if (insert && bench->dataset.labels != NULL)
+    {
+        // labeled rows are found by scanning the whole dataset
+        ops = bench->dataset.num_rows;
+    }
+    BenchWorker *workers = (BenchWorker *)calloc(threads, sizeof(BenchWorker));
+    pthread_t *tids = (pthread_t *)malloc(threads * sizeof(pthread_t));
+    for (int t=0; t<threads; ++t)
+    {
+        workers[t].bench = bench;
+        workers[t].insert = insert;
+        workers[t].start = ops * t / threads;
+        workers[t].end = ops * (t + 1) / threads;
+        if (bench->config.filter == BENCH_SBF && threads > 1)
+        {
+            init_sbf_writer(&(workers[t].writer), &(bench->sbf), t);
+        }
+    }
+
+    double start = now_seconds();
+    if (threads == 1)
+    {
+        bench_worker(&(workers[0]));
+    }
+    else
+    {
+        for (int t=0; t<threads; ++t)
+        {
+            pthread_create(&(tids[t]), NULL, bench_worker, &(workers[t]));
+        }
+        for (int t=0; t<threads; ++t)
+        {
+            pthread_join(tids[t], NULL);
+        }
+    }
+    memset(stats, 0, sizeof(OpStats));
+    stats->seconds = now_seconds() - start;
+
+    for (int t=0; t<threads; ++t)
+    {
+        stats->num_latencies += workers[t].stats.num_latencies;
+    }
+    stats->latencies = (uint64 *)malloc((stats->num_latencies + 1) * sizeof(uint64));
+    uint64 filled = 0;
+    for (int t=0; t<threads; ++t)
+    {
+        OpStats *part = &(workers[t].stats);
+        memcpy(stats->latencies + filled, part->latencies, part->num_latencies * sizeof(uint64));
+        filled += part->num_latencies;
+        stats->ops += part->ops;
+        stats->members += part->members;
+        stats->false_negatives += part->false_negatives;
+        stats->false_positives += part->false_positives;
+        free(part->latencies);
+    }
+    qsort(stats->latencies, stats->num_latencies, sizeof(uint64), compare_uint64);
+    free(workers);
+    free(tids);
+}
+
+/**
+ * Print s as a JSON string, quotes included. Quotes, backslashes and control characters
+ * are escaped, other bytes are printed as they are.
+*/
+static void print_json_string(const char *s)
+{
+    putchar('"');
+    for (; *s; ++s)
+    {
+        unsigned char c = (unsigned char)*s;
+        if (c == '"' || c == '\\')
+        {
+            printf("\\%c", c);
+        }
+        else if (c < 0x20)
+        {
+            printf("\\u%04x", c);
+        }
+        else
+        {
+            putchar(c);
+        }
+    }
+    putchar('"');
+}
+
+static void print_phase(const char *name, OpStats *stats, int json)
+{
+    double mops = stats->ops / stats->seconds / 1e6;
+    if (json)
+    {
+        printf("\"%s\":{\"ops\":%llu,\"seconds\":%.6f,\"mops_per_sec\":%.4f", name, stats->ops, stats->seconds, mops);
+        if (stats->num_latencies)
+        {
+            printf(",\"p50_ns\":%llu,\"p99_ns\":%llu,\"p999_ns\":%llu", percentile(stats, 0.5), percentile(stats, 0.99), percentile(stats, 0.999));
+        }
+        printf("}");
+        return;
+    }
+    printf("%-6s %10llu ops %8.3f s %8.3f M ops/sec", name, stats->ops, stats->seconds, mops);
+    if (stats->num_latencies)
+    {
+        printf("   p50 %6llu ns  p99 %6llu ns  p999 %7llu ns", percentile(stats, 0.5), percentile(stats, 0.99), percentile(stats, 0.999));
+    }
+    printf("\n");
+}
+
+// Duplicate detection accuracy over one stretch of a stream
+typedef struct TimelineRow
+{
+    uint64 events;              // events since the start of the stream
+    uint64 duplicates;          // keys of the stretch seen before
+    double false_positive_rate; // new keys reported as duplicates
+    double false_negative_rate; // duplicates reported as new
+    double zero_ratio;          // fraction of zero counters (bits for BF/BBF) at the end of the stretch
+} TimelineRow;
+
+/**
+ * Fill the stream document with Gaussian features derived from the key, so a key
+ * repeated in the stream is scored the same way every time.
+*/
+static void stream_document(Data *document, uint64 key)
+{
+    document->id = (unsigned int)key;
+    WyRand rng;
+    wyrand_seed(&rng, key);
+    for (int j=0; j<document->num_float_features; j+=2)
+    {
+        double u = ((wyrand_next(&rng) >> 11) + 1) * 0x1.0p-53;
+        double v = (wyrand_next(&rng) >> 11) * 0x1.0p-53;
+        double r = sqrt(-2 * log(u));
+        document->float_features[j] = r * cos(2 * PI * v);
+        if (j + 1 < document->num_float_features)
+        {
+            document->float_features[j + 1] = r * sin(2 * PI * v);
+        }
+    }
+}
+
+static double bench_zero_ratio(Bench *bench)
+{
+    CounterBitSet *counters = NULL;
+    switch (bench->config.filter)
+    {
+        case BENCH_BF: counters = &(bench->bf.bitset); break;
+        case BENCH_BBF: counters = &(bench->bbf.bitset); break;
+        case BENCH_SBF: counters = &(bench->sbf.counters); break;
+        case BENCH_SSLBF: counters = &(bench->sslbf.sbf.counters); break;
+        case BENCH_GSLBF:
+        {
+            uint64 zeros = 0, size = 0;
+            for (int i=0; i<bench->gslbf.g; ++i)
+            {
+                zeros += bench->gslbf.SBF_array[i].counters.zero_count;
+                size += bench->gslbf.SBF_array[i].counters.size;
+            }
+            return (double)zeros / size;
+        }
+    }
+    return (double)counters->zero_count / counters->size;
+}
+
+/**
+ * Replay a generated stream: every key is first queried, i.e. is it a duplicate, then
+ * inserted. Answers are checked against the exact set of keys seen so far and error
+ * rates are reported every report_interval events.
+ * Keys, documents and the exact answers are prepared a chunk of events at a time, so that
+ * only the filter operations are timed, with one timer pair per chunk. Queries and
+ * inserts interleave, so a stream event (query then insert) is the measured operation.
+ *
+ * bench: pointer to an initialized Bench
+ * stats: pointer to the OpStats of stream events to be filled
+ * rows: pointer to the timeline to be allocated and filled, keys / report_interval rows
+*/
+static int run_bench_stream(Bench *bench, OpStats *stats, TimelineRow **rows)
+{
+    BenchConfig *config = &(bench->config);
+    StreamOptions options = config->stream;
+    options.mode = config->workload == WORKLOAD_ZIPF ? STREAM_ZIPF : config->workload == WORKLOAD_WINDOW ? STREAM_WINDOW : STREAM_BURSTY;
+    StreamGenerator stream;
+    init_stream(&stream, &options);
+    KeySet seen;
+    init_key_set(&seen, config->keys);
+
+    BenchWorker inserter, querier;
+    memset(&inserter, 0, sizeof(BenchWorker));
+    memset(&querier, 0, sizeof(BenchWorker));
+    inserter.bench = querier.bench = bench;
+    inserter.insert = 1;
+    memset(stats, 0, sizeof(OpStats));
+    uint64 sample = config->sample;
+    stats->latencies = (uint64 *)malloc((sample ? config->keys / sample + 1 : 1) * sizeof(uint64));
+
+    uint64 keys[STREAM_CHUNK];
+    unsigned char duplicate[STREAM_CHUNK], answer[STREAM_CHUNK];
+    int num_rows = 0;
+    *rows = (TimelineRow *)malloc((config->keys / config->report_interval + 1) * sizeof(TimelineRow));
+    uint64 duplicates = 0, false_negatives = 0, false_positives = 0, last_row = 0;
+
+    for (uint64 e=0; e<config->keys; )
+    {
+        // chunks end at timeline rows, whose zero ratio is read after their last event
+        uint64 row_end = (e / config->report_interval + 1) * config->report_interval;
+        row_end = row_end < config->keys ? row_end : config->keys;
+        int n = row_end - e < STREAM_CHUNK ? row_end - e : STREAM_CHUNK;
+        for (int c=0; c<n; ++c)
+        {
+            keys[c] = next_stream_key(&stream);
+            duplicate[c] = insert_key_set(&seen, keys[c]);
+            if (bench->data != NULL)
+            {
+                stream_document(&(bench->data[c]), keys[c]);
+            }
+        }
+
+        uint64 begin = now_nanoseconds();
+        for (int c=0; c<n; ++c)
+        {
+            Data *document = bench->data != NULL ? &(bench->data[c]) : NULL;
+            if (sample && (e + c) % sample == 0)
+            {
+                uint64 op_begin = now_nanoseconds();
+                answer[c] = bench_op(&querier, keys[c], document);
+                bench_op(&inserter, keys[c], document);
+                stats->latencies[stats->num_latencies++] = now_nanoseconds() - op_begin;
+            }
+            else
+            {
+                answer[c] = bench_op(&querier, keys[c], document);
+                bench_op(&inserter, keys[c], document);
+            }
+        }
+        stats->seconds += (now_nanoseconds() - begin) * 1e-9;
+
+        for (int c=0; c<n; ++c)
+        {
+            duplicates += duplicate[c];
+            false_negatives += duplicate[c] && ! answer[c];
+            false_positives += ! duplicate[c] && answer[c];
+        }
+        e += n;
+        if (e == row_end)
+        {
+            TimelineRow *row = &((*rows)[num_rows++]);
+            uint64 stretch = e - last_row;
+            last_row = e;
+            row->events = e;
+            row->duplicates = duplicates;
+            row->false_positive_rate = stretch > duplicates ? (double)false_positives / (stretch - duplicates) : 0;
+            row->false_negative_rate = duplicates ? (double)false_negatives / duplicates : 0;
+            row->zero_ratio = bench_zero_ratio(bench);
+            stats->members += duplicates;
+            stats->false_negatives += false_negatives;
+            stats->false_positives += false_positives;
+            duplicates = false_negatives = false_positives = 0;
+        }
+    }
+
+    stats->ops = config->keys;
+    qsort(stats->latencies, stats->num_latencies, sizeof(uint64), compare_uint64);
+    free_key_set(&seen);
+    free_stream(&stream);
+    return num_rows;
+}
+
+/**
+ * Open the hardware counters for the phases of filter operations, only in builds with
+ * SLBF_PERF and for single-threaded runs since the counters follow the calling thread.
+*/
+static int start_bench_perf(BenchConfig *config)
+{
+#ifdef SLBF_PERF
+    return config->threads == 1 && perf_start() > 0;
+#else
+    return 0;
+#endif
+}
+
+static void take_perf_totals(PerfTotals *totals)
+{
+    for (int p=0; p<NUM_PERF_PHASES; ++p)
+    {
+        perf_phase_totals(p, &(totals[p]));
+    }
+    perf_reset();
+}
+
+/**
+ * Counter values per operation of each phase that ran, e.g. cycles spent hashing per insert.
+*/
+static void print_perf(const char *name, PerfTotals *totals, uint64 ops, int json)
+{
+    if (json)
+    {
+        printf(",\"perf_%s\":{", name);
+    }
+    else
+    {
+        printf("%s phases, per op:\n", name);
+    }
+    int first = 1;
+    for (int p=0; p<NUM_PERF_PHASES; ++p)
+    {
+        if (totals[p].calls == 0)
+        {
+            continue;
+        }
+        if (json)
+        {
+            printf("%s\"%s\":{\"calls\":%.4f", first ? "" : ",", perf_phase_name(p), (double)totals[p].calls / ops);
+        }
+        else
+        {
+            printf("  %-11s calls %6.2f", perf_phase_name(p), (double)totals[p].calls / ops);
+        }
+        for (int e=0; e<NUM_PERF_EVENTS; ++e)
+        {
+            if (! perf_event_available(e))
+            {
+                printf(json ? ",\"%s\":null" : "  %s n/a", perf_event_name(e));
+                continue;
+            }
+            printf(json ? ",\"%s\":%.4f" : "  %s %10.3f", perf_event_name(e), (double)totals[p].events[e] / ops);
+        }
+        printf(json ? "}" : "\n");
+        first = 0;
+    }
+    if (json)
+    {
+        printf("}");
+    }
+}
+
+/**
+ * Benchmark one filter configuration given on the command line: insert all keys, then
+ * run the queries, or replay a stream with its error rates over time, reporting
+ * throughput, latency percentiles and error rates as text or as one JSON object per run.
+*/
+static int run_benchmark(int argc, char *argv[])
+{
+    Bench bench;
+    memset(&bench, 0, sizeof(Bench));
+    parse_bench_config(&(bench.config), &(bench.dataset), argc, argv);
+    BenchConfig *config = &(bench.config);
+    init_bench(&bench);
+
+    OpStats insert_stats, query_stats;
+    memset(&insert_stats, 0, sizeof(OpStats));
+    TimelineRow *rows = NULL;
+    int num_rows = 0;
+    PerfTotals insert_perf[NUM_PERF_PHASES], query_perf[NUM_PERF_PHASES];
+    int perf = start_bench_perf(config);
+    if (config->workload >= WORKLOAD_ZIPF)
+    {
+        // stream events are both queries and inserts, their answers give the error rates
+        num_rows = run_bench_stream(&bench, &query_stats, &rows);
+        take_perf_totals(insert_perf);
+    }
+    else
+    {
+        run_bench_phase(&bench, 1, &insert_stats);
+        take_perf_totals(insert_perf);
+        run_bench_phase(&bench, 0, &query_stats);
+        take_perf_totals(query_perf);
+    }
+    uint64 non_members = query_stats.ops - query_stats.members;
+    double fpr = non_members ? (double)query_stats.false_positives / non_members : 0;
+    double fnr = query_stats.members ? (double)query_stats.false_negatives / query_stats.members : 0;
+
+    if (config->json)
+    {
+        printf("{\"filter\":\"%s\",\"workload\":\"%s\",\"K\":%d,\"P\":%d,\"m\":%llu,\"bits_per_counter\":%d,\"tau\":%g,\"g\":%d,"
+               "\"layout\":\"%s\",\"decrement_mode\":\"%s\",\"rng\":\"%s\",\"hash_mode\":\"%s\",\"keys\":%llu,\"queries\":%llu,\"threads\":%d,"
+               "\"sample\":%d,\"simd\":\"%s\",",
+               BENCH_FILTER_NAMES[config->filter], BENCH_WORKLOAD_NAMES[config->workload], config->K, config->P, config->m,
+               config->bits_per_counter, config->tau, config->g, LAYOUT_NAMES[config->options.layout], DECREMENT_NAMES[config->options.decrement_mode],
+               RNG_NAMES[config->options.rng], HASH_NAMES[config->filter == BENCH_BF ? config->bf_hash_mode : config->options.hash_mode],
+               config->keys, config->queries, config->threads, config->sample, simd_level_name(simd_level()));
+        if (config->dataset_path != NULL)
+        {
+            printf("\"dataset\":");
+            print_json_string(config->dataset_path);
+            printf(",\"rows\":%llu,", bench.dataset.num_rows);
+        }
+        if (num_rows)
+        {
+            print_phase("stream", &query_stats, 1);
+        }
+        else
+        {
+            print_phase("insert", &insert_stats, 1);
+            printf(",");
+            print_phase("query", &query_stats, 1);
+        }
+        printf(",\"false_positive_rate\":%.6f,\"false_negative_rate\":%.6f", fpr, fnr);
+        if (num_rows)
+        {
+            printf(",\"timeline\":[");
+            for (int i=0; i<num_rows; ++i)
+            {
+                printf("%s{\"events\":%llu,\"duplicates\":%llu,\"false_positive_rate\":%.6f,\"false_negative_rate\":%.6f,\"zero_ratio\":%.6f}",
+                       i ? "," : "", rows[i].events, rows[i].duplicates, rows[i].false_positive_rate, rows[i].false_negative_rate, rows[i].zero_ratio);
+            }
+            printf("]");
+        }
+        if (perf)
+        {
+            print_perf(num_rows ? "stream" : "insert", insert_perf, num_rows ? query_stats.ops : insert_stats.ops, 1);
+            if (! num_rows)
+            {
+                print_perf("query", query_perf, query_stats.ops, 1);
+            }
+        }
+        printf("}\n");
+    }
+    else
+    {
+        printf("%s, %s keys, K=%d P=%d m=%llu bits=%d, %llu keys, %llu queries, %d thread(s)\n",
+               BENCH_FILTER_NAMES[config->filter], BENCH_WORKLOAD_NAMES[config->workload], config->K, config->P, config->m,
+               config->bits_per_counter, config->keys, config->queries, config->threads);
+        if (config->dataset_path != NULL)
+        {
+            printf("dataset %s, %llu rows\n", config->dataset_path, bench.dataset.num_rows);
+        }
+        if (num_rows)
+        {
+            printf("%12s %12s %10s %10s %10s\n", "events", "duplicates", "fpr", "fnr", "zeros");
+            for (int i=0; i<num_rows; ++i)
+            {
+                printf("%12llu %12llu %10.6f %10.6f %10.6f\n", rows[i].events, rows[i].duplicates,
+                       rows[i].false_positive_rate, rows[i].false_negative_rate, rows[i].zero_ratio);
+            }
+        }
+        if (num_rows)
+        {
+            print_phase("stream", &query_stats, 0);
+        }
+        else
+        {
+            print_phase("insert", &insert_stats, 0);
+            print_phase("query", &query_stats, 0);
+        }
+        printf("false positive rate %.6f, false negative rate %.6f\n", fpr, fnr);
+        if (perf)
+        {
+            print_perf(num_rows ? "stream" : "insert", insert_perf, num_rows ? query_stats.ops : insert_stats.ops, 0);
+            if (! num_rows)
+            {
+                print_perf("query", query_perf, query_stats.ops, 0);
+            }
+        }
+    }
+
+    free(insert_stats.latencies);
+    free(query_stats.latencies);
+    free(rows);
+    free_bench(&bench);
+    return 0;
+}
+
+static const char *EXPERIMENT_USAGE =
+    "experiments: main -x name [arguments], defaults in parentheses\n"
+    "  bf [xxh32|xxh64]                       standard Bloom filter (xxh32)\n"
+    "  bbf                                    blocked Bloom filter\n"
+    "  sbf [layout] [decrement mode]          SBF stable point (packed random)\n"
+    "  sbf_throughput [layout] [mode]         SBF inserts per second (packed random)\n"
+    "  sbf_rng [layout]                       isaac against wyrand decrements (padded)\n"
+    "  bulk_decrement [bits] [layout]         decrement_range against a sweep (3 packed)\n"
+    "  sbf_timed                              wall-clock aging\n"
+    "  zero_tracking [layout] [bits]          zero rate monitoring (packed 3)\n"
+    "  persistence [path] [logistic] [cbm] [features]  save and mmap round trips, learned filters\n"
+    "                                         with both models (./sbf.filter ../models/logistic, no boost)\n"
+    "  snapshot [path]                        fork snapshots during ingest (./sbf.snapshot)\n"
+    "  dataset [path] [rows] [floats]         columnar dataset views (./rows.dataset 20000000 16)\n"
+    "  batch_query [batch]                    batched queries (64)\n"
+    "  bf_concurrent [threads]                concurrent BF (8)\n"
+    "  sbf_concurrent [threads] [layout] [mode]  concurrent SBF stress test (8 padded random)\n"
+    "  sharded_sbf [threads] [shards]         sharded SBF ingest (8 64)\n"
+    "  dot_product [features]                 logistic SIMD kernels (512)\n"
+    "  gslbf_scores                           GSLBF scores outside the threshold grid\n"
+    "  model_parity [cbm] [json] [features]   CatBoost against the native evaluator\n"
+    "                                         (../models/boost.cbm ../models/boost.json 20)\n";
+
+static const char *exp_arg(int argc, char *argv[], int i, const char *fallback)
+{
+    return i < argc ? argv[i] : fallback;
+}
+
+/**
+ * Run a built-in experiment by name. argv[0] is the name, the next arguments override
+ * the defaults listed in EXPERIMENT_USAGE.
+*/
+static int run_experiment(int argc, char *argv[])
+{
+    const char *name = argv[0];
+    if (! strcmp(name, "bf"))
+    {
+        exp_bf(parse_name(exp_arg(argc, argv, 1, "xxh32"), HASH_NAMES, 2, 'x'));
+    }
+    else if (! strcmp(name, "bbf"))
+    {
+        exp_bbf();
+    }
+    else if (! strcmp(name, "sbf") || ! strcmp(name, "sbf_throughput"))
+    {
+        CounterLayout layout = parse_name(exp_arg(argc, argv, 1, "packed"), LAYOUT_NAMES, 2, 'x');
+        DecrementMode mode = parse_name(exp_arg(argc, argv, 2, "random"), DECREMENT_NAMES, 2, 'x');
+        if (! strcmp(name, "sbf"))
+        {
+            exp_sbf(layout, mode);
+        }
+        else
+        {
+            exp_sbf_throughput(layout, mode);
+        }
+    }
+    else if (! strcmp(name, "sbf_rng"))
+    {
+        exp_sbf_rng(parse_name(exp_arg(argc, argv, 1, "padded"), LAYOUT_NAMES, 2, 'x'));
+    }
+    else if (! strcmp(name, "bulk_decrement"))
+    {
+        exp_bulk_decrement(atoi(exp_arg(argc, argv, 1, "3")), parse_name(exp_arg(argc, argv, 2, "packed"), LAYOUT_NAMES, 2, 'x'));
+    }
+    else if (! strcmp(name, "sbf_timed"))
+    {
+        exp_sbf_timed();
+    }
+    else if (! strcmp(name, "zero_tracking"))
+    {
+        exp_zero_tracking(parse_name(exp_arg(argc, argv, 1, "packed"), LAYOUT_NAMES, 2, 'x'), atoi(exp_arg(argc, argv, 2, "3")));
+    }
+    else if (! strcmp(name, "persistence"))
+    {
+        exp_persistence((char *)exp_arg(argc, argv, 1, "./sbf.filter"), (char *)exp_arg(argc, argv, 2, "../models/logistic"),
+                        (char *)exp_arg(argc, argv, 3, NULL), atoi(exp_arg(argc, argv, 4, "20")));
+    }
+    else if (! strcmp(name, "snapshot"))
+    {
+        exp_snapshot((char *)exp_arg(argc, argv, 1, "./sbf.snapshot"));
+    }
+    else if (! strcmp(name, "dataset"))
+    {
+        exp_dataset((char *)exp_arg(argc, argv, 1, "./rows.dataset"), strtoull(exp_arg(argc, argv, 2, "20000000"), NULL, 10),
+                    atoi(exp_arg(argc, argv, 3, "16")));
+    }
+    else if (! strcmp(name, "batch_query"))
+    {
+        exp_batch_query(atoi(exp_arg(argc, argv, 1, "64")));
+    }
+    else if (! strcmp(name, "bf_concurrent"))
+    {
+        exp_bf_concurrent(atoi(exp_arg(argc, argv, 1, "8")));
+    }
+    else if (! strcmp(name, "sbf_concurrent"))
+    {
+        exp_sbf_concurrent(atoi(exp_arg(argc, argv, 1, "8")), parse_name(exp_arg(argc, argv, 2, "padded"), LAYOUT_NAMES, 2, 'x'),
+                           parse_name(exp_arg(argc, argv, 3, "random"), DECREMENT_NAMES, 2, 'x'));
+    }
+    else if (! strcmp(name, "sharded_sbf"))
+    {
+        exp_sharded_sbf(atoi(exp_arg(argc, argv, 1, "8")), atoi(exp_arg(argc, argv, 2, "64")));
+    }
+    else if (! strcmp(name, "dot_product"))
+    {
+        exp_dot_product(atoi(exp_arg(argc, argv, 1, "512")));
+    }
+    else if (! strcmp(name, "gslbf_scores"))
+    {
+        exp_gslbf_scores();
+    }
+    else if (! strcmp(name, "model_parity"))
+    {
+        exp_model_parity((char *)exp_arg(argc, argv, 1, "../models/boost.cbm"), (char *)exp_arg(argc, argv, 2, "../models/boost.json"),
+                         atoi(exp_arg(argc, argv, 3, "20")));
+    }
+    else
+    {
+        printf("Unknown experiment %s.\n%s", name, EXPERIMENT_USAGE);
+        return 1;
+    }
+    return 0;
+}
+
+int main(int argc, char const *argv[])
+{
+    if (argc > 1 && ! strcmp(argv[1], "-x"))
+    {
+        if (argc == 2)
+        {
+            printf("%s", EXPERIMENT_USAGE);
+            return 1;
+        }
+        return run_experiment(argc - 2, (char **)argv + 2);
+    }
+    if (argc > 1)
+    {
+        return run_benchmark(argc, (char **)argv);
+    }
 
+    // without options, run the SBF stable point experiment
+    exp_sbf(LAYOUT_PACKED, DECREMENT_RANDOM);
     return 0;
 }
@@ -4,12 +4,15 @@
 #include "string.h"
 
 #include "./model.h"
+#include "./simd.h"
+#include "./perfstat.h"
 #include "../include/c_api.h"
 
 
 /**
  * Load classifier from file. 
- * Currently support logistic regression model and boosting tree model using Catboost.
+ * Currently support logistic regression model, boosting tree model using Catboost, and
+ * Catboost json exports evaluated by the native oblivious tree evaluator.
  * 
  * model: pointer to a Model
  * type: model type
@@ -49,7 +52,7 @@ void load_model(Model *model, ModelType type, char *path)
         }
         fclose(fp);
 
-        if ((count == num_weights) && (!weights)) 
+        if ((count == num_weights) && weights)
         {
             model->type = LOGISTIC;
             model->num_weights = num_weights;
@@ -64,6 +67,10 @@ void load_model(Model *model, ModelType type, char *path)
     }
     else if (type == BOOST)
     {
+        if (model->catboost_model_handle == NULL)
+        {
+            model->catboost_model_handle = ModelCalcerCreate();
+        }
         if (! LoadFullModelFromFile(model->catboost_model_handle, path))
         {
             printf("Load Catboost model failed. Error message: %s.\n", GetErrorString());
@@ -71,6 +78,12 @@ void load_model(Model *model, ModelType type, char *path)
         }
         model->type = BOOST;
     }
+    else if (type == OBLIVIOUS)
+    {
+        model->oblivious = (ObliviousModel *)malloc(sizeof(ObliviousModel));
+        load_oblivious_model(model->oblivious, path);
+        model->type = OBLIVIOUS;
+    }
     else
     {
         printf("Unsupported model type.");
@@ -95,6 +108,12 @@ void free_model(Model *model)
     {
         ModelCalcerDelete(model->catboost_model_handle);
     }
+    else if (model->type == OBLIVIOUS)
+    {
+        free_oblivious_model(model->oblivious);
+        free(model->oblivious);
+        model->oblivious = NULL;
+    }
 }
 
 float predict(Model *model, Data *data)
@@ -103,6 +122,10 @@ float predict(Model *model, Data *data)
     {
         return predict_logistic(model, data);
     }
+    else if (model->type == OBLIVIOUS)
+    {
+        return predict_tree(model, data);
+    }
     else 
     {
         return predict_boost(model, data);
@@ -110,6 +133,42 @@ float predict(Model *model, Data *data)
 }
 
 
+/**
+ * Raw score (logit) of logistic model, i.e. the dot product of features and weights.
+ * 
+ * data: pointer to Data
+ * model: pointer to Model
+*/
+static float logistic_margin(Model *model, Data *data)
+{
+    return dot_product(data->float_features, model->weights, data->num_float_features);
+}
+
+/**
+ * Raw scores of logistic model for a batch of Data, scored several rows at a time.
+ * All Data must have the same number of float features.
+ * 
+ * model: pointer to Model
+ * data: array of n Data
+ * n: number of Data
+ * scores: pointer to the n results to be stored
+*/
+static void logistic_margin_batch(Model *model, Data *data, int n, float *scores)
+{
+    if (n <= 0)
+    {
+        return;
+    }
+
+    const float **rows = (const float **)malloc(n * sizeof(float *));
+    for (int i=0; i<n; ++i)
+    {
+        rows[i] = data[i].float_features;
+    }
+    dot_product_batch(rows, model->weights, n, data[0].num_float_features, scores);
+    free(rows);
+}
+
 /**
  * Make prediction using logistic model.
  * 
@@ -118,14 +177,61 @@ float predict(Model *model, Data *data)
 */
 float predict_logistic(Model *model, Data *data)
 {
-    float sum = 0;
-    for (int i=0; i<data->num_float_features; ++i)
+    return 1 / (1 + exp(-logistic_margin(model, data)));
+}
+
+
+/**
+ * Make prediction in raw score space, which is monotone in predict and cheaper:
+ * the logit for logistic model (no exp), the raw formula value for tree models.
+ * Compare it against raw_threshold(model, tau) instead of comparing predict with tau.
+ * 
+ * model: pointer to Model
+ * data: pointer to Data
+*/
+float predict_raw(Model *model, Data *data)
+{
+    float score;
+    PERF_BEGIN(PERF_MODEL);
+    if (model->type == LOGISTIC)
+    {
+        score = logistic_margin(model, data);
+    }
+    else if (model->type == OBLIVIOUS)
     {
-        sum -= data->float_features[i] * model->weights[i];
+        score = predict_tree(model, data);
     }
-    return 1 / (1 + exp(sum));
+    else
+    {
+        score = predict_boost(model, data);
+    }
+    PERF_END(PERF_MODEL);
+    return score;
 }
 
+/**
+ * Map a decision threshold on predict to the equivalent one on predict_raw,
+ * i.e. logit(tau) for logistic model and tau itself for tree models.
+ * 
+ * model: pointer to Model
+ * tau: decision threshold
+*/
+float raw_threshold(Model *model, float tau)
+{
+    if (model->type != LOGISTIC)
+    {
+        return tau;
+    }
+    if (tau <= 0)
+    {
+        return -INFINITY;
+    }
+    if (tau >= 1)
+    {
+        return INFINITY;
+    }
+    return logf(tau / (1 - tau));
+}
 
 /**
  * Make prediction using boosting model.
@@ -148,3 +254,162 @@ float predict_boost( Model *model, Data *data)
     return prediction;
 }
 
+
+
+/**
+ * Make prediction using the native oblivious tree evaluator, same raw value as predict_boost
+ * for a model with float features only.
+ * 
+ * data: pointer to Data
+ * model: pointer to Model
+*/
+float predict_tree(Model *model, Data *data)
+{
+    return predict_oblivious(model->oblivious, data->float_features);
+}
+
+/**
+ * Make predictions for a batch of Data, scores[i] equals predict(model, &data[i]).
+ * 
+ * model: pointer to Model
+ * data: array of n Data
+ * n: number of Data
+ * scores: pointer to the n results to be stored
+*/
+void predict_batch(Model *model, Data *data, int n, float *scores)
+{
+    if (model->type == LOGISTIC)
+    {
+        predict_logistic_batch(model, data, n, scores);
+    }
+    else if (model->type == OBLIVIOUS)
+    {
+        predict_tree_batch(model, data, n, scores);
+    }
+    else
+    {
+        predict_boost_batch(model, data, n, scores);
+    }
+}
+
+
+/**
+ * Make predictions for a batch of Data using logistic model.
+ * All Data must have the same number of float features.
+ * 
+ * model: pointer to Model
+ * data: array of n Data
+ * n: number of Data
+ * scores: pointer to the n results to be stored
+*/
+void predict_logistic_batch(Model *model, Data *data, int n, float *scores)
+{
+    logistic_margin_batch(model, data, n, scores);
+    for (int i=0; i<n; ++i)
+    {
+        scores[i] = 1 / (1 + exp(-scores[i]));
+    }
+}
+
+
+/**
+ * Make predictions for a batch of Data using boosting model, with a single
+ * CalcModelPrediction call for the whole batch.
+ * All Data must have the same number of float and categorical features.
+ * 
+ * model: pointer to Model
+ * data: array of n Data
+ * n: number of Data
+ * scores: pointer to the n results to be stored
+*/
+void predict_boost_batch(Model *model, Data *data, int n, float *scores)
+{
+    if (n <= 0)
+    {
+        return;
+    }
+
+    const float **float_features = (const float **)malloc(n * sizeof(float *));
+    const char ***cat_features = (const char ***)malloc(n * sizeof(char **));
+    double *predictions = (double *)malloc(n * sizeof(double));
+    for (int i=0; i<n; ++i)
+    {
+        float_features[i] = data[i].float_features;
+        cat_features[i] = data[i].cat_features;
+    }
+
+    if (! CalcModelPrediction(
+        model->catboost_model_handle, n,
+        float_features, data[0].num_float_features,
+        cat_features, data[0].num_cat_features,
+        predictions, n
+    ))
+    {
+        printf("CalcModelPrediction error message: %s\n", GetErrorString());
+    }
+    for (int i=0; i<n; ++i)
+    {
+        scores[i] = predictions[i];
+    }
+
+    free(float_features);
+    free(cat_features);
+    free(predictions);
+}
+
+
+/**
+ * Make predictions for a batch of Data using the native oblivious tree evaluator.
+ * 
+ * model: pointer to Model
+ * data: array of n Data
+ * n: number of Data
+ * scores: pointer to the n results to be stored
+*/
+void predict_tree_batch(Model *model, Data *data, int n, float *scores)
+{
+    if (n <= 0)
+    {
+        return;
+    }
+
+    const float **rows = (const float **)malloc(n * sizeof(float *));
+    double *predictions = (double *)malloc(n * sizeof(double));
+    for (int i=0; i<n; ++i)
+    {
+        rows[i] = data[i].float_features;
+    }
+    predict_oblivious_batch(model->oblivious, rows, n, predictions);
+    for (int i=0; i<n; ++i)
+    {
+        scores[i] = predictions[i];
+    }
+    free(rows);
+    free(predictions);
+}
+
+/**
+ * Make raw score predictions for a batch of Data, scores[i] equals predict_raw(model, &data[i]).
+ * 
+ * model: pointer to Model
+ * data: array of n Data
+ * n: number of Data
+ * scores: pointer to the n results to be stored
+*/
+void predict_raw_batch(Model *model, Data *data, int n, float *scores)
+{
+    PERF_BEGIN(PERF_MODEL);
+    if (model->type == LOGISTIC)
+    {
+        logistic_margin_batch(model, data, n, scores);
+    }
+    else if (model->type == OBLIVIOUS)
+    {
+        predict_tree_batch(model, data, n, scores);
+    }
+    else
+    {
+        predict_boost_batch(model, data, n, scores);
+    }
+    PERF_END(PERF_MODEL);
+}
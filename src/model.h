@@ -2,6 +2,7 @@
 #define MODEL_H
 
 #include "../include/c_api.h"
+#include "./oblivious.h"
 
 typedef struct Data
 {
@@ -16,7 +17,8 @@ typedef struct Data
 typedef enum ModelType
 {
     LOGISTIC,
-    BOOST
+    BOOST,
+    OBLIVIOUS // catboost json export evaluated natively
 } ModelType;
 
 typedef struct Model
@@ -27,6 +29,8 @@ typedef struct Model
     int num_weights;
     // for boost model (using catboost)
     ModelCalcerHandle *catboost_model_handle;
+    // for oblivious model
+    ObliviousModel *oblivious;
 } Model;
 
 
@@ -35,5 +39,13 @@ void free_model(Model *model);
 float predict(Model *model, Data *data);
 float predict_logistic(Model *model, Data *data);
 float predict_boost(Model *model, Data *data);
+float predict_tree(Model *model, Data *data);
+float predict_raw(Model *model, Data *data);
+float raw_threshold(Model *model, float tau);
+void predict_batch(Model *model, Data *data, int n, float *scores);
+void predict_logistic_batch(Model *model, Data *data, int n, float *scores);
+void predict_boost_batch(Model *model, Data *data, int n, float *scores);
+void predict_tree_batch(Model *model, Data *data, int n, float *scores);
+void predict_raw_batch(Model *model, Data *data, int n, float *scores);
 
 #endif
@@ -0,0 +1,408 @@
+#include "stdio.h"
+#include "stdlib.h"
+#include "string.h"
+
+#include "./oblivious.h"
+
+#define OBLIVIOUS_BLOCK 64 // documents evaluated together per tree in batch mode
+
+
+/**
+ * Minimal JSON document model, enough to read CatBoost json exports.
+*/
+typedef enum JsonType
+{
+    JSON_NULL,
+    JSON_BOOL,
+    JSON_NUMBER,
+    JSON_STRING,
+    JSON_ARRAY,
+    JSON_OBJECT
+} JsonType;
+
+typedef struct JsonValue
+{
+    JsonType type;
+    double number;
+    char *string;
+    int length;              // number of array items or object members
+    char **keys;             // object member names
+    struct JsonValue *items; // array items or object member values
+} JsonValue;
+
+static void json_parse_value(const char **p, JsonValue *value);
+
+static void json_error(const char *p, const char *expected)
+{
+    printf("Model json format error: expected %s near \"%.20s\".\n", expected, p);
+    exit(1);
+}
+
+static void json_skip_whitespace(const char **p)
+{
+    while (**p == ' ' || **p == '\t' || **p == '\n' || **p == '\r')
+    {
+        (*p)++;
+    }
+}
+
+static char *json_parse_string(const char **p)
+{
+    if (**p != '"')
+    {
+        json_error(*p, "string");
+    }
+    (*p)++;
+    const char *start = *p;
+    while (**p && **p != '"')
+    {
+        if (**p == '\\' && *(*p + 1))
+        {
+            (*p)++;
+        }
+        (*p)++;
+    }
+    if (**p != '"')
+    {
+        json_error(start, "end of string");
+    }
+
+    // escapes are kept verbatim, the names we look up contain none
+    int length = *p - start;
+    char *string = (char *)malloc(length + 1);
+    memcpy(string, start, length);
+    string[length] = '\0';
+    (*p)++;
+    return string;
+}
+
+static void json_append(JsonValue *value, int *capacity, char *key, const char **p)
+{
+    if (value->length == *capacity)
+    {
+        *capacity = *capacity ? 2 * *capacity : 8;
+        value->items = (JsonValue *)realloc(value->items, *capacity * sizeof(JsonValue));
+        if (value->type == JSON_OBJECT)
+        {
+            value->keys = (char **)realloc(value->keys, *capacity * sizeof(char *));
+        }
+    }
+    if (value->type == JSON_OBJECT)
+    {
+        value->keys[value->length] = key;
+    }
+    json_parse_value(p, &(value->items[value->length]));
+    value->length++;
+}
+
+static void json_parse_value(const char **p, JsonValue *value)
+{
+    memset(value, 0, sizeof(JsonValue));
+    json_skip_whitespace(p);
+
+    if (**p == '{' || **p == '[')
+    {
+        char close = **p == '{' ? '}' : ']';
+        int capacity = 0;
+        value->type = **p == '{' ? JSON_OBJECT : JSON_ARRAY;
+        (*p)++;
+        json_skip_whitespace(p);
+        while (**p != close)
+        {
+            char *key = NULL;
+            if (value->type == JSON_OBJECT)
+            {
+                key = json_parse_string(p);
+                json_skip_whitespace(p);
+                if (**p != ':')
+                {
+                    json_error(*p, "':'");
+                }
+                (*p)++;
+            }
+            json_append(value, &capacity, key, p);
+            json_skip_whitespace(p);
+            if (**p == ',')
+            {
+                (*p)++;
+                json_skip_whitespace(p);
+            }
+            else if (**p != close)
+            {
+                json_error(*p, "',' or end of container");
+            }
+        }
+        (*p)++;
+    }
+    else if (**p == '"')
+    {
+        value->type = JSON_STRING;
+        value->string = json_parse_string(p);
+    }
+    else if (! strncmp(*p, "true", 4) || ! strncmp(*p, "false", 5))
+    {
+        value->type = JSON_BOOL;
+        value->number = **p == 't';
+        *p += **p == 't' ? 4 : 5;
+    }
+    else if (! strncmp(*p, "null", 4))
+    {
+        value->type = JSON_NULL;
+        *p += 4;
+    }
+    else
+    {
+        char *end = NULL;
+        value->type = JSON_NUMBER;
+        value->number = strtod(*p, &end);
+        if (end == *p)
+        {
+            json_error(*p, "value");
+        }
+        *p = end;
+    }
+}
+
+static JsonValue *json_get(JsonValue *object, const char *key)
+{
+    if (object == NULL || object->type != JSON_OBJECT)
+    {
+        return NULL;
+    }
+    for (int i=0; i<object->length; ++i)
+    {
+        if (! strcmp(object->keys[i], key))
+        {
+            return &(object->items[i]);
+        }
+    }
+    return NULL;
+}
+
+static void json_free(JsonValue *value)
+{
+    for (int i=0; i<value->length; ++i)
+    {
+        json_free(&(value->items[i]));
+        if (value->type == JSON_OBJECT)
+        {
+            free(value->keys[i]);
+        }
+    }
+    free(value->items);
+    free(value->keys);
+    free(value->string);
+}
+
+static JsonValue *json_require(JsonValue *object, const char *key, JsonType type)
+{
+    JsonValue *value = json_get(object, key);
+    if (value == NULL || value->type != type)
+    {
+        printf("Model json format error: missing or invalid \"%s\".\n", key);
+        exit(1);
+    }
+    return value;
+}
+
+
+/**
+ * Load an oblivious tree ensemble from a CatBoost json export
+ * (model.save_model(path, format="json")).
+ * Only float feature splits of single-dimension models are supported; models using
+ * categorical features (one-hot or CTR splits) are rejected.
+ *
+ * model: pointer to an ObliviousModel
+ * path: path to the json file
+*/
+void load_oblivious_model(ObliviousModel *model, const char *path)
+{
+    FILE *fp = fopen(path, "rb");
+    if (fp == NULL)
+    {
+        printf("Read file failed.");
+        exit(1);
+    }
+    fseek(fp, 0, SEEK_END);
+    long size = ftell(fp);
+    fseek(fp, 0, SEEK_SET);
+    char *text = (char *)malloc(size + 1);
+    if (fread(text, 1, size, fp) != (size_t)size)
+    {
+        printf("Read file failed.");
+        exit(1);
+    }
+    text[size] = '\0';
+    fclose(fp);
+
+    JsonValue root;
+    const char *p = text;
+    json_parse_value(&p, &root);
+    JsonValue *trees = json_require(&root, "oblivious_trees", JSON_ARRAY);
+
+    // first pass: sizes
+    int num_splits = 0, num_leaves = 0;
+    for (int t=0; t<trees->length; ++t)
+    {
+        JsonValue *splits = json_require(&(trees->items[t]), "splits", JSON_ARRAY);
+        JsonValue *leaves = json_require(&(trees->items[t]), "leaf_values", JSON_ARRAY);
+        if (leaves->length != (1 << splits->length))
+        {
+            printf("Model json format error: tree %d has %d leaves for depth %d (multi-dimension models are not supported).\n",
+                   t, leaves->length, splits->length);
+            exit(1);
+        }
+        num_splits += splits->length;
+        num_leaves += leaves->length;
+    }
+
+    model->num_trees = trees->length;
+    model->num_splits = num_splits;
+    model->tree_depth = (int *)malloc(trees->length * sizeof(int));
+    model->tree_split_offset = (int *)malloc(trees->length * sizeof(int));
+    model->tree_leaf_offset = (int *)malloc(trees->length * sizeof(int));
+    model->split_feature = (int *)malloc(num_splits * sizeof(int));
+    model->split_border = (float *)malloc(num_splits * sizeof(float));
+    model->leaf_values = (double *)malloc(num_leaves * sizeof(double));
+
+    // second pass: flatten
+    int split_offset = 0, leaf_offset = 0, max_feature = -1;
+    for (int t=0; t<trees->length; ++t)
+    {
+        JsonValue *splits = json_get(&(trees->items[t]), "splits");
+        JsonValue *leaves = json_get(&(trees->items[t]), "leaf_values");
+        model->tree_depth[t] = splits->length;
+        model->tree_split_offset[t] = split_offset;
+        model->tree_leaf_offset[t] = leaf_offset;
+        for (int j=0; j<splits->length; ++j)
+        {
+            JsonValue *split = &(splits->items[j]);
+            JsonValue *split_type = json_get(split, "split_type");
+            if (split_type != NULL && (split_type->type != JSON_STRING || strcmp(split_type->string, "FloatFeature")))
+            {
+                printf("Unsupported split type %s in tree %d, only FloatFeature splits are supported.\n",
+                       split_type->type == JSON_STRING ? split_type->string : "?", t);
+                exit(1);
+            }
+            int feature = (int)json_require(split, "float_feature_index", JSON_NUMBER)->number;
+            model->split_feature[split_offset] = feature;
+            model->split_border[split_offset] = (float)json_require(split, "border", JSON_NUMBER)->number;
+            max_feature = feature > max_feature ? feature : max_feature;
+            split_offset++;
+        }
+        for (int j=0; j<leaves->length; ++j)
+        {
+            model->leaf_values[leaf_offset++] = leaves->items[j].number;
+        }
+    }
+
+    // raw prediction is scale * sum + bias, bias is a one-element array for single-dimension models
+    model->scale = 1;
+    model->bias = 0;
+    JsonValue *scale_and_bias = json_get(&root, "scale_and_bias");
+    if (scale_and_bias != NULL && scale_and_bias->type == JSON_ARRAY && scale_and_bias->length == 2)
+    {
+        model->scale = scale_and_bias->items[0].number;
+        JsonValue *bias = &(scale_and_bias->items[1]);
+        model->bias = bias->type == JSON_ARRAY ? (bias->length ? bias->items[0].number : 0) : bias->number;
+    }
+
+    model->num_float_features = max_feature + 1;
+    JsonValue *float_features = json_get(json_get(&root, "features_info"), "float_features");
+    if (float_features != NULL && float_features->type == JSON_ARRAY && float_features->length > model->num_float_features)
+    {
+        model->num_float_features = float_features->length;
+    }
+
+    json_free(&root);
+    free(text);
+}
+
+/**
+ * Release memory allocated to an oblivious model.
+ *
+ * model: pointer to an ObliviousModel
+*/
+void free_oblivious_model(ObliviousModel *model)
+{
+    free(model->tree_depth);
+    free(model->tree_split_offset);
+    free(model->tree_leaf_offset);
+    free(model->split_feature);
+    free(model->split_border);
+    free(model->leaf_values);
+    model->leaf_values = NULL;
+}
+
+/**
+ * Raw prediction of one document. The leaf index of each tree is built from comparison
+ * results without branches.
+ *
+ * model: pointer to an ObliviousModel
+ * features: float features of the document
+*/
+double predict_oblivious(ObliviousModel *model, const float *features)
+{
+    double sum = 0;
+    for (int t=0; t<model->num_trees; ++t)
+    {
+        const int *feature = model->split_feature + model->tree_split_offset[t];
+        const float *border = model->split_border + model->tree_split_offset[t];
+        int idx = 0;
+        for (int j=0; j<model->tree_depth[t]; ++j)
+        {
+            idx |= (features[feature[j]] > border[j]) << j;
+        }
+        sum += model->leaf_values[model->tree_leaf_offset[t] + idx];
+    }
+    return model->scale * sum + model->bias;
+}
+
+/**
+ * Raw predictions of many documents. Documents are evaluated OBLIVIOUS_BLOCK at a time
+ * tree by tree, so each tree's splits and leaves stay in cache for the whole block and
+ * the per-document loop is independent work the compiler can vectorize.
+ *
+ * model: pointer to an ObliviousModel
+ * rows: array of n pointers to float features
+ * n: number of documents
+ * out: pointer to the n results to be stored
+*/
+void predict_oblivious_batch(ObliviousModel *model, const float **rows, int n, double *out)
+{
+    int idx[OBLIVIOUS_BLOCK];
+    double sum[OBLIVIOUS_BLOCK];
+
+    for (int start=0; start<n; start+=OBLIVIOUS_BLOCK)
+    {
+        int block = n - start < OBLIVIOUS_BLOCK ? n - start : OBLIVIOUS_BLOCK;
+        const float **block_rows = rows + start;
+        memset(sum, 0, sizeof(sum));
+
+        for (int t=0; t<model->num_trees; ++t)
+        {
+            const int *feature = model->split_feature + model->tree_split_offset[t];
+            const float *border = model->split_border + model->tree_split_offset[t];
+            const double *leaves = model->leaf_values + model->tree_leaf_offset[t];
+            memset(idx, 0, sizeof(idx));
+            for (int j=0; j<model->tree_depth[t]; ++j)
+            {
+                int f = feature[j];
+                float b = border[j];
+                for (int d=0; d<block; ++d)
+                {
+                    idx[d] |= (block_rows[d][f] > b) << j;
+                }
+            }
+            for (int d=0; d<block; ++d)
+            {
+                sum[d] += leaves[idx[d]];
+            }
+        }
+
+        for (int d=0; d<block; ++d)
+        {
+            out[start + d] = model->scale * sum[d] + model->bias;
+        }
+    }
+}
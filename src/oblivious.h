@@ -0,0 +1,27 @@
+#ifndef OBLIVIOUS_H
+#define OBLIVIOUS_H
+
+// Oblivious decision tree ensemble loaded from a CatBoost json export.
+// Every level of a tree shares one split, so the leaf index of a document is a bitmask
+// with bit j set iff x[split_feature[j]] > split_border[j].
+typedef struct ObliviousModel
+{
+    int num_trees;
+    int num_splits;
+    int num_float_features;
+    int *tree_depth;          // [num_trees]
+    int *tree_split_offset;   // [num_trees], first split of each tree
+    int *tree_leaf_offset;    // [num_trees], first leaf value of each tree
+    int *split_feature;       // [num_splits]
+    float *split_border;      // [num_splits]
+    double *leaf_values;      // [sum of 2^depth]
+    double scale;
+    double bias;
+} ObliviousModel;
+
+void load_oblivious_model(ObliviousModel *model, const char *path);
+void free_oblivious_model(ObliviousModel *model);
+double predict_oblivious(ObliviousModel *model, const float *features);
+void predict_oblivious_batch(ObliviousModel *model, const float **rows, int n, double *out);
+
+#endif
@@ -0,0 +1,223 @@
+#include "stdio.h"
+#include "string.h"
+#include "unistd.h"
+#include "sys/mman.h"
+#include "sys/syscall.h"
+#include "linux/perf_event.h"
+
+#include "./perfstat.h"
+
+typedef struct PerfCounter
+{
+    int fd;
+    struct perf_event_mmap_page *page; // for rdpmc reads, NULL if the kernel does not allow them
+} PerfCounter;
+
+static const char *PERF_PHASE_NAMES[NUM_PERF_PHASES] = {"hash", "decrement", "set_to_max", "model", "interval"};
+static const char *PERF_EVENT_NAMES[NUM_PERF_EVENTS] = {"cycles", "llc_misses", "branch_misses"};
+
+static PerfCounter counters[NUM_PERF_EVENTS] = {{-1, NULL}, {-1, NULL}, {-1, NULL}};
+static int cycles_are_task_clock = 0;
+static __thread int perf_running = 0; // set for the thread that called perf_start
+static uint64 phase_start[NUM_PERF_PHASES][NUM_PERF_EVENTS];
+static PerfTotals phase_totals[NUM_PERF_PHASES];
+static double read_overhead[NUM_PERF_EVENTS]; // counted by an empty begin/end pair
+
+#define PERF_CALIBRATION_ROUNDS 1000
+
+
+static int open_counter(PerfCounter *counter, uint32 type, uint64 config)
+{
+    struct perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.type = type;
+    attr.size = sizeof(attr);
+    attr.config = config;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    counter->fd = syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+    counter->page = NULL;
+    if (counter->fd < 0)
+    {
+        return 0;
+    }
+    void *page = mmap(NULL, sysconf(_SC_PAGESIZE), PROT_READ, MAP_SHARED, counter->fd, 0);
+    if (page != MAP_FAILED)
+    {
+        counter->page = (struct perf_event_mmap_page *)page;
+    }
+    return 1;
+}
+
+/**
+ * Current value of a counter. Reads the PMU register directly with rdpmc when the kernel
+ * exposes it (tens of cycles), falls back to a read system call otherwise.
+*/
+static inline uint64 read_counter(PerfCounter *counter)
+{
+#if defined(__x86_64__) || defined(__i386__)
+    struct perf_event_mmap_page *page = counter->page;
+    if (page != NULL && page->cap_user_rdpmc)
+    {
+        uint32 seq, index;
+        uint64 count;
+        do
+        {
+            seq = page->lock;
+            __asm__ __volatile__("" ::: "memory");
+            index = page->index;
+            count = page->offset;
+            if (index)
+            {
+                uint32 low, high;
+                __asm__ __volatile__("rdpmc" : "=a"(low), "=d"(high) : "c"(index - 1));
+                int shift = 64 - page->pmc_width;
+                count += (uint64)((long long)((uint64)high << 32 | low) << shift >> shift);
+            }
+            __asm__ __volatile__("" ::: "memory");
+        } while (page->lock != seq);
+        if (index)
+        {
+            return count;
+        }
+    }
+#endif
+    uint64 count = 0;
+    if (read(counter->fd, &count, sizeof(count)) != sizeof(count))
+    {
+        return 0;
+    }
+    return count;
+}
+
+/**
+ * Open the counters for the calling thread and reset the totals. Cycles fall back to the
+ * task clock (nanoseconds) where the PMU is not exposed, e.g. in most virtual machines.
+ *
+ * return: number of available events
+*/
+int perf_start()
+{
+    perf_stop();
+    cycles_are_task_clock = 0;
+    if (! open_counter(&counters[PERF_CYCLES], PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES))
+    {
+        cycles_are_task_clock = open_counter(&counters[PERF_CYCLES], PERF_TYPE_SOFTWARE, PERF_COUNT_SW_TASK_CLOCK);
+    }
+    open_counter(&counters[PERF_LLC_MISSES], PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES);
+    open_counter(&counters[PERF_BRANCH_MISSES], PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES);
+
+    int available = 0;
+    for (int e=0; e<NUM_PERF_EVENTS; ++e)
+    {
+        available += counters[e].fd >= 0;
+    }
+    perf_running = available > 0;
+
+    // the counter reads themselves are partly counted, measure them on an empty phase
+    memset(read_overhead, 0, sizeof(read_overhead));
+    perf_reset();
+    for (int i=0; i<PERF_CALIBRATION_ROUNDS; ++i)
+    {
+        perf_phase_begin(PERF_HASH);
+        perf_phase_end(PERF_HASH);
+    }
+    for (int e=0; e<NUM_PERF_EVENTS; ++e)
+    {
+        read_overhead[e] = (double)phase_totals[PERF_HASH].events[e] / PERF_CALIBRATION_ROUNDS;
+    }
+    perf_reset();
+    return available;
+}
+
+/**
+ * Close the counters, phases are no longer measured.
+*/
+void perf_stop()
+{
+    for (int e=0; e<NUM_PERF_EVENTS; ++e)
+    {
+        if (counters[e].page != NULL)
+        {
+            munmap(counters[e].page, sysconf(_SC_PAGESIZE));
+            counters[e].page = NULL;
+        }
+        if (counters[e].fd >= 0)
+        {
+            close(counters[e].fd);
+            counters[e].fd = -1;
+        }
+    }
+    perf_running = 0;
+}
+
+/**
+ * Zero the totals of all phases.
+*/
+void perf_reset()
+{
+    memset(phase_totals, 0, sizeof(phase_totals));
+}
+
+int perf_event_available(PerfEvent event)
+{
+    return counters[event].fd >= 0;
+}
+
+const char *perf_event_name(PerfEvent event)
+{
+    return event == PERF_CYCLES && cycles_are_task_clock ? "task_clock_ns" : PERF_EVENT_NAMES[event];
+}
+
+const char *perf_phase_name(PerfPhase phase)
+{
+    return PERF_PHASE_NAMES[phase];
+}
+
+/**
+ * Totals of a phase since the last reset, without the calibrated cost of the counter reads.
+ *
+ * phase: phase of filter operations
+ * totals: pointer to the PerfTotals to be filled
+*/
+void perf_phase_totals(PerfPhase phase, PerfTotals *totals)
+{
+    *totals = phase_totals[phase];
+    for (int e=0; e<NUM_PERF_EVENTS; ++e)
+    {
+        double overhead = read_overhead[e] * totals->calls;
+        totals->events[e] = totals->events[e] > overhead ? totals->events[e] - (uint64)overhead : 0;
+    }
+}
+
+void perf_phase_begin(PerfPhase phase)
+{
+    if (! perf_running)
+    {
+        return;
+    }
+    // cycles are read last here and first in perf_phase_end, so the other reads stay out of them
+    for (int e=NUM_PERF_EVENTS-1; e>=0; --e)
+    {
+        if (counters[e].fd >= 0)
+        {
+            phase_start[phase][e] = read_counter(&counters[e]);
+        }
+    }
+}
+
+void perf_phase_end(PerfPhase phase)
+{
+    if (! perf_running)
+    {
+        return;
+    }
+    for (int e=0; e<NUM_PERF_EVENTS; ++e)
+    {
+        if (counters[e].fd >= 0)
+        {
+            phase_totals[phase].events[e] += read_counter(&counters[e]) - phase_start[phase][e];
+        }
+    }
+    phase_totals[phase].calls++;
+}
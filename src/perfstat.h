@@ -0,0 +1,51 @@
+#ifndef PERFSTAT_H
+#define PERFSTAT_H
+
+#include "./bitutils.h"
+
+// Hardware counters attributed to the phases of filter operations. Compiled in with
+// -DSLBF_PERF (make PERF=1), otherwise PERF_BEGIN/PERF_END expand to nothing.
+// Counters follow the thread that called perf_start; phases must not nest.
+typedef enum PerfPhase
+{
+    PERF_HASH,      // gen_k_hash
+    PERF_DECREMENT, // SBF decrements, random indices or range
+    PERF_SET_MAX,   // setting counters to max (bits for BF)
+    PERF_MODEL,     // model inference of learned filters
+    PERF_INTERVAL,  // GSLBF group lookup
+    NUM_PERF_PHASES
+} PerfPhase;
+
+typedef enum PerfEvent
+{
+    PERF_CYCLES,        // CPU cycles, task clock nanoseconds when the PMU is not available
+    PERF_LLC_MISSES,
+    PERF_BRANCH_MISSES,
+    NUM_PERF_EVENTS
+} PerfEvent;
+
+typedef struct PerfTotals
+{
+    uint64 calls;
+    uint64 events[NUM_PERF_EVENTS];
+} PerfTotals;
+
+int perf_start();
+void perf_stop();
+void perf_reset();
+int perf_event_available(PerfEvent event);
+const char *perf_event_name(PerfEvent event);
+const char *perf_phase_name(PerfPhase phase);
+void perf_phase_totals(PerfPhase phase, PerfTotals *totals);
+void perf_phase_begin(PerfPhase phase);
+void perf_phase_end(PerfPhase phase);
+
+#ifdef SLBF_PERF
+#define PERF_BEGIN(phase) perf_phase_begin(phase)
+#define PERF_END(phase) perf_phase_end(phase)
+#else
+#define PERF_BEGIN(phase) ((void)0)
+#define PERF_END(phase) ((void)0)
+#endif
+
+#endif
@@ -0,0 +1,582 @@
+#include "../include/xxhash.h"
+#include "./persist.h"
+
+#include "stdio.h"
+#include "stdlib.h"
+#include "string.h"
+#include "time.h"
+#include "fcntl.h"
+#include "unistd.h"
+#include "sys/mman.h"
+#include "sys/stat.h"
+#include "sys/wait.h"
+
+#define FILTER_BYTE_ORDER 0x01020304 // reads back differently on a foreign-endian machine
+
+
+// Fixed part of the header, followed by num_sections FileSection records and two arrays
+// of num_tau floats (tau, raw tau). The whole header is padded to a page.
+typedef struct FileHeader
+{
+    char magic[8];
+    uint32 version;
+    uint32 kind;
+    uint32 byte_order;
+    uint32 num_sections;
+    uint32 isaac_bytes;      // sizeof(isaac_ctx) of the writer, the ISAAC state is stored raw
+    uint32 num_tau;          // 1 for an SSLBF, g + 1 for a GSLBF, 0 otherwise
+    uint64 header_bytes;
+    uint64 file_bytes;
+    uint64 payload_checksum; // XXH64 chained over the counter payloads in section order
+    uint64 header_checksum;  // XXH64 of the header_bytes bytes with this field zeroed
+    // model reference of learned filters
+    int model_type;
+    int order;
+    char model_path[FILTER_PATH_BYTES];
+} FileHeader;
+
+// One counter array and the state of the filter using it
+typedef struct FileSection
+{
+    uint64 offset; // payload position in the file, a multiple of FILTER_PAGE_BYTES
+    uint64 bytes;  // payload length, num_bins * sizeof(uint32)
+    uint64 size;
+    uint64 zero_count;
+    int bits_per_counter;
+    int layout;
+    int K;
+    int P;
+    int hash_mode;
+    int decrement_mode;
+    int rng;
+    int block_pos;
+    uint64 wyrand_state;
+    uint64 index_block[RNG_BLOCK];
+    isaac_ctx isaac;
+} FileSection;
+
+
+static uint64 round_to_page(uint64 bytes)
+{
+    return (bytes + FILTER_PAGE_BYTES - 1) / FILTER_PAGE_BYTES * FILTER_PAGE_BYTES;
+}
+
+static FileSection *file_sections(FileHeader *header)
+{
+    return (FileSection *)(header + 1);
+}
+
+static float *file_taus(FileHeader *header)
+{
+    return (float *)(file_sections(header) + header->num_sections);
+}
+
+static uint64 header_checksum(FileHeader *header)
+{
+    FileHeader fixed = *header;
+    fixed.header_checksum = 0;
+    uint64 seed = XXH64(&fixed, sizeof(FileHeader), 0);
+    return XXH64(header + 1, header->header_bytes - sizeof(FileHeader), seed);
+}
+
+static FileHeader *new_file_header(FilterKind kind, int num_sections, int num_tau)
+{
+    uint64 used = sizeof(FileHeader) + num_sections * sizeof(FileSection) + 2 * num_tau * sizeof(float);
+    uint64 header_bytes = round_to_page(used);
+    FileHeader *header = (FileHeader *)calloc(1, header_bytes);
+    memcpy(header->magic, FILTER_FILE_MAGIC, sizeof(header->magic));
+    header->version = FILTER_FILE_VERSION;
+    header->kind = kind;
+    header->byte_order = FILTER_BYTE_ORDER;
+    header->num_sections = num_sections;
+    header->isaac_bytes = sizeof(isaac_ctx);
+    header->num_tau = num_tau;
+    header->header_bytes = header_bytes;
+    return header;
+}
+
+static void set_model_reference(FileHeader *header, Model *model, QueryOrder order, const char *model_path)
+{
+    if (model_path == NULL || strlen(model_path) >= FILTER_PATH_BYTES)
+    {
+        printf("A model path shorter than %d bytes is needed to save a learned filter.\n", FILTER_PATH_BYTES);
+        exit(1);
+    }
+    header->model_type = model->type;
+    header->order = order;
+    strcpy(header->model_path, model_path);
+}
+
+static void section_from_counters(FileSection *section, CounterBitSet *counters)
+{
+    section->bytes = counters->num_bins * sizeof(uint32);
+    section->size = counters->size;
+    section->zero_count = counters->zero_count;
+    section->bits_per_counter = counters->bits_per_counter;
+    section->layout = counters->layout;
+}
+
+static void section_from_sbf(FileSection *section, SBF *sbf)
+{
+    section_from_counters(section, &(sbf->counters));
+    section->K = sbf->K;
+    section->P = sbf->P;
+    section->hash_mode = sbf->hash_mode;
+    section->decrement_mode = sbf->decrement_mode;
+    section->rng = sbf->rng;
+    section->block_pos = sbf->block_pos;
+    section->wyrand_state = sbf->wyrand.state;
+    memcpy(section->index_block, sbf->index_block, RNG_BLOCK * sizeof(uint64));
+    section->isaac = sbf->isaac;
+}
+
+/**
+ * Lay the payloads out after the header, checksum everything and write the file.
+ *
+ * path: file to be written
+ * header: header with sections and thresholds filled in, offsets and checksums are set here
+ * payloads: counter array of each section
+*/
+static void write_filter_file(const char *path, FileHeader *header, uint32 **payloads)
+{
+    FileSection *sections = file_sections(header);
+    uint64 offset = header->header_bytes;
+    uint64 checksum = 0;
+    for (uint32 i=0; i<header->num_sections; ++i)
+    {
+        sections[i].offset = offset;
+        offset += round_to_page(sections[i].bytes);
+        checksum = XXH64(payloads[i], sections[i].bytes, checksum);
+    }
+    header->file_bytes = offset;
+    header->payload_checksum = checksum;
+    header->header_checksum = header_checksum(header);
+
+    FILE *fp = fopen(path, "wb");
+    if (fp == NULL)
+    {
+        printf("Write file %s failed.\n", path);
+        exit(1);
+    }
+    static const char zeros[FILTER_PAGE_BYTES];
+    int ok = fwrite(header, 1, header->header_bytes, fp) == header->header_bytes;
+    for (uint32 i=0; ok && i<header->num_sections; ++i)
+    {
+        uint64 padding = round_to_page(sections[i].bytes) - sections[i].bytes;
+        ok = fwrite(payloads[i], 1, sections[i].bytes, fp) == sections[i].bytes
+            && fwrite(zeros, 1, padding, fp) == padding;
+    }
+    if (fclose(fp) != 0 || ! ok)
+    {
+        printf("Write file %s failed.\n", path);
+        exit(1);
+    }
+}
+
+/**
+ * Map a filter file and check its header. The payload checksum is only checked with
+ * verify set, since it reads every page of the file.
+ *
+ * path: file to be opened
+ * kind: expected filter kind
+ * mapping: pointer to the FilterMapping to be filled
+ * verify: check the payload checksum
+*/
+static FileHeader *map_filter_file(const char *path, FilterKind kind, FilterMapping *mapping, int verify)
+{
+    int fd = open(path, O_RDONLY);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) != 0)
+    {
+        printf("Read file %s failed.\n", path);
+        exit(1);
+    }
+    if ((uint64)st.st_size < sizeof(FileHeader))
+    {
+        printf("%s is not a filter file.\n", path);
+        exit(1);
+    }
+    // private and writable: the filter can keep being updated without touching the file
+    void *base = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (base == MAP_FAILED)
+    {
+        printf("Mapping %s failed.\n", path);
+        exit(1);
+    }
+    mapping->base = base;
+    mapping->length = st.st_size;
+
+    FileHeader *header = (FileHeader *)base;
+    if (memcmp(header->magic, FILTER_FILE_MAGIC, sizeof(header->magic)))
+    {
+        printf("%s is not a filter file.\n", path);
+        exit(1);
+    }
+    if (header->version != FILTER_FILE_VERSION || header->byte_order != FILTER_BYTE_ORDER
+        || header->isaac_bytes != sizeof(isaac_ctx))
+    {
+        printf("%s was written by an incompatible version or machine (version %u).\n", path, header->version);
+        exit(1);
+    }
+    if (header->file_bytes != mapping->length || header->header_bytes > mapping->length
+        || sizeof(FileHeader) + header->num_sections * sizeof(FileSection) + 2 * header->num_tau * sizeof(float) > header->header_bytes
+        || header_checksum(header) != header->header_checksum)
+    {
+        printf("%s is truncated or its header is corrupted.\n", path);
+        exit(1);
+    }
+    if (header->kind != kind)
+    {
+        printf("%s holds filter kind %u, %d expected.\n", path, header->kind, kind);
+        exit(1);
+    }
+
+    FileSection *sections = file_sections(header);
+    uint64 checksum = 0;
+    for (uint32 i=0; i<header->num_sections; ++i)
+    {
+        if (sections[i].offset % FILTER_PAGE_BYTES || sections[i].offset + sections[i].bytes > mapping->length)
+        {
+            printf("%s has an invalid payload offset.\n", path);
+            exit(1);
+        }
+        if (verify)
+        {
+            checksum = XXH64((char *)base + sections[i].offset, sections[i].bytes, checksum);
+        }
+    }
+    if (verify && checksum != header->payload_checksum)
+    {
+        printf("%s payload checksum mismatch.\n", path);
+        exit(1);
+    }
+
+    // counters are probed at hashed positions, read-ahead would only load unused pages
+    madvise(base, mapping->length, MADV_RANDOM);
+    return header;
+}
+
+static void counters_from_section(CounterBitSet *counters, FileSection *section, FilterMapping *mapping)
+{
+    counters->raw_bits = (uint32 *)((char *)mapping->base + section->offset);
+    counters->size = section->size;
+    counters->bits_per_counter = section->bits_per_counter;
+    counters->num_bins = section->bytes / sizeof(uint32);
+    counters->layout = section->layout;
+    counters->counters_per_bin = BIN_BITS / section->bits_per_counter;
+    counters->zero_count = section->zero_count;
+    counters->borrowed = 1;
+}
+
+static void sbf_from_section(SBF *sbf, FileSection *section, FilterMapping *mapping)
+{
+    CounterBitSet counters;
+    counters_from_section(&counters, section, mapping);
+
+    SBFOptions options;
+    options.layout = section->layout;
+    options.hash_mode = section->hash_mode;
+    options.decrement_mode = section->decrement_mode;
+    options.rng = section->rng;
+    init_sbf_with_counters(sbf, section->P, section->K, &counters, &options);
+
+    // continue the random streams where the saved filter stopped
+    sbf->isaac = section->isaac;
+    sbf->wyrand.state = section->wyrand_state;
+    memcpy(sbf->index_block, section->index_block, RNG_BLOCK * sizeof(uint64));
+    sbf->block_pos = section->block_pos;
+}
+
+static void model_from_header(Model *model, FileHeader *header)
+{
+    char model_path[FILTER_PATH_BYTES];
+    memcpy(model_path, header->model_path, FILTER_PATH_BYTES);
+    model_path[FILTER_PATH_BYTES - 1] = '\0';
+    // load_model reuses a CatBoost handle when there is one, the caller's model is not initialized
+    memset(model, 0, sizeof(Model));
+    load_model(model, header->model_type, model_path);
+}
+
+
+/**
+ * Save a Bloom filter.
+ *
+ * bf: pointer to a BF
+ * path: file to be written
+*/
+void save_bf(BF *bf, const char *path)
+{
+    FileHeader *header = new_file_header(FILTER_BF, 1, 0);
+    FileSection *section = file_sections(header);
+    section_from_counters(section, &(bf->bitset));
+    section->K = bf->K;
+    section->hash_mode = bf->hash_mode;
+
+    uint32 *payloads[1] = {bf->bitset.raw_bits};
+    write_filter_file(path, header, payloads);
+    free(header);
+}
+
+/**
+ * Open a Bloom filter saved by save_bf. Its bits stay in the mapping and are paged in
+ * by the first queries that touch them.
+ * Release with free_bf, then close_filter_mapping.
+ *
+ * bf: pointer to the BF to be initialized
+ * path: file to be opened
+ * mapping: pointer to the FilterMapping the bits live in
+ * verify: check the payload checksum (reads the whole file)
+*/
+void open_bf(BF *bf, const char *path, FilterMapping *mapping, int verify)
+{
+    FileHeader *header = map_filter_file(path, FILTER_BF, mapping, verify);
+    FileSection *section = file_sections(header);
+
+    counters_from_section(&(bf->bitset), section, mapping);
+    bf->K = section->K;
+    bf->m = section->size;
+    bf->hash_mode = section->hash_mode;
+    bf->hash_codes = (uint64 *)malloc(bf->K * sizeof(uint64));
+}
+
+/**
+ * Save a stable Bloom filter, including the state of its random streams so that an
+ * opened copy decrements exactly the counters the original would have.
+ *
+ * sbf: pointer to an SBF
+ * path: file to be written
+*/
+void save_sbf(SBF *sbf, const char *path)
+{
+    FileHeader *header = new_file_header(FILTER_SBF, 1, 0);
+    section_from_sbf(file_sections(header), sbf);
+
+    uint32 *payloads[1] = {sbf->counters.raw_bits};
+    write_filter_file(path, header, payloads);
+    free(header);
+}
+
+/**
+ * Open a stable Bloom filter saved by save_sbf.
+ * Release with free_sbf, then close_filter_mapping.
+ *
+ * sbf: pointer to the SBF to be initialized
+ * path: file to be opened
+ * mapping: pointer to the FilterMapping the counters live in
+ * verify: check the payload checksum (reads the whole file)
+*/
+void open_sbf(SBF *sbf, const char *path, FilterMapping *mapping, int verify)
+{
+    FileHeader *header = map_filter_file(path, FILTER_SBF, mapping, verify);
+    sbf_from_section(sbf, file_sections(header), mapping);
+}
+
+/**
+ * Save an SSLBF. The model itself is not stored, only its type and the path it can be
+ * loaded from.
+ *
+ * sslbf: pointer to an SSLBF
+ * path: file to be written
+ * model_path: path the model of the SSLBF was loaded from
+*/
+void save_sslbf(SSLBF *sslbf, const char *path, const char *model_path)
+{
+    FileHeader *header = new_file_header(FILTER_SSLBF, 1, 1);
+    set_model_reference(header, &(sslbf->model), sslbf->order, model_path);
+    section_from_sbf(file_sections(header), &(sslbf->sbf));
+    float *taus = file_taus(header);
+    taus[0] = sslbf->tau;
+    taus[1] = sslbf->raw_tau;
+
+    uint32 *payloads[1] = {sslbf->sbf.counters.raw_bits};
+    write_filter_file(path, header, payloads);
+    free(header);
+}
+
+/**
+ * Open an SSLBF saved by save_sslbf, loading its model from the saved model path.
+ * Release with free_sslbf, then close_filter_mapping.
+ *
+ * sslbf: pointer to the SSLBF to be initialized
+ * path: file to be opened
+ * mapping: pointer to the FilterMapping the counters live in
+ * verify: check the payload checksum (reads the whole file)
+*/
+void open_sslbf(SSLBF *sslbf, const char *path, FilterMapping *mapping, int verify)
+{
+    FileHeader *header = map_filter_file(path, FILTER_SSLBF, mapping, verify);
+    if (header->num_tau != 1 || header->num_sections != 1)
+    {
+        printf("%s has %u thresholds and %u sections, 1 and 1 expected.\n", path, header->num_tau, header->num_sections);
+        exit(1);
+    }
+
+    sbf_from_section(&(sslbf->sbf), file_sections(header), mapping);
+    model_from_header(&(sslbf->model), header);
+    float *taus = file_taus(header);
+    sslbf->tau = taus[0];
+    sslbf->raw_tau = taus[1];
+    sslbf->order = header->order;
+    memset(&(sslbf->stats), 0, sizeof(QueryStats));
+}
+
+/**
+ * Save a GSLBF, one payload per group SBF.
+ *
+ * gslbf: pointer to a GSLBF
+ * path: file to be written
+ * model_path: path the model of the GSLBF was loaded from
+*/
+void save_gslbf(GSLBF *gslbf, const char *path, const char *model_path)
+{
+    int g = gslbf->g;
+    FileHeader *header = new_file_header(FILTER_GSLBF, g, g + 1);
+    set_model_reference(header, &(gslbf->model), MODEL_FIRST, model_path);
+
+    uint32 **payloads = (uint32 **)malloc(g * sizeof(uint32 *));
+    FileSection *sections = file_sections(header);
+    for (int i=0; i<g; ++i)
+    {
+        section_from_sbf(&(sections[i]), &(gslbf->SBF_array[i]));
+        payloads[i] = gslbf->SBF_array[i].counters.raw_bits;
+    }
+    float *taus = file_taus(header);
+    memcpy(taus, gslbf->tau_array, (g + 1) * sizeof(float));
+    memcpy(taus + g + 1, gslbf->raw_tau_array, (g + 1) * sizeof(float));
+
+    write_filter_file(path, header, payloads);
+    free(payloads);
+    free(header);
+}
+
+/**
+ * Open a GSLBF saved by save_gslbf, loading its model from the saved model path.
+ * Release with free_gslbf, then close_filter_mapping.
+ *
+ * gslbf: pointer to the GSLBF to be initialized
+ * path: file to be opened
+ * mapping: pointer to the FilterMapping the counters live in
+ * verify: check the payload checksum (reads the whole file)
+*/
+void open_gslbf(GSLBF *gslbf, const char *path, FilterMapping *mapping, int verify)
+{
+    FileHeader *header = map_filter_file(path, FILTER_GSLBF, mapping, verify);
+    int g = header->num_sections;
+    if (header->num_tau != (uint32)g + 1)
+    {
+        printf("%s has %u thresholds for %d groups.\n", path, header->num_tau, g);
+        exit(1);
+    }
+
+    gslbf->SBF_array = (SBF *)malloc(g * sizeof(SBF));
+    FileSection *sections = file_sections(header);
+    for (int i=0; i<g; ++i)
+    {
+        sbf_from_section(&(gslbf->SBF_array[i]), &(sections[i]), mapping);
+    }
+    model_from_header(&(gslbf->model), header);
+
+    // one block for both arrays: raw_tau_array first since free_gslbf releases it,
+    // tau_array is caller-owned for an initialized GSLBF and never freed
+    float *taus = file_taus(header);
+    gslbf->raw_tau_array = (float *)malloc(2 * (g + 1) * sizeof(float));
+    gslbf->tau_array = gslbf->raw_tau_array + g + 1;
+    memcpy(gslbf->raw_tau_array, taus + g + 1, (g + 1) * sizeof(float));
+    memcpy(gslbf->tau_array, taus, (g + 1) * sizeof(float));
+    gslbf->g = g;
+}
+
+/**
+ * Unmap a file opened by one of the open_* functions, after the filter was freed.
+ *
+ * mapping: pointer to a FilterMapping
+*/
+void close_filter_mapping(FilterMapping *mapping)
+{
+    if (mapping->base != NULL)
+    {
+        munmap(mapping->base, mapping->length);
+        mapping->base = NULL;
+        mapping->length = 0;
+    }
+}
+
+static double snapshot_now()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+/**
+ * Start writing a snapshot of a live SBF in the background. The process forks and the
+ * child saves its copy-on-write view of the filter (counters, RNG state) to path + ".tmp",
+ * then renames it over path, so path always holds a complete snapshot. The caller is only
+ * stopped for the fork, whose cost grows with the page tables of the process; afterwards
+ * its first write to each page pays one page copy.
+ * With concurrent writers the snapshot is the state at the fork: inserts in flight on
+ * other threads may be partly applied, as a concurrent reader would see them. Only the
+ * SBF's own random streams are saved, not those of its SBFWriters, which live outside the
+ * SBF: a restored filter answers like the live one at the fork, but inserts into it
+ * decrement other counters than the writers would have. Seed new writers for it with
+ * init_sbf_writer as usual.
+ *
+ * sbf: pointer to an SBF
+ * path: file to be written
+ * snapshot: pointer to the FilterSnapshot to be filled, check it with poll_filter_snapshot
+*/
+void start_sbf_snapshot(SBF *sbf, const char *path, FilterSnapshot *snapshot)
+{
+    char *tmp_path = (char *)malloc(strlen(path) + 5);
+    sprintf(tmp_path, "%s.tmp", path);
+    // buffered output would otherwise be written twice, once by the child
+    fflush(NULL);
+
+    double start = snapshot_now();
+    pid_t pid = fork();
+    if (pid == 0)
+    {
+        // relaxed atomic updates from other threads can leave zero_count off by the
+        // inserts in flight, the frozen copy can afford an exact recount
+        sbf->counters.zero_count = count_zero_counters(&(sbf->counters));
+        save_sbf(sbf, tmp_path);
+        _exit(rename(tmp_path, path) == 0 ? 0 : 1);
+    }
+    snapshot->pause = snapshot_now() - start;
+    free(tmp_path);
+    if (pid < 0)
+    {
+        printf("Snapshot of %s failed: fork failed.\n", path);
+        exit(1);
+    }
+    snapshot->pid = pid;
+    snapshot->status = 0;
+    snapshot->started = start;
+    snapshot->duration = 0;
+}
+
+/**
+ * Check whether a snapshot has been written, reaping its writer process when done.
+ * 
+ * snapshot: pointer to a FilterSnapshot started by start_sbf_snapshot
+ * block: wait for the writer to finish
+ * return: 1 written, -1 failed, 0 still running
+*/
+int poll_filter_snapshot(FilterSnapshot *snapshot, int block)
+{
+    if (snapshot->pid == 0)
+    {
+        return snapshot->status;
+    }
+    int wstatus;
+    pid_t done = waitpid(snapshot->pid, &wstatus, block ? 0 : WNOHANG);
+    if (done == 0)
+    {
+        return 0;
+    }
+    snapshot->duration = snapshot_now() - snapshot->started;
+    snapshot->status = done == snapshot->pid && WIFEXITED(wstatus) && WEXITSTATUS(wstatus) == 0 ? 1 : -1;
+    snapshot->pid = 0;
+    return snapshot->status;
+}
@@ -0,0 +1,55 @@
+#ifndef PERSIST_H
+#define PERSIST_H
+
+#include "./filters.h"
+#include "sys/types.h"
+
+// On-disk filter format: a header with the filter parameters, RNG state, thresholds and
+// model reference, followed by one counter payload per bit/counter array. Payloads start
+// on FILTER_PAGE_BYTES boundaries so an opened file is used in place through mmap.
+#define FILTER_FILE_MAGIC "SLBFFILT"
+#define FILTER_FILE_VERSION 1
+#define FILTER_PAGE_BYTES 4096
+#define FILTER_PATH_BYTES 256
+
+typedef enum FilterKind
+{
+    FILTER_BF,
+    FILTER_SBF,
+    FILTER_SSLBF,
+    FILTER_GSLBF
+} FilterKind;
+
+// A file mapped by one of the open_* functions. Counters of the opened filter point into
+// it, so it must outlive the filter. The mapping is private: inserts into an opened filter
+// copy the touched pages and never reach the file, save the filter again to persist them.
+typedef struct FilterMapping
+{
+    void *base;
+    uint64 length;
+} FilterMapping;
+
+void save_bf(BF *bf, const char *path);
+void open_bf(BF *bf, const char *path, FilterMapping *mapping, int verify);
+void save_sbf(SBF *sbf, const char *path);
+void open_sbf(SBF *sbf, const char *path, FilterMapping *mapping, int verify);
+void save_sslbf(SSLBF *sslbf, const char *path, const char *model_path);
+void open_sslbf(SSLBF *sslbf, const char *path, FilterMapping *mapping, int verify);
+void save_gslbf(GSLBF *gslbf, const char *path, const char *model_path);
+void open_gslbf(GSLBF *gslbf, const char *path, FilterMapping *mapping, int verify);
+void close_filter_mapping(FilterMapping *mapping);
+
+// Snapshot of a live SBF written by a forked child from its copy-on-write view of memory
+typedef struct FilterSnapshot
+{
+    pid_t pid;        // writer process, 0 once it has been reaped
+    int status;       // 1 written, -1 failed, 0 still running
+    double started;
+    double pause;     // seconds the caller was stopped for, i.e. the fork
+    double duration;  // seconds from the fork until the file was complete, set on completion
+} FilterSnapshot;
+
+void start_sbf_snapshot(SBF *sbf, const char *path, FilterSnapshot *snapshot);
+int poll_filter_snapshot(FilterSnapshot *snapshot, int block);
+
+#endif
@@ -0,0 +1,33 @@
+#include "./rng.h"
+
+/**
+ * Seed a wyrand generator.
+ * 
+ * rng: pointer to a WyRand
+ * seed: any 64-bit value
+*/
+void wyrand_seed(WyRand *rng, uint64 seed)
+{
+    rng->state = seed;
+}
+
+/**
+ * Generate n outputs in [0, bound), same as n calls of wyrand_next_bounded. Every output is
+ * computed from the block's base state, so the iterations are independent and pipeline
+ * (or vectorize) instead of waiting on each other.
+ * 
+ * rng: pointer to a WyRand
+ * bound: exclusive upper bound of the outputs
+ * out: pointer to n outputs to be stored
+ * n: number of outputs
+*/
+void wyrand_fill_bounded(WyRand *rng, uint64 bound, uint64 *out, int n)
+{
+    uint64 base = rng->state;
+    for (int i=0; i<n; ++i)
+    {
+        uint64 r = wyrand_mix(base + (uint64)(i + 1) * WYRAND_INCREMENT);
+        out[i] = ((unsigned __int128)r * bound) >> 64;
+    }
+    rng->state = base + (uint64)n * WYRAND_INCREMENT;
+}
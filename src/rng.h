@@ -0,0 +1,51 @@
+#ifndef RNG_H
+#define RNG_H
+
+#include "./bitutils.h"
+
+#define RNG_BLOCK 64 // bounded outputs generated per refill
+
+typedef enum RngMode
+{
+    RNG_ISAAC, // ISAAC with rejection sampling, reproduces existing experiments
+    RNG_WYRAND // wyrand with multiply-shift bounding, generated in blocks
+} RngMode;
+
+// wyrand: a Weyl sequence finalized by a 64x64->128 multiply. The output of step i only
+// depends on state + i * increment, so a block of outputs has no loop-carried dependency.
+typedef struct WyRand
+{
+    uint64 state;
+} WyRand;
+
+#define WYRAND_INCREMENT 0xa0761d6478bd642fULL
+#define WYRAND_MIX 0xe7037ed1a0b428dbULL
+
+void wyrand_seed(WyRand *rng, uint64 seed);
+void wyrand_fill_bounded(WyRand *rng, uint64 bound, uint64 *out, int n);
+
+static inline uint64 wyrand_mix(uint64 s)
+{
+    unsigned __int128 product = (unsigned __int128)s * (s ^ WYRAND_MIX);
+    return (uint64)(product >> 64) ^ (uint64)product;
+}
+
+/**
+ * Next 64-bit output.
+*/
+static inline uint64 wyrand_next(WyRand *rng)
+{
+    rng->state += WYRAND_INCREMENT;
+    return wyrand_mix(rng->state);
+}
+
+/**
+ * Next output in [0, bound), reduced with multiply-shift instead of a modulo. The bias is
+ * below bound / 2^64, negligible for counter indices.
+*/
+static inline uint64 wyrand_next_bounded(WyRand *rng, uint64 bound)
+{
+    return ((unsigned __int128)wyrand_next(rng) * bound) >> 64;
+}
+
+#endif
@@ -0,0 +1,317 @@
+#include "stdio.h"
+
+#include "./simd.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define SIMD_X86
+#endif
+
+#define DOT_BATCH_ROWS 4
+
+typedef float (*DotKernel)(const float *a, const float *b, int n);
+typedef void (*DotBatchKernel)(const float **rows, const float *w, int num_rows, int n, float *out);
+
+static int simd_initialized = 0;
+static SimdLevel current_level = SIMD_SCALAR;
+static DotKernel dot_kernel = NULL;
+static DotBatchKernel dot_batch_kernel = NULL;
+
+
+static float dot_scalar(const float *a, const float *b, int n)
+{
+    float sum = 0;
+    for (int i=0; i<n; ++i)
+    {
+        sum += a[i] * b[i];
+    }
+    return sum;
+}
+
+static void dot_batch_rows(const float **rows, const float *w, int num_rows, int n, float *out)
+{
+    for (int r=0; r<num_rows; ++r)
+    {
+        out[r] = dot_kernel(rows[r], w, n);
+    }
+}
+
+#ifdef SIMD_X86
+
+__attribute__((target("sse2")))
+static float dot_sse(const float *a, const float *b, int n)
+{
+    __m128 acc0 = _mm_setzero_ps();
+    __m128 acc1 = _mm_setzero_ps();
+    int i = 0;
+    for (; i + 8 <= n; i += 8)
+    {
+        acc0 = _mm_add_ps(acc0, _mm_mul_ps(_mm_loadu_ps(a + i), _mm_loadu_ps(b + i)));
+        acc1 = _mm_add_ps(acc1, _mm_mul_ps(_mm_loadu_ps(a + i + 4), _mm_loadu_ps(b + i + 4)));
+    }
+    float lanes[4];
+    _mm_storeu_ps(lanes, _mm_add_ps(acc0, acc1));
+    float sum = lanes[0] + lanes[1] + lanes[2] + lanes[3];
+    for (; i<n; ++i)
+    {
+        sum += a[i] * b[i];
+    }
+    return sum;
+}
+
+__attribute__((target("avx2,fma")))
+static inline float hsum_avx(__m256 v)
+{
+    __m128 s = _mm_add_ps(_mm256_castps256_ps128(v), _mm256_extractf128_ps(v, 1));
+    s = _mm_add_ps(s, _mm_movehl_ps(s, s));
+    s = _mm_add_ss(s, _mm_shuffle_ps(s, s, 1));
+    return _mm_cvtss_f32(s);
+}
+
+__attribute__((target("avx2,fma")))
+static float dot_avx2(const float *a, const float *b, int n)
+{
+    __m256 acc0 = _mm256_setzero_ps();
+    __m256 acc1 = _mm256_setzero_ps();
+    __m256 acc2 = _mm256_setzero_ps();
+    __m256 acc3 = _mm256_setzero_ps();
+    int i = 0;
+    for (; i + 32 <= n; i += 32)
+    {
+        acc0 = _mm256_fmadd_ps(_mm256_loadu_ps(a + i), _mm256_loadu_ps(b + i), acc0);
+        acc1 = _mm256_fmadd_ps(_mm256_loadu_ps(a + i + 8), _mm256_loadu_ps(b + i + 8), acc1);
+        acc2 = _mm256_fmadd_ps(_mm256_loadu_ps(a + i + 16), _mm256_loadu_ps(b + i + 16), acc2);
+        acc3 = _mm256_fmadd_ps(_mm256_loadu_ps(a + i + 24), _mm256_loadu_ps(b + i + 24), acc3);
+    }
+    for (; i + 8 <= n; i += 8)
+    {
+        acc0 = _mm256_fmadd_ps(_mm256_loadu_ps(a + i), _mm256_loadu_ps(b + i), acc0);
+    }
+    float sum = hsum_avx(_mm256_add_ps(_mm256_add_ps(acc0, acc1), _mm256_add_ps(acc2, acc3)));
+    for (; i<n; ++i)
+    {
+        sum += a[i] * b[i];
+    }
+    return sum;
+}
+
+/**
+ * Score DOT_BATCH_ROWS rows per pass so that each weight vector load is shared by all of them.
+*/
+__attribute__((target("avx2,fma")))
+static void dot_batch_avx2(const float **rows, const float *w, int num_rows, int n, float *out)
+{
+    int r = 0;
+    for (; r + DOT_BATCH_ROWS <= num_rows; r += DOT_BATCH_ROWS)
+    {
+        const float *r0 = rows[r], *r1 = rows[r + 1], *r2 = rows[r + 2], *r3 = rows[r + 3];
+        __m256 acc0 = _mm256_setzero_ps();
+        __m256 acc1 = _mm256_setzero_ps();
+        __m256 acc2 = _mm256_setzero_ps();
+        __m256 acc3 = _mm256_setzero_ps();
+        int i = 0;
+        for (; i + 8 <= n; i += 8)
+        {
+            __m256 wv = _mm256_loadu_ps(w + i);
+            acc0 = _mm256_fmadd_ps(_mm256_loadu_ps(r0 + i), wv, acc0);
+            acc1 = _mm256_fmadd_ps(_mm256_loadu_ps(r1 + i), wv, acc1);
+            acc2 = _mm256_fmadd_ps(_mm256_loadu_ps(r2 + i), wv, acc2);
+            acc3 = _mm256_fmadd_ps(_mm256_loadu_ps(r3 + i), wv, acc3);
+        }
+        float s0 = hsum_avx(acc0), s1 = hsum_avx(acc1), s2 = hsum_avx(acc2), s3 = hsum_avx(acc3);
+        for (; i<n; ++i)
+        {
+            s0 += r0[i] * w[i];
+            s1 += r1[i] * w[i];
+            s2 += r2[i] * w[i];
+            s3 += r3[i] * w[i];
+        }
+        out[r] = s0;
+        out[r + 1] = s1;
+        out[r + 2] = s2;
+        out[r + 3] = s3;
+    }
+    for (; r<num_rows; ++r)
+    {
+        out[r] = dot_avx2(rows[r], w, n);
+    }
+}
+
+__attribute__((target("avx512f")))
+static float dot_avx512(const float *a, const float *b, int n)
+{
+    __m512 acc0 = _mm512_setzero_ps();
+    __m512 acc1 = _mm512_setzero_ps();
+    int i = 0;
+    for (; i + 32 <= n; i += 32)
+    {
+        acc0 = _mm512_fmadd_ps(_mm512_loadu_ps(a + i), _mm512_loadu_ps(b + i), acc0);
+        acc1 = _mm512_fmadd_ps(_mm512_loadu_ps(a + i + 16), _mm512_loadu_ps(b + i + 16), acc1);
+    }
+    for (; i + 16 <= n; i += 16)
+    {
+        acc0 = _mm512_fmadd_ps(_mm512_loadu_ps(a + i), _mm512_loadu_ps(b + i), acc0);
+    }
+    if (i < n)
+    {
+        __mmask16 tail = (__mmask16)((1U << (n - i)) - 1);
+        acc1 = _mm512_fmadd_ps(_mm512_maskz_loadu_ps(tail, a + i), _mm512_maskz_loadu_ps(tail, b + i), acc1);
+    }
+    return _mm512_reduce_add_ps(_mm512_add_ps(acc0, acc1));
+}
+
+/**
+ * Score DOT_BATCH_ROWS rows per pass so that each weight vector load is shared by all of them.
+*/
+__attribute__((target("avx512f")))
+static void dot_batch_avx512(const float **rows, const float *w, int num_rows, int n, float *out)
+{
+    int r = 0;
+    for (; r + DOT_BATCH_ROWS <= num_rows; r += DOT_BATCH_ROWS)
+    {
+        const float *r0 = rows[r], *r1 = rows[r + 1], *r2 = rows[r + 2], *r3 = rows[r + 3];
+        __m512 acc0 = _mm512_setzero_ps();
+        __m512 acc1 = _mm512_setzero_ps();
+        __m512 acc2 = _mm512_setzero_ps();
+        __m512 acc3 = _mm512_setzero_ps();
+        for (int i=0; i<n; i+=16)
+        {
+            __mmask16 lanes = n - i >= 16 ? (__mmask16)0xffff : (__mmask16)((1U << (n - i)) - 1);
+            __m512 wv = _mm512_maskz_loadu_ps(lanes, w + i);
+            acc0 = _mm512_fmadd_ps(_mm512_maskz_loadu_ps(lanes, r0 + i), wv, acc0);
+            acc1 = _mm512_fmadd_ps(_mm512_maskz_loadu_ps(lanes, r1 + i), wv, acc1);
+            acc2 = _mm512_fmadd_ps(_mm512_maskz_loadu_ps(lanes, r2 + i), wv, acc2);
+            acc3 = _mm512_fmadd_ps(_mm512_maskz_loadu_ps(lanes, r3 + i), wv, acc3);
+        }
+        out[r] = _mm512_reduce_add_ps(acc0);
+        out[r + 1] = _mm512_reduce_add_ps(acc1);
+        out[r + 2] = _mm512_reduce_add_ps(acc2);
+        out[r + 3] = _mm512_reduce_add_ps(acc3);
+    }
+    for (; r<num_rows; ++r)
+    {
+        out[r] = dot_avx512(rows[r], w, n);
+    }
+}
+
+#endif
+
+/**
+ * Highest SIMD level supported by the running CPU.
+*/
+static SimdLevel detect_simd_level()
+{
+#ifdef SIMD_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx512f"))
+    {
+        return SIMD_AVX512;
+    }
+    if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma"))
+    {
+        return SIMD_AVX2;
+    }
+    if (__builtin_cpu_supports("sse2"))
+    {
+        return SIMD_SSE;
+    }
+#endif
+    return SIMD_SCALAR;
+}
+
+/**
+ * Install the kernels of the given level.
+*/
+static void select_kernels(SimdLevel level)
+{
+    current_level = level;
+    dot_kernel = dot_scalar;
+    dot_batch_kernel = dot_batch_rows;
+#ifdef SIMD_X86
+    switch (level)
+    {
+        case SIMD_AVX512:
+            dot_kernel = dot_avx512;
+            dot_batch_kernel = dot_batch_avx512;
+            break;
+        case SIMD_AVX2:
+            dot_kernel = dot_avx2;
+            dot_batch_kernel = dot_batch_avx2;
+            break;
+        case SIMD_SSE:
+            dot_kernel = dot_sse;
+            break;
+        default:
+            break;
+    }
+#endif
+    simd_initialized = 1;
+}
+
+/**
+ * SIMD level of the kernels in use. Detected from the CPU on first use.
+*/
+SimdLevel simd_level()
+{
+    if (! simd_initialized)
+    {
+        select_kernels(detect_simd_level());
+    }
+    return current_level;
+}
+
+/**
+ * Force a SIMD level (e.g. for benchmarking), capped at what the CPU supports.
+ *
+ * level: requested SIMD level
+*/
+void set_simd_level(SimdLevel level)
+{
+    SimdLevel supported = detect_simd_level();
+    select_kernels(level < supported ? level : supported);
+}
+
+const char *simd_level_name(SimdLevel level)
+{
+    switch (level)
+    {
+        case SIMD_AVX512: return "avx512";
+        case SIMD_AVX2: return "avx2";
+        case SIMD_SSE: return "sse";
+        default: return "scalar";
+    }
+}
+
+/**
+ * Dot product of two float vectors with the best kernel for the running CPU.
+ *
+ * a: pointer to n floats
+ * b: pointer to n floats
+ * n: vector length
+*/
+float dot_product(const float *a, const float *b, int n)
+{
+    if (! simd_initialized)
+    {
+        select_kernels(detect_simd_level());
+    }
+    return dot_kernel(a, b, n);
+}
+
+/**
+ * Dot products of many rows against one weight vector, out[r] = dot_product(rows[r], w, n).
+ *
+ * rows: array of num_rows pointers to n floats
+ * w: pointer to n weights
+ * num_rows: number of rows
+ * n: vector length
+ * out: pointer to the num_rows results to be stored
+*/
+void dot_product_batch(const float **rows, const float *w, int num_rows, int n, float *out)
+{
+    if (! simd_initialized)
+    {
+        select_kernels(detect_simd_level());
+    }
+    dot_batch_kernel(rows, w, num_rows, n, out);
+}
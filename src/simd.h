@@ -0,0 +1,18 @@
+#ifndef SIMD_H
+#define SIMD_H
+
+typedef enum SimdLevel
+{
+    SIMD_SCALAR,
+    SIMD_SSE,
+    SIMD_AVX2,
+    SIMD_AVX512
+} SimdLevel;
+
+SimdLevel simd_level();
+void set_simd_level(SimdLevel level);
+const char *simd_level_name(SimdLevel level);
+float dot_product(const float *a, const float *b, int n);
+void dot_product_batch(const float **rows, const float *w, int num_rows, int n, float *out);
+
+#endif
@@ -0,0 +1,278 @@
+#include "stdio.h"
+#include "stdlib.h"
+#include "string.h"
+#include "math.h"
+
+#include "./workload.h"
+
+
+/**
+ * Key of the index-th distinct element. splitmix64 finalizer: a bijection, so distinct
+ * indices give distinct keys, spread over the whole 64-bit range.
+*/
+static uint64 stream_key(uint64 index)
+{
+    uint64 z = index + 0x9e3779b97f4a7c15ULL;
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+    return z ^ (z >> 31);
+}
+
+/**
+ * Key of the index-th distinct element of a workload, spread over key_bits bits: splitmix64
+ * for 64-bit keys, the murmur3 finalizer for 32-bit ones. Both are bijections, so distinct
+ * indices below 2^key_bits give distinct keys.
+ *
+ * index: index of the element
+ * key_bits: 64, or 32 for keys that must fit a Data id
+*/
+uint64 workload_key(uint64 index, int key_bits)
+{
+    if (key_bits == 64)
+    {
+        return stream_key(index);
+    }
+    uint32 h = (uint32)index;
+    h ^= h >> 16;
+    h *= 0x85ebca6b;
+    h ^= h >> 13;
+    h *= 0xc2b2ae35;
+    h ^= h >> 16;
+    return h;
+}
+
+static double stream_uniform(StreamGenerator *stream)
+{
+    return (wyrand_next(&(stream->rng)) >> 11) * 0x1.0p-53;
+}
+
+static void remember_key(StreamGenerator *stream, uint64 key)
+{
+    stream->history[stream->history_pos] = key;
+    stream->history_pos = (stream->history_pos + 1) % stream->history_size;
+}
+
+/**
+ * Fill stream options with defaults: Zipf with exponent 1 over a million keys.
+ *
+ * options: pointer to StreamOptions
+*/
+void default_stream_options(StreamOptions *options)
+{
+    options->mode = STREAM_ZIPF;
+    options->universe = 1000000;
+    options->zipf_exponent = 1.0;
+    options->duplicate_ratio = 0.5;
+    options->distance = 1000;
+    options->burst_length = 100000;
+    options->hot_keys = 1000;
+    options->seed = 0;
+    options->key_bits = 64;
+}
+
+/**
+ * Init a key stream.
+ *
+ * stream: pointer to a StreamGenerator
+ * options: pointer to StreamOptions
+*/
+void init_stream(StreamGenerator *stream, StreamOptions *options)
+{
+    memset(stream, 0, sizeof(StreamGenerator));
+    stream->options = *options;
+    wyrand_seed(&(stream->rng), options->seed);
+
+    if (options->mode == STREAM_ZIPF)
+    {
+        if (options->universe == 0)
+        {
+            printf("A Zipf stream needs a non-empty universe.\n");
+            exit(1);
+        }
+        if (options->key_bits < 64 && options->universe > 1ULL << options->key_bits)
+        {
+            printf("A universe of %llu keys does not fit %d-bit keys.\n", options->universe, options->key_bits);
+            exit(1);
+        }
+        stream->zipf_cdf = (double *)malloc(options->universe * sizeof(double));
+        double sum = 0;
+        for (uint64 r=0; r<options->universe; ++r)
+        {
+            sum += pow((double)(r + 1), -options->zipf_exponent);
+            stream->zipf_cdf[r] = sum;
+        }
+        for (uint64 r=0; r<options->universe; ++r)
+        {
+            stream->zipf_cdf[r] /= sum;
+        }
+        return;
+    }
+
+    stream->history_size = options->mode == STREAM_WINDOW ? options->distance : options->hot_keys;
+    if (stream->history_size == 0 || (options->mode == STREAM_BURSTY && options->burst_length == 0))
+    {
+        printf("Window streams need a distance, bursty streams a burst length and hot keys.\n");
+        exit(1);
+    }
+    stream->history = (uint64 *)malloc(stream->history_size * sizeof(uint64));
+}
+
+/**
+ * Next key of the stream.
+ *
+ * stream: pointer to a StreamGenerator
+*/
+uint64 next_stream_key(StreamGenerator *stream)
+{
+    StreamOptions *options = &(stream->options);
+    uint64 key;
+    switch (options->mode)
+    {
+        case STREAM_ZIPF:
+        {
+            // first rank whose cumulative popularity exceeds u
+            double u = stream_uniform(stream);
+            uint64 lo = 0, hi = options->universe - 1;
+            while (lo < hi)
+            {
+                uint64 mid = lo + (hi - lo) / 2;
+                if (stream->zipf_cdf[mid] > u)
+                {
+                    hi = mid;
+                }
+                else
+                {
+                    lo = mid + 1;
+                }
+            }
+            key = workload_key(lo, options->key_bits);
+            break;
+        }
+        case STREAM_WINDOW:
+            // the ring holds the last distance keys, the oldest is next to be overwritten
+            if (stream->events >= options->distance && stream_uniform(stream) < options->duplicate_ratio)
+            {
+                key = stream->history[stream->history_pos];
+            }
+            else
+            {
+                key = workload_key(stream->next_fresh++, options->key_bits);
+            }
+            remember_key(stream, key);
+            break;
+        default:
+            if ((stream->events / options->burst_length) % 2 == 0 || stream->next_fresh == 0)
+            {
+                key = workload_key(stream->next_fresh++, options->key_bits);
+                remember_key(stream, key);
+            }
+            else
+            {
+                uint64 hot = stream->next_fresh < stream->history_size ? stream->next_fresh : stream->history_size;
+                key = stream->history[wyrand_next_bounded(&(stream->rng), hot)];
+            }
+            break;
+    }
+    stream->events++;
+    return key;
+}
+
+/**
+ * Release memory allocated to a key stream.
+ *
+ * stream: pointer to a StreamGenerator
+*/
+void free_stream(StreamGenerator *stream)
+{
+    free(stream->history);
+    free(stream->zipf_cdf);
+    stream->history = NULL;
+    stream->zipf_cdf = NULL;
+}
+
+static uint64 key_slot(KeySet *set, uint64 key)
+{
+    return stream_key(key) & (set->capacity - 1);
+}
+
+static void grow_key_set(KeySet *set)
+{
+    uint64 *old_slots = set->slots;
+    uint64 old_capacity = set->capacity;
+    set->capacity *= 2;
+    set->slots = (uint64 *)calloc(set->capacity, sizeof(uint64));
+    for (uint64 i=0; i<old_capacity; ++i)
+    {
+        if (old_slots[i])
+        {
+            uint64 slot = key_slot(set, old_slots[i]);
+            while (set->slots[slot])
+            {
+                slot = (slot + 1) & (set->capacity - 1);
+            }
+            set->slots[slot] = old_slots[i];
+        }
+    }
+    free(old_slots);
+}
+
+/**
+ * Init an exact key set.
+ *
+ * set: pointer to a KeySet
+ * expected: expected number of keys, the set grows beyond it
+*/
+void init_key_set(KeySet *set, uint64 expected)
+{
+    set->capacity = 16;
+    while (set->capacity < 2 * expected)
+    {
+        set->capacity *= 2;
+    }
+    set->slots = (uint64 *)calloc(set->capacity, sizeof(uint64));
+    set->size = 0;
+    set->has_zero = 0;
+}
+
+/**
+ * Add a key to the set.
+ *
+ * set: pointer to a KeySet
+ * key: key to be added
+ * return: 1 if the key was already in the set, 0 otherwise
+*/
+int insert_key_set(KeySet *set, uint64 key)
+{
+    if (key == 0)
+    {
+        int seen = set->has_zero;
+        set->has_zero = 1;
+        return seen;
+    }
+    uint64 slot = key_slot(set, key);
+    while (set->slots[slot])
+    {
+        if (set->slots[slot] == key)
+        {
+            return 1;
+        }
+        slot = (slot + 1) & (set->capacity - 1);
+    }
+    set->slots[slot] = key;
+    if (++set->size * 2 > set->capacity)
+    {
+        grow_key_set(set);
+    }
+    return 0;
+}
+
+/**
+ * Release memory allocated to a key set.
+ *
+ * set: pointer to a KeySet
+*/
+void free_key_set(KeySet *set)
+{
+    free(set->slots);
+    set->slots = NULL;
+}
@@ -0,0 +1,59 @@
+#ifndef WORKLOAD_H
+#define WORKLOAD_H
+
+#include "./bitutils.h"
+#include "./rng.h"
+
+// Key streams with controlled duplicate patterns, for duplicate detection experiments
+typedef enum StreamMode
+{
+    STREAM_ZIPF,   // keys drawn from a fixed universe with Zipfian popularity
+    STREAM_WINDOW, // a fraction of events repeat the key seen exactly distance events earlier
+    STREAM_BURSTY  // alternating phases: bursts of new keys, then repeats of recent keys
+} StreamMode;
+
+typedef struct StreamOptions
+{
+    StreamMode mode;
+    uint64 universe;        // zipf: number of distinct keys
+    double zipf_exponent;   // zipf: popularity of rank r is proportional to 1 / r^exponent
+    double duplicate_ratio; // window: probability of an event being a repeat
+    uint64 distance;        // window: events between a key and its repeat
+    uint64 burst_length;    // bursty: events per phase
+    uint64 hot_keys;        // bursty: quiet phases repeat the last hot_keys new keys
+    uint64 seed;
+    int key_bits;           // 64, or 32 for keys used as Data ids by learned filters
+} StreamOptions;
+
+typedef struct StreamGenerator
+{
+    StreamOptions options;
+    WyRand rng;
+    uint64 events;     // keys generated so far
+    uint64 next_fresh; // index of the next never generated key
+    uint64 *history;   // ring of recent keys, distance or hot_keys entries
+    uint64 history_size;
+    uint64 history_pos;
+    double *zipf_cdf;  // zipf: cumulative popularity of ranks 1...universe
+} StreamGenerator;
+
+uint64 workload_key(uint64 index, int key_bits);
+void default_stream_options(StreamOptions *options);
+void init_stream(StreamGenerator *stream, StreamOptions *options);
+uint64 next_stream_key(StreamGenerator *stream);
+void free_stream(StreamGenerator *stream);
+
+// Exact set of keys, the ground truth of duplicate detection
+typedef struct KeySet
+{
+    uint64 *slots; // open addressing, 0 marks an empty slot
+    uint64 capacity;
+    uint64 size;
+    int has_zero;  // key 0 is kept out of the table
+} KeySet;
+
+void init_key_set(KeySet *set, uint64 expected);
+int insert_key_set(KeySet *set, uint64 key);
+void free_key_set(KeySet *set);
+
+#endif